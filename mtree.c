@@ -0,0 +1,8661 @@
+/* Metric tree sample implementation.
+
+   This is the library, see mtree.h for its interface.  It inserts
+   keys, 32-bit integers or wider (see KEY_BITS), into an index, and
+   queries the index for points within a certain distance of the given
+   point.
+
+   That is,
+
+   Let S = { N pseudorandom 32-bit integers }
+   Let d(x,y) be the (base-2) Hamming distance between x and y
+   Let q(x,r) = { y in S : d(x,y) <= r }
+
+   There are six implementations in here which can be selected at
+   runtime, and "auto" picks between them.
+
+   "bk" is a BK-Tree.  Each internal node has a center point, and each
+   child node contains a set of all points a certain distance away
+   from the center.
+
+   "vp" is a VP-Tree.  Each internal node has a center point and two
+   children.  The "near" child contains all points contained in a
+   closed ball of a certain radius around the center, and the "far"
+   node contains all other points.
+
+   "vpflat" is a VP-Tree stored in a single arena, in preorder.
+
+   "bkflat" is a BK-Tree stored the same way.
+
+   "mih" is multi-index hashing, which looks up substrings of the
+   query in hash tables.
+
+   "linear" is a linear search.
+
+   The tree implementations use a linear search for leaf nodes.  The
+   maximum number of points in a leaf node is configurable at runtime,
+   but 1000 is a good number.  If the number is low, say 1, then the
+   memory usage of the tree implementations will skyrocket to
+   unreasonable levels: more than 24 bytes per element.
+
+   Note that VP trees are slightly faster than BK trees for this
+   problem, and neither tree implementation significantly outperforms
+   linear search (that is, by a factor of two or more) for r > 6.  */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#if defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#else
+#define HAVE_NEON 0
+#endif
+
+#ifndef INSTRUMENT
+#define INSTRUMENT 0
+#endif
+
+#ifndef HAVE_POPCNT
+#define HAVE_POPCNT 0
+#endif
+
+/* Radii below this, at most 16, get searches of their own, see "Fixed
+   radii".  0 leaves only the searches taking any radius.  */
+#ifndef FIXED_RADII
+#define FIXED_RADII 16
+#endif
+#if FIXED_RADII > 16
+#error "FIXED_RADII can be at most 16"
+#endif
+
+#include "mtree.h"
+
+#define RAND_A 4284966893U
+
+void
+mtree_rng_seed(struct mtree_rng *r, uint32_t seed)
+{
+    r->x0 = seed;
+    r->x1 = 0x038acaf3U;
+    r->c = 0xa2cc5886U;
+}
+
+uint32_t
+mtree_rng_next(struct mtree_rng *r)
+{
+    uint64_t y = (uint64_t)r->x0 * RAND_A + r->c;
+    r->x0 = r->x1;
+    r->x1 = y;
+    r->c = y >> 32;
+    return y;
+}
+
+__attribute__((malloc))
+static void *
+xmalloc(size_t sz)
+{
+    void *p;
+    if (!sz)
+        return NULL;
+    p = malloc(sz);
+    if (!p)
+        err(1, "malloc");
+    return p;
+}
+
+/* Keys ====================
+
+   Keys are KEY_BITS wide, which can be 32, 64, 128, 256 or 512.
+   Keys of 32 and 64 bits are plain integers.  Wider keys are arrays
+   of 64-bit words, and every operation on them is a loop over a
+   constant number of words, which the compiler unrolls completely.  */
+
+enum { MAX_DISTANCE = MTREE_MAX_DISTANCE };
+
+/* Distance, small enough to keep in tree nodes */
+#if KEY_BITS < 256
+typedef unsigned char dist_t;
+#else
+typedef unsigned short dist_t;
+#endif
+
+/* The key type is in mtree.h */
+typedef mtree_key_t bkey_t;
+
+#ifdef MTREE_KEY_WORDS
+#define KEY_WORDS MTREE_KEY_WORDS
+#define KEY_WIDE 1
+#else
+#define KEY_WIDE 0
+#endif
+
+static inline unsigned
+popcount64_swar(uint64_t d)
+{
+    d = d - ((d >> 1) & 0x5555555555555555ULL);
+    d = (d & 0x3333333333333333ULL) + ((d >> 2) & 0x3333333333333333ULL);
+    d = (d + (d >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (d * 0x0101010101010101ULL) >> 56;
+}
+
+#if HAVE_POPCNT
+
+#if KEY_BITS == 32
+
+static inline unsigned
+distance(bkey_t x, bkey_t y)
+{
+    return __builtin_popcount(x^y);
+}
+
+#elif KEY_BITS == 64
+
+static inline unsigned
+distance(bkey_t x, bkey_t y)
+{
+    return __builtin_popcountll(x^y);
+}
+
+#endif
+
+#else
+
+#if KEY_BITS == 32
+
+static inline unsigned
+distance(bkey_t x, bkey_t y)
+{
+    uint32_t d = x^y;
+    d = (d & 0x55555555U) + ((d >> 1) & 0x55555555U);
+    d = (d & 0x33333333U) + ((d >> 2) & 0x33333333U);
+    d = (d + (d >> 4)) & 0x0f0f0f0fU;
+    d = d + (d >> 8);
+    d = d + (d >> 16);
+    return d & 63;
+}
+
+#elif KEY_BITS == 64
+
+static inline unsigned
+distance(bkey_t x, bkey_t y)
+{
+    return popcount64_swar(x^y);
+}
+
+#endif
+
+#endif
+
+#if KEY_WIDE
+
+static inline unsigned
+distance(bkey_t x, bkey_t y)
+{
+    unsigned i, d = 0;
+    for (i = 0; i < KEY_WORDS; ++i)
+#if HAVE_POPCNT
+        d += __builtin_popcountll(x.w[i] ^ y.w[i]);
+#else
+        d += popcount64_swar(x.w[i] ^ y.w[i]);
+#endif
+    return d;
+}
+
+static inline unsigned
+key_bit(bkey_t k, unsigned i)
+{
+    return (k.w[i / 64] >> (i % 64)) & 1;
+}
+
+/* Fold a key to 32 bits, for checksums */
+static inline uint32_t
+key_fold(bkey_t k)
+{
+    uint64_t x = 0;
+    unsigned i;
+    for (i = 0; i < KEY_WORDS; ++i)
+        x ^= k.w[i];
+    return x ^ (x >> 32);
+}
+
+static inline bkey_t
+key_rand(struct mtree_rng *r)
+{
+    bkey_t k;
+    unsigned i;
+    for (i = 0; i < KEY_WORDS; ++i)
+        k.w[i] = ((uint64_t) mtree_rng_next(r) << 32) | mtree_rng_next(r);
+    return k;
+}
+
+#else
+
+static inline unsigned
+key_bit(bkey_t k, unsigned i)
+{
+    return (k >> i) & 1;
+}
+
+static inline uint32_t
+key_fold(bkey_t k)
+{
+    return k ^ ((uint64_t) k >> 32);
+}
+
+static inline bkey_t
+key_rand(struct mtree_rng *r)
+{
+#if KEY_BITS == 64
+    return ((uint64_t) mtree_rng_next(r) << 32) | mtree_rng_next(r);
+#else
+    return mtree_rng_next(r);
+#endif
+}
+
+#endif
+
+mtree_key_t
+mtree_rng_key(struct mtree_rng *r)
+{
+    return key_rand(r);
+}
+
+char *
+mtree_keystr(mtree_key_t k, const mtree_key_t *ref, char *buf)
+{
+    unsigned i;
+    for (i = 0; i < KEY_BITS; ++i)
+        buf[KEY_BITS - 1 - i] = !ref || key_bit(k, i) != key_bit(*ref, i)
+            ? '0' + key_bit(k, i) : '.';
+    buf[KEY_BITS] = '\0';
+    return buf;
+}
+
+uint32_t
+mtree_key_fold(mtree_key_t k)
+{
+    return key_fold(k);
+}
+
+/* Index statistics ====================
+
+   Each type measures an index by walking it, so the figures belong to
+   that index alone, however many are built and on however many
+   threads, and can be taken again after changes.  The bytes are split
+   between nodes, which include whatever is stored with them such as
+   leaf tables and slices, keys, and slack.  Slack is memory allocated
+   but not in use: the unused ends of pool chunks, the room key arrays
+   keep to grow, and what a leaf leaves behind in its pool when it
+   changes.  The figures go in a struct mtree_stats.  */
+
+enum {
+    STATS_FILL = MTREE_STATS_FILL,
+    STATS_DEPTH = MTREE_STATS_DEPTH
+};
+
+static void
+stats_init(struct mtree_stats *st, size_t max_linear)
+{
+    memset(st, 0, sizeof(*st));
+    st->max_linear = max_linear;
+}
+
+/* Count a leaf of n keys at a depth, whose key array has room for
+   'alloc' keys, or is part of another array if 'alloc' is 0.  */
+static void
+stats_leaf(struct mtree_stats *st, size_t n, size_t alloc, unsigned depth)
+{
+    size_t f = n && st->max_linear ? (n - 1) * 10 / st->max_linear : 0;
+    st->leaves++;
+    st->keys += n;
+    st->key_bytes += sizeof(bkey_t) * n;
+    if (alloc > n)
+        st->slack += sizeof(bkey_t) * (alloc - n);
+    if (st->max_linear)
+        st->fill[f < STATS_FILL ? f : STATS_FILL - 1]++;
+    st->depth[depth < STATS_DEPTH ? depth : STATS_DEPTH - 1]++;
+}
+
+/* Result buffers ====================
+
+   Query results go to a buffer, which can handle them in one of a
+   few ways.  The default, BUF_GROW, stores every hit in an array
+   which is grown with realloc() (glibc uses mremap() for large
+   arrays) and reused from query to query.  BUF_COUNT only counts the
+   hits.  BUF_FIXED stores hits in a caller-provided array and sets
+   'overflow' if it fills up.  BUF_VISIT passes each hit to a
+   callback.  In every mode 'n' is the number of hits so far.  */
+
+enum {
+    BUF_GROW = MTREE_SINK_GROW,
+    BUF_COUNT = MTREE_SINK_COUNT,
+    BUF_FIXED = MTREE_SINK_FIXED,
+    BUF_VISIT = MTREE_SINK_VISIT
+};
+
+struct buf {
+    bkey_t *keys;
+    size_t n, a;
+    unsigned mode;
+    int overflow;
+    void (*visit)(void *, bkey_t);
+    void *arg;
+};
+
+static void
+buf_init(struct buf *restrict b, unsigned mode)
+{
+    b->keys = NULL;
+    b->n = 0;
+    b->a = 0;
+    b->mode = mode;
+    b->overflow = 0;
+    b->visit = NULL;
+    b->arg = NULL;
+}
+
+static void
+buf_fixed(struct buf *restrict b, bkey_t *keys, size_t a)
+{
+    buf_init(b, BUF_FIXED);
+    b->keys = keys;
+    b->a = a;
+}
+
+static void
+buf_visit(struct buf *restrict b, void (*visit)(void *, bkey_t), void *arg)
+{
+    buf_init(b, BUF_VISIT);
+    b->visit = visit;
+    b->arg = arg;
+}
+
+static void
+buf_reset(struct buf *restrict b)
+{
+    b->n = 0;
+    b->overflow = 0;
+}
+
+static void
+buf_free(struct buf *restrict b)
+{
+    if (b->mode == BUF_GROW)
+        free(b->keys);
+    b->keys = NULL;
+    b->a = 0;
+}
+
+/* Set to an errno by a query which failed, as one on a server can,
+   and cleared by whatever reports it.  The hits of a failed query are
+   whatever it had found, so they aren't cached.  */
+static __thread int query_errno;
+
+/* Make room for at least 'n' more keys in a growable buffer.  */
+static void
+bufreserve(struct buf *restrict b, size_t n)
+{
+    size_t na;
+    bkey_t *np;
+    if (b->n + n > b->a) {
+        na = b->a ? 2*b->a : 16;
+        while (na < b->n + n)
+            na *= 2;
+        np = realloc(b->keys, sizeof(*np) * na);
+        if (!np)
+            err(1, "realloc");
+        b->keys = np;
+        b->a = na;
+    }
+}
+
+/* Return nonzero if 'n' keys can be stored directly in the array.  */
+static inline int
+bufroom(struct buf *restrict b, size_t n)
+{
+    if (b->n + n <= b->a)
+        return 1;
+    if (b->mode != BUF_GROW)
+        return 0;
+    bufreserve(b, n);
+    return 1;
+}
+
+__attribute__((noinline))
+static void
+addkey_slow(struct buf *restrict b, bkey_t k)
+{
+    switch (b->mode) {
+    case BUF_GROW:
+        bufreserve(b, 1);
+        b->keys[b->n] = k;
+        break;
+    case BUF_FIXED:
+        b->overflow = 1;
+        break;
+    case BUF_VISIT:
+        b->visit(b->arg, k);
+        break;
+    }
+    b->n++;
+}
+
+static inline void
+addkey(struct buf *restrict b, bkey_t k)
+{
+    if (b->n < b->a)
+        b->keys[b->n++] = k;
+    else
+        addkey_slow(b, k);
+}
+
+/* Expected number of hits for a query of radius r over n random
+   keys, for reserving buffer space.  */
+static size_t
+buf_estimate(size_t n, unsigned r)
+{
+    double c = 1.0, s = 1.0;
+    unsigned i;
+    for (i = 1; i <= r && i <= MAX_DISTANCE; ++i) {
+        c = c * (MAX_DISTANCE - i + 1) / i;
+        s += c;
+    }
+    for (i = 0; i < MAX_DISTANCE; ++i)
+        s *= 0.5;
+    return (size_t) (n * s);
+}
+
+/* A query in a batch is a struct mtree_query.  Queries can also be
+   pushed down a tree together in blocks of up to QBLOCK_MAX, so that
+   each node and leaf is read once for the whole block, rather than
+   once per query.  */
+enum { QBLOCK_MAX = MTREE_BLOCK_MAX };
+
+/* Instrumentation ====================
+
+   Building with -DINSTRUMENT counts, for each radius query, the
+   internal nodes visited and the leaves scanned with the keys in
+   them, and keeps a histogram of the depth of every node visited, so
+   it shows where pruning stops working.  The counters are thread
+   local, and ws_run() takes each query's share.  Otherwise the macros
+   expand to nothing.  Blocked and kNN queries aren't counted.  */
+
+enum { STAT_DEPTH = MTREE_STAT_DEPTH };
+
+struct stats {
+    size_t nodes;
+    size_t leaves;
+    size_t scanned;
+    unsigned depth;
+    /* Nodes and leaves visited at each depth, the last is the rest */
+    size_t visits[STAT_DEPTH];
+};
+
+#if INSTRUMENT
+
+static __thread struct stats stats;
+
+static inline void
+stat_visit(void)
+{
+    stats.visits[stats.depth < STAT_DEPTH ? stats.depth : STAT_DEPTH - 1]++;
+}
+
+static inline void
+stat_node(void)
+{
+    stats.nodes++;
+    stat_visit();
+}
+
+static inline void
+stat_leaf(size_t n)
+{
+    stats.leaves++;
+    stats.scanned += n;
+    stat_visit();
+}
+
+static inline void
+stat_down(void)
+{
+    stats.depth++;
+}
+
+static inline size_t
+stat_up(size_t nc)
+{
+    stats.depth--;
+    return nc;
+}
+
+/* Depth histogram of the queries in a batch, summed over the workers */
+static size_t stat_visits[STAT_DEPTH];
+
+static void
+stat_merge(void)
+{
+    unsigned i;
+    for (i = 0; i < STAT_DEPTH; ++i)
+        if (stats.visits[i])
+            __atomic_fetch_add(&stat_visits[i], stats.visits[i],
+                               __ATOMIC_RELAXED);
+    memset(stats.visits, 0, sizeof(stats.visits));
+}
+
+void
+mtree_visits(size_t visits[MTREE_STAT_DEPTH])
+{
+    unsigned i;
+    for (i = 0; i < STAT_DEPTH; ++i)
+        visits[i] = __atomic_load_n(&stat_visits[i], __ATOMIC_RELAXED);
+}
+
+void
+mtree_visits_reset(void)
+{
+    unsigned i;
+    for (i = 0; i < STAT_DEPTH; ++i)
+        __atomic_store_n(&stat_visits[i], 0, __ATOMIC_RELAXED);
+}
+
+#define STAT_NODE() stat_node()
+#define STAT_LEAF(n) stat_leaf(n)
+/* A recursive call one level down the tree */
+#define DESCEND(call) (stat_down(), stat_up(call))
+#define STAT_DOWN() stat_down()
+#define STAT_BEGIN(q) ((q)->nodes = stats.nodes,        \
+                       (q)->leaves = stats.leaves,      \
+                       (q)->scanned = stats.scanned)
+#define STAT_END(q) ((q)->nodes = stats.nodes - (q)->nodes,             \
+                     (q)->leaves = stats.leaves - (q)->leaves,          \
+                     (q)->scanned = stats.scanned - (q)->scanned)
+#define STAT_MERGE() stat_merge()
+/* For the explicit stacks of the iterative queries */
+#define STAT_FRAME unsigned depth;
+#define STAT_PUSH(f) ((f)->depth = stats.depth + 1)
+#define STAT_POP(f) (stats.depth = (f)->depth)
+#define STAT_SAVE(v) unsigned v = stats.depth
+#define STAT_RESTORE(v) (stats.depth = (v))
+
+#else
+
+#define STAT_NODE() ((void) 0)
+#define STAT_LEAF(n) ((void) 0)
+#define DESCEND(call) (call)
+#define STAT_DOWN() ((void) 0)
+#define STAT_BEGIN(q) ((void) 0)
+#define STAT_END(q) ((void) 0)
+#define STAT_MERGE() ((void) 0)
+#define STAT_FRAME
+#define STAT_PUSH(f) ((void) 0)
+#define STAT_POP(f) ((void) 0)
+#define STAT_SAVE(v) ((void) 0)
+#define STAT_RESTORE(v) ((void) 0)
+
+#endif
+
+/* Leaf scan ====================
+
+   Every query ends in a linear scan over an array of keys, which is
+   where nearly all of the time goes for large r.  The scan kernel is
+   picked at runtime by scan_init() so the same binary will use
+   AVX-512 or AVX2 where the CPU has it.  The vector kernels compute
+   the distance for a whole vector of keys, build a mask of the keys
+   within range, and store the matching keys directly into the
+   buffer.  There are vector kernels for 32-bit and 64-bit keys.
+   Wider keys use the POPCNT kernel, one instruction per word.  */
+
+typedef void (*scan_t)(struct buf *restrict, const bkey_t *restrict,
+                       size_t, bkey_t, unsigned);
+
+static void
+scan_generic(struct buf *restrict b, const bkey_t *restrict keys,
+             size_t n, bkey_t ref, unsigned maxd)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        if (distance(ref, keys[i]) <= maxd)
+            addkey(b, keys[i]);
+}
+
+/* Add the keys selected by the bits in 'm', of at most 16 keys.  */
+static inline void
+scan_store(struct buf *restrict b, const bkey_t *restrict keys,
+           unsigned m)
+{
+    bkey_t *restrict out;
+    if (b->mode == BUF_COUNT) {
+        b->n += __builtin_popcount(m);
+    } else if (bufroom(b, 16)) {
+        out = b->keys + b->n;
+        while (m) {
+            *out++ = keys[__builtin_ctz(m)];
+            m &= m - 1;
+        }
+        b->n = out - b->keys;
+    } else {
+        while (m) {
+            addkey(b, keys[__builtin_ctz(m)]);
+            m &= m - 1;
+        }
+    }
+}
+
+#if HAVE_X86_SIMD
+
+__attribute__((target("popcnt")))
+static inline unsigned
+distance_popcnt(bkey_t x, bkey_t y)
+{
+#if KEY_WIDE
+    unsigned i, d = 0;
+    for (i = 0; i < KEY_WORDS; ++i)
+        d += __builtin_popcountll(x.w[i] ^ y.w[i]);
+    return d;
+#elif KEY_BITS == 64
+    return __builtin_popcountll(x ^ y);
+#else
+    return __builtin_popcount(x ^ y);
+#endif
+}
+
+__attribute__((target("popcnt")))
+static void
+scan_popcnt(struct buf *restrict b, const bkey_t *restrict keys,
+            size_t n, bkey_t ref, unsigned maxd)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        if (distance_popcnt(ref, keys[i]) <= maxd)
+            addkey(b, keys[i]);
+}
+
+#endif
+
+#if HAVE_X86_SIMD && !KEY_WIDE
+
+#define HAVE_SCAN_X86 1
+
+/* Per-byte popcount, using a nibble lookup table.  */
+__attribute__((target("avx2")))
+static inline __m256i
+popcnt8_avx2(__m256i x)
+{
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lo = _mm256_set1_epi8(0x0f);
+    return _mm256_add_epi8(
+        _mm256_shuffle_epi8(lut, _mm256_and_si256(x, lo)),
+        _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), lo)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+popcnt8_avx512bw(__m512i x)
+{
+    const __m512i lut = _mm512_broadcast_i32x4(_mm_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i lo = _mm512_set1_epi8(0x0f);
+    return _mm512_add_epi8(
+        _mm512_shuffle_epi8(lut, _mm512_and_si512(x, lo)),
+        _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(x, 4), lo)));
+}
+
+#if KEY_BITS == 32
+
+enum { AVX2_LANES = 8, AVX512_LANES = 16 };
+
+__attribute__((target("avx2")))
+static inline unsigned
+match_avx2(const bkey_t *restrict keys, __m256i refv, __m256i maxdv)
+{
+    __m256i x, c;
+    x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) keys), refv);
+    c = _mm256_maddubs_epi16(popcnt8_avx2(x), _mm256_set1_epi8(1));
+    c = _mm256_madd_epi16(c, _mm256_set1_epi16(1));
+    c = _mm256_cmpgt_epi32(c, maxdv);
+    return ~_mm256_movemask_ps(_mm256_castsi256_ps(c)) & 0xffU;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+popcnt_avx512bw(__m512i x)
+{
+    __m512i c = _mm512_maddubs_epi16(popcnt8_avx512bw(x), _mm512_set1_epi8(1));
+    return _mm512_madd_epi16(c, _mm512_set1_epi16(1));
+}
+
+#define avx2_set1 _mm256_set1_epi32
+#define avx512_set1 _mm512_set1_epi32
+#define avx512_maskz_loadu _mm512_maskz_loadu_epi32
+#define avx512_cmple_mask _mm512_mask_cmple_epu32_mask
+#define avx512_compressstoreu _mm512_mask_compressstoreu_epi32
+#define avx512_popcnt _mm512_popcnt_epi32
+
+#else
+
+enum { AVX2_LANES = 4, AVX512_LANES = 8 };
+
+__attribute__((target("avx2")))
+static inline unsigned
+match_avx2(const bkey_t *restrict keys, __m256i refv, __m256i maxdv)
+{
+    __m256i x, c;
+    x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) keys), refv);
+    c = _mm256_sad_epu8(popcnt8_avx2(x), _mm256_setzero_si256());
+    c = _mm256_cmpgt_epi64(c, maxdv);
+    return ~_mm256_movemask_pd(_mm256_castsi256_pd(c)) & 0xfU;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+popcnt_avx512bw(__m512i x)
+{
+    return _mm512_sad_epu8(popcnt8_avx512bw(x), _mm512_setzero_si512());
+}
+
+#define avx2_set1 _mm256_set1_epi64x
+#define avx512_set1 _mm512_set1_epi64
+#define avx512_maskz_loadu _mm512_maskz_loadu_epi64
+#define avx512_cmple_mask _mm512_mask_cmple_epu64_mask
+#define avx512_compressstoreu _mm512_mask_compressstoreu_epi64
+#define avx512_popcnt _mm512_popcnt_epi64
+
+#endif
+
+__attribute__((target("avx2,popcnt")))
+static void
+scan_avx2(struct buf *restrict b, const bkey_t *restrict keys,
+          size_t n, bkey_t ref, unsigned maxd)
+{
+    __m256i refv = avx2_set1(ref), maxdv = avx2_set1(maxd);
+    size_t i;
+    unsigned m, j;
+    for (i = 0; i + 16 <= n; i += 16) {
+        for (j = 0, m = 0; j < 16; j += AVX2_LANES)
+            m |= match_avx2(keys + i + j, refv, maxdv) << j;
+        if (m)
+            scan_store(b, keys + i, m);
+    }
+    for (; i < n; ++i)
+        if (distance_popcnt(ref, keys[i]) <= maxd)
+            addkey(b, keys[i]);
+}
+
+/* The two AVX-512 kernels differ only in how they count bits, the
+   tail is handled with a masked load.  */
+#define SCAN_AVX512(name, isa, popcnt)                                  \
+__attribute__((target(isa)))                                           \
+static void                                                             \
+name(struct buf *restrict b, const bkey_t *restrict keys,               \
+     size_t n, bkey_t ref, unsigned maxd)                               \
+{                                                                       \
+    __m512i refv = avx512_set1(ref);                                    \
+    __m512i maxdv = avx512_set1(maxd);                                  \
+    __m512i x;                                                          \
+    unsigned m, tail;                                                   \
+    size_t i;                                                           \
+    for (i = 0; i < n; i += AVX512_LANES) {                             \
+        if (n - i >= AVX512_LANES)                                      \
+            tail = (1U << AVX512_LANES) - 1;                            \
+        else                                                            \
+            tail = (1U << (n - i)) - 1;                                 \
+        x = avx512_maskz_loadu(tail, keys + i);                         \
+        m = avx512_cmple_mask(                                          \
+            tail, popcnt(_mm512_xor_si512(x, refv)), maxdv);            \
+        if (m && b->mode != BUF_COUNT && bufroom(b, 16)) {              \
+            avx512_compressstoreu(b->keys + b->n, m, x);                \
+            b->n += __builtin_popcount(m);                              \
+        } else if (m) {                                                 \
+            scan_store(b, keys + i, m);                                 \
+        }                                                               \
+    }                                                                   \
+}
+
+SCAN_AVX512(scan_avx512bw, "avx512f,avx512bw,popcnt", popcnt_avx512bw)
+SCAN_AVX512(scan_avx512vpop, "avx512f,avx512vpopcntdq,popcnt",
+            avx512_popcnt)
+
+#undef SCAN_AVX512
+#undef avx2_set1
+#undef avx512_set1
+#undef avx512_maskz_loadu
+#undef avx512_cmple_mask
+#undef avx512_compressstoreu
+#undef avx512_popcnt
+
+#else
+
+#define HAVE_SCAN_X86 0
+
+#endif
+
+#if HAVE_NEON && !KEY_WIDE
+
+#define HAVE_SCAN_NEON 1
+
+#if KEY_BITS == 32
+
+enum { NEON_LANES = 4 };
+
+static inline unsigned
+match_neon(const bkey_t *restrict keys, bkey_t ref, unsigned maxd)
+{
+    static const uint32_t bit[4] = { 1, 2, 4, 8 };
+    uint32x4_t c = veorq_u32(vld1q_u32(keys), vdupq_n_u32(ref));
+    c = vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(c))));
+    return vaddvq_u32(vandq_u32(vcleq_u32(c, vdupq_n_u32(maxd)),
+                                vld1q_u32(bit)));
+}
+
+#else
+
+enum { NEON_LANES = 2 };
+
+static inline unsigned
+match_neon(const bkey_t *restrict keys, bkey_t ref, unsigned maxd)
+{
+    static const uint64_t bit[2] = { 1, 2 };
+    uint64x2_t c = veorq_u64(vld1q_u64(keys), vdupq_n_u64(ref));
+    c = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(
+        vcntq_u8(vreinterpretq_u8_u64(c)))));
+    return vaddvq_u64(vandq_u64(vcleq_u64(c, vdupq_n_u64(maxd)),
+                                vld1q_u64(bit)));
+}
+
+#endif
+
+static void
+scan_neon(struct buf *restrict b, const bkey_t *restrict keys,
+          size_t n, bkey_t ref, unsigned maxd)
+{
+    size_t i;
+    unsigned m, j;
+    for (i = 0; i + 8 <= n; i += 8) {
+        for (j = 0, m = 0; j < 8; j += NEON_LANES)
+            m |= match_neon(keys + i + j, ref, maxd) << j;
+        if (m)
+            scan_store(b, keys + i, m);
+    }
+    scan_generic(b, keys + i, n - i, ref, maxd);
+}
+
+#else
+
+#define HAVE_SCAN_NEON 0
+
+#endif
+
+static scan_t scan_keys = scan_generic;
+static const char *scan_name = "generic";
+
+/* Pick the fastest leaf scan the CPU supports.  */
+static void
+scan_init(void)
+{
+#if HAVE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vpopcntdq")) {
+        scan_keys = scan_avx512vpop;
+        scan_name = "avx512vpopcntdq";
+    } else if (__builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw")) {
+        scan_keys = scan_avx512bw;
+        scan_name = "avx512bw";
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan_keys = scan_avx2;
+        scan_name = "avx2";
+    } else if (__builtin_cpu_supports("popcnt")) {
+        scan_keys = scan_popcnt;
+        scan_name = "popcnt";
+    }
+#elif HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        scan_keys = scan_popcnt;
+        scan_name = "popcnt";
+    }
+#elif HAVE_SCAN_NEON
+    scan_keys = scan_neon;
+    scan_name = "neon";
+#endif
+}
+
+/* Bit-sliced scan ====================
+
+   With the slice_leaves option, leaves also keep their keys bit-sliced, in
+   blocks of SLICE_KEYS keys where slice i of a block holds bit i of
+   every key in it.  One pass over the slices of a block then works
+   out the distances of all of its keys at once, in bit-sliced
+   counters.  Each counter starts at 2^L - 1 - maxd, for the smallest L
+   with 2^L > maxd, so it carries out of its top bit once the distance
+   passes maxd.  When every key in a block is out of range, the rest of
+   its slices are skipped.  The keys are kept as they are as well, for
+   the hits and every other kind of query.  */
+
+enum {
+    /* 64-bit words in a slice */
+    SLICE_WORDS = 4,
+    SLICE_KEYS = 64 * SLICE_WORDS,
+    /* Largest L, and how many slices to run between bail-out tests */
+    SLICE_COUNT = 9,
+    SLICE_BAIL = 8
+};
+
+/* Slices are only aligned as words, so they can follow a node.  */
+typedef uint64_t slice_t
+    __attribute__((vector_size(8 * SLICE_WORDS), aligned(8)));
+
+typedef void (*slice_scan_t)(struct buf *restrict, const bkey_t *restrict,
+                             const slice_t *restrict, size_t, size_t,
+                             const slice_t *restrict,
+                             const slice_t *restrict, unsigned);
+
+
+static inline size_t
+slice_size(size_t n)
+{
+    return sizeof(slice_t) * KEY_BITS * ((n + SLICE_KEYS - 1) / SLICE_KEYS);
+}
+
+/* Slice n keys into s, which has room for slice_size(n) bytes.  */
+static void
+slice_keys(slice_t *restrict s, const bkey_t *restrict keys, size_t n)
+{
+    slice_t *restrict w;
+    size_t i;
+    unsigned j, k;
+    memset(s, 0, slice_size(n));
+    for (i = 0; i < n; ++i) {
+        w = s + i / SLICE_KEYS * KEY_BITS;
+        k = i % SLICE_KEYS;
+        for (j = 0; j < KEY_BITS; ++j)
+            w[j][k / 64] |= (uint64_t) key_bit(keys[i], j) << (k % 64);
+    }
+}
+
+/* Add the keys of a block which are out of range to 'over', with L
+   bits of counter.  L is a constant in each of the callers in
+   SCAN_SLICED, so the counter stays in registers.  */
+static inline __attribute__((always_inline)) void
+slice_block(const slice_t *restrict w, const slice_t *restrict rm,
+            const slice_t *restrict init, slice_t *restrict over,
+            unsigned L)
+{
+    slice_t c[SLICE_COUNT], carry, t, o = *over;
+    uint64_t all;
+    unsigned i, j, k;
+    for (k = 0; k < L; ++k)
+        c[k] = init[k];
+    for (i = 0; i < KEY_BITS; i += SLICE_BAIL) {
+        for (j = i; j < i + SLICE_BAIL; ++j) {
+            carry = w[j] ^ rm[j];
+            for (k = 0; k < L; ++k) {
+                t = c[k] & carry;
+                c[k] ^= carry;
+                carry = t;
+            }
+            o |= carry;
+        }
+        for (all = o[0], k = 1; k < SLICE_WORDS; ++k)
+            all &= o[k];
+        if (!~all)
+            break;
+    }
+    *over = o;
+}
+
+/* Scan keys lo up to hi of a leaf with slices s, given the slices of
+   the query in rm and the L slices of the counter's start in init.
+   This is built for AVX2 as well, which does a whole slice at once.  */
+#define SCAN_SLICED(name, attr)                                         \
+attr static void                                                        \
+name(struct buf *restrict b, const bkey_t *restrict keys,               \
+     const slice_t *restrict s, size_t lo, size_t hi,                   \
+     const slice_t *restrict rm, const slice_t *restrict init,          \
+     unsigned L)                                                        \
+{                                                                       \
+    slice_t over;                                                       \
+    size_t base, i;                                                     \
+    unsigned k;                                                         \
+    uint64_t m;                                                         \
+    for (base = lo - lo % SLICE_KEYS; base < hi; base += SLICE_KEYS) {  \
+        for (k = 0; k < SLICE_WORDS; ++k) {                             \
+            i = base + 64 * k;                                          \
+            m = 0;                                                      \
+            if (i < lo)                                                 \
+                m = lo - i >= 64 ? ~m : ((uint64_t) 1 << (lo - i)) - 1; \
+            if (i + 64 > hi)                                            \
+                m |= hi <= i ? ~(uint64_t) 0 : ~(uint64_t) 0 << (hi - i); \
+            over[k] = m;                                                \
+        }                                                               \
+        switch (L) {                                                    \
+        SLICE_CASE(0) SLICE_CASE(1) SLICE_CASE(2) SLICE_CASE(3)         \
+        SLICE_CASE(4) SLICE_CASE(5) SLICE_CASE(6) SLICE_CASE(7)         \
+        SLICE_CASE(8) default: SLICE_CASE(9)                            \
+        }                                                               \
+        for (k = 0; k < SLICE_WORDS; ++k)                               \
+            for (m = ~over[k]; m; m &= m - 1)                           \
+                addkey(b, keys[base + 64 * k + __builtin_ctzll(m)]);    \
+    }                                                                   \
+}
+
+#define SLICE_CASE(n)                                                   \
+        case n:                                                         \
+            slice_block(s + base / SLICE_KEYS * KEY_BITS, rm, init,     \
+                        &over, n);                                      \
+            break;
+
+SCAN_SLICED(scan_sliced_generic, )
+#if HAVE_X86_SIMD
+SCAN_SLICED(scan_sliced_avx2, __attribute__((target("avx2"))))
+#endif
+
+#undef SLICE_CASE
+#undef SCAN_SLICED
+
+static slice_scan_t scan_slices = scan_sliced_generic;
+
+static void
+slice_init(void)
+{
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_slices = scan_sliced_avx2;
+#endif
+}
+
+/* Scan keys lo up to hi of a leaf with slices s.  */
+static void
+scan_sliced(struct buf *restrict b, const bkey_t *restrict keys,
+            const slice_t *restrict s, size_t lo, size_t hi,
+            bkey_t ref, unsigned maxd)
+{
+    slice_t rm[KEY_BITS], init[SLICE_COUNT];
+    unsigned L, j, k;
+    if (maxd >= KEY_BITS) {
+        scan_keys(b, keys + lo, hi - lo, ref, maxd);
+        return;
+    }
+    for (L = 0; (1U << L) <= maxd; ++L);
+    for (j = 0; j < L; ++j)
+        for (k = 0; k < SLICE_WORDS; ++k)
+            init[j][k] = (((1U << L) - 1 - maxd) >> j) & 1 ? ~(uint64_t) 0 : 0;
+    for (j = 0; j < KEY_BITS; ++j)
+        for (k = 0; k < SLICE_WORDS; ++k)
+            rm[j][k] = key_bit(ref, j) ? ~(uint64_t) 0 : 0;
+    scan_slices(b, keys, s, lo, hi, rm, init, L);
+}
+
+/* Packed leaves ====================
+
+   With the pack_leaves option, a VP-tree leaf whose keys differ in few bits
+   keeps them packed as well.  The bits set in 'vary' are the ones
+   which differ between the keys, 'common' holds the others, and each
+   key is stored as its varying bits alone, gathered into a lane of 8
+   or 16 bits, or 32 for 64-bit keys.  A query's distance from a key is
+   the distance of the common bits, which is the same for the whole
+   leaf, plus the distance of the lanes.  So a leaf whose common bits
+   are out of range is skipped, and the others are scanned a lane at a
+   time with a smaller radius, reading at most half the bytes of the
+   keys.  Hits are unpacked from their lanes, so the keys as they are
+   are only read by kNN queries and changes.  Keys wider than 64 bits
+   aren't packed, and with them the option leaves every leaf as it
+   is.  */
+
+struct packed {
+    bkey_t common, vary;
+    /* Bytes per lane */
+    unsigned width;
+};
+
+typedef void (*pack_scan_t)(struct buf *restrict,
+                            const struct packed *restrict, size_t, size_t,
+                            bkey_t, unsigned);
+
+
+#if !KEY_WIDE
+
+static inline const unsigned char *
+pack_lanes(const struct packed *p)
+{
+    return (const unsigned char *) (p + 1);
+}
+
+/* Gather the bits of x under mask into the low bits, as pext does.  */
+static inline uint64_t
+pack_bits(uint64_t x, uint64_t mask)
+{
+    uint64_t r = 0, bit = 1;
+    for (; mask; mask &= mask - 1, bit <<= 1)
+        if (x & mask & -mask)
+            r |= bit;
+    return r;
+}
+
+/* Scatter the low bits of x to the bits under mask, as pdep does.  */
+static inline uint64_t
+unpack_bits(uint64_t x, uint64_t mask)
+{
+    uint64_t r = 0, bit = 1;
+    for (; mask; mask &= mask - 1, bit <<= 1)
+        if (x & bit)
+            r |= mask & -mask;
+    return r;
+}
+
+static inline uint64_t
+pack_lane(const struct packed *p, size_t i)
+{
+    const unsigned char *l = pack_lanes(p) + i * p->width;
+    uint32_t x32;
+    uint16_t x16;
+    if (p->width == 1)
+        return *l;
+    if (p->width == 2) {
+        memcpy(&x16, l, 2);
+        return x16;
+    }
+    memcpy(&x32, l, 4);
+    return x32;
+}
+
+/* Bytes per lane for w varying bits */
+static inline unsigned
+pack_width(unsigned w)
+{
+    return w <= 8 ? 1 : w <= 16 ? 2 : w <= 32 ? 4 : 8;
+}
+
+/* Bytes to pack n keys, or 0 if packing them saves nothing.  */
+static size_t
+pack_size(const bkey_t *keys, size_t n)
+{
+    bkey_t all = ~(bkey_t) 0, any = 0;
+    unsigned width;
+    size_t i;
+    if (!n)
+        return 0;
+    for (i = 0; i < n; ++i) {
+        all &= keys[i];
+        any |= keys[i];
+    }
+    width = pack_width(__builtin_popcountll((uint64_t) (all ^ any)));
+    if (8 * width >= KEY_BITS)
+        return 0;
+    return sizeof(struct packed) + width * n;
+}
+
+/* Pack n keys into p, which has room for pack_size(keys, n) bytes.  */
+static void
+pack_keys(struct packed *restrict p, const bkey_t *restrict keys, size_t n)
+{
+    unsigned char *l = (unsigned char *) (p + 1);
+    bkey_t all = ~(bkey_t) 0, any = 0;
+    uint64_t x;
+    uint32_t x32;
+    uint16_t x16;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        all &= keys[i];
+        any |= keys[i];
+    }
+    p->common = all;
+    p->vary = all ^ any;
+    p->width = pack_width(__builtin_popcountll((uint64_t) p->vary));
+    for (i = 0; i < n; ++i, l += p->width) {
+        x = pack_bits(keys[i], p->vary);
+        if (p->width == 1) {
+            *l = x;
+        } else if (p->width == 2) {
+            x16 = x;
+            memcpy(l, &x16, 2);
+        } else {
+            x32 = x;
+            memcpy(l, &x32, 4);
+        }
+    }
+}
+
+/* Scan lanes lo up to hi for a query whose lane is ref, and whose
+   radius less the distance of the common bits is maxd.  */
+static void
+scan_packed_generic(struct buf *restrict b, const struct packed *restrict p,
+                    size_t lo, size_t hi, bkey_t ref, unsigned maxd)
+{
+    uint64_t x;
+    size_t i;
+    for (i = lo; i < hi; ++i) {
+        x = pack_lane(p, i);
+        if ((unsigned) __builtin_popcountll(x ^ ref) <= maxd)
+            addkey(b, p->common | unpack_bits(x, p->vary));
+    }
+}
+
+#if HAVE_X86_SIMD
+
+/* The lanes of a vector p cover, from lane i, in lane mask m */
+__attribute__((target("bmi2,popcnt")))
+static inline void
+pack_store(struct buf *restrict b, const struct packed *restrict p,
+           size_t i, uint64_t m)
+{
+    if (b->mode == BUF_COUNT) {
+        b->n += __builtin_popcountll(m);
+        return;
+    }
+    for (; m; m &= m - 1)
+        addkey(b, p->common | _pdep_u64(pack_lane(p, i + __builtin_ctzll(m)),
+                                        p->vary));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+pc16_avx512bw(__m512i x)
+{
+    return _mm512_maddubs_epi16(popcnt8_avx512bw(x), _mm512_set1_epi8(1));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+pc32_avx512bw(__m512i x)
+{
+    return _mm512_madd_epi16(pc16_avx512bw(x), _mm512_set1_epi16(1));
+}
+
+/* A loop over lanes of 'bits' bits, 512 / bits to a vector */
+#define PACK_LOOP(bits, set1, loadu, cmple, popcnt)                     \
+    for (i = lo; i < hi; i += 512 / bits) {                             \
+        tail = hi - i >= 512 / bits ? ~(uint64_t) 0 >> (64 - 512 / bits) \
+            : ((uint64_t) 1 << (hi - i)) - 1;                           \
+        x = loadu(tail, l + i * (bits / 8));                            \
+        m = cmple(tail, popcnt(_mm512_xor_si512(x, set1(ref))),         \
+                  set1(maxd));                                          \
+        if (m)                                                          \
+            pack_store(b, p, i, m);                                     \
+    }
+
+/* As with SCAN_AVX512, the kernels differ in how they count bits.  */
+#define SCAN_PACKED(name, isa, pc8, pc16, pc32)                         \
+__attribute__((target(isa)))                                           \
+static void                                                             \
+name(struct buf *restrict b, const struct packed *restrict p,           \
+     size_t lo, size_t hi, bkey_t ref, unsigned maxd)                   \
+{                                                                       \
+    const unsigned char *l = pack_lanes(p);                             \
+    uint64_t m, tail;                                                   \
+    __m512i x;                                                          \
+    size_t i;                                                           \
+    if (p->width == 1) {                                                \
+        PACK_LOOP(8, _mm512_set1_epi8, _mm512_maskz_loadu_epi8,         \
+                  _mm512_mask_cmple_epu8_mask, pc8)                     \
+    } else if (p->width == 2) {                                         \
+        PACK_LOOP(16, _mm512_set1_epi16, _mm512_maskz_loadu_epi16,      \
+                  _mm512_mask_cmple_epu16_mask, pc16)                   \
+    } else {                                                            \
+        PACK_LOOP(32, _mm512_set1_epi32, _mm512_maskz_loadu_epi32,      \
+                  _mm512_mask_cmple_epu32_mask, pc32)                   \
+    }                                                                   \
+}
+
+SCAN_PACKED(scan_packed_avx512bw, "avx512f,avx512bw,bmi2,popcnt",
+            popcnt8_avx512bw, pc16_avx512bw, pc32_avx512bw)
+SCAN_PACKED(scan_packed_avx512bitalg,
+            "avx512f,avx512bw,avx512bitalg,avx512vpopcntdq,bmi2,popcnt",
+            _mm512_popcnt_epi8, _mm512_popcnt_epi16, _mm512_popcnt_epi32)
+
+#undef SCAN_PACKED
+#undef PACK_LOOP
+
+/* The lane of a query, with pext */
+__attribute__((target("bmi2")))
+static uint64_t
+pack_ref_bmi2(uint64_t x, uint64_t mask)
+{
+    return _pext_u64(x, mask);
+}
+
+#endif
+
+static pack_scan_t scan_lanes = scan_packed_generic;
+static uint64_t (*pack_ref)(uint64_t, uint64_t) = pack_bits;
+
+static void
+pack_init(void)
+{
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512bitalg") &&
+        __builtin_cpu_supports("avx512vpopcntdq") &&
+        __builtin_cpu_supports("bmi2"))
+        scan_lanes = scan_packed_avx512bitalg;
+    else if (__builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512bw") &&
+             __builtin_cpu_supports("bmi2"))
+        scan_lanes = scan_packed_avx512bw;
+    if (__builtin_cpu_supports("bmi2"))
+        pack_ref = pack_ref_bmi2;
+#endif
+}
+
+/* Scan keys lo up to hi of a packed leaf.  */
+static void
+scan_packed(struct buf *restrict b, const struct packed *restrict p,
+            size_t lo, size_t hi, bkey_t ref, unsigned maxd)
+{
+    unsigned d = distance(ref & ~p->vary, p->common);
+    if (d <= maxd && lo < hi)
+        scan_lanes(b, p, lo, hi, pack_ref(ref, p->vary), maxd - d);
+}
+
+#else
+
+static size_t
+pack_size(const bkey_t *keys, size_t n)
+{
+    (void) keys;
+    (void) n;
+    return 0;
+}
+
+static void
+pack_keys(struct packed *restrict p, const bkey_t *restrict keys, size_t n)
+{
+    (void) p;
+    (void) keys;
+    (void) n;
+}
+
+static void
+pack_init(void)
+{
+}
+
+static void
+scan_packed(struct buf *restrict b, const struct packed *restrict p,
+            size_t lo, size_t hi, bkey_t ref, unsigned maxd)
+{
+    (void) b;
+    (void) p;
+    (void) lo;
+    (void) hi;
+    (void) ref;
+    (void) maxd;
+}
+
+#endif
+
+/* Nearest neighbours ====================
+
+   A k-nearest-neighbour query keeps the best k keys found so far in
+   a max-heap, ordered by distance.  Once the heap is full, only keys
+   closer than the worst one in the heap are of interest, so the
+   search radius shrinks as better keys are found.  */
+
+struct knn_item {
+    bkey_t key;
+    unsigned d;
+};
+
+struct knn {
+    struct knn_item *heap;
+    size_t n, k;
+};
+
+static void
+knn_init(struct knn *restrict h, size_t k)
+{
+    h->heap = xmalloc(sizeof(*h->heap) * (k ? k : 1));
+    h->n = 0;
+    h->k = k;
+}
+
+static void
+knn_free(struct knn *restrict h)
+{
+    free(h->heap);
+}
+
+/* Return the largest distance which could still improve the result,
+   or -1 if no key can.  */
+static inline int
+knn_radius(const struct knn *restrict h)
+{
+    if (h->n < h->k)
+        return MAX_DISTANCE;
+    return (int) h->heap[0].d - 1;
+}
+
+static void
+knn_add(struct knn *restrict h, bkey_t key, unsigned d)
+{
+    struct knn_item *restrict a = h->heap;
+    size_t i, j, n;
+    if (h->n < h->k) {
+        /* Sift up */
+        for (i = h->n++; i > 0 && a[(i - 1) / 2].d < d; i = j) {
+            j = (i - 1) / 2;
+            a[i] = a[j];
+        }
+    } else {
+        if (!h->k || d >= a[0].d)
+            return;
+        /* Sift down */
+        n = h->n;
+        for (i = 0; (j = 2 * i + 1) < n; i = j) {
+            if (j + 1 < n && a[j + 1].d > a[j].d)
+                j++;
+            if (a[j].d <= d)
+                break;
+            a[i] = a[j];
+        }
+    }
+    a[i].key = key;
+    a[i].d = d;
+}
+
+/* Offer every key of a leaf to the heap.  The keys are run through
+   the leaf scan kernel in small chunks at the current radius first,
+   so only the keys which are close enough are looked at again.  */
+enum { KNN_CHUNK = 64 };
+
+static size_t
+knn_scan(struct knn *restrict h, const bkey_t *restrict keys, size_t n,
+         bkey_t ref)
+{
+    bkey_t hit[KNN_CHUNK];
+    struct buf b;
+    size_t off, len, i;
+    int r;
+    for (off = 0; off < n; off += len) {
+        len = n - off;
+        if (len > KNN_CHUNK)
+            len = KNN_CHUNK;
+        r = knn_radius(h);
+        if (r < 0)
+            break;
+        buf_fixed(&b, hit, KNN_CHUNK);
+        scan_keys(&b, keys + off, len, ref, r);
+        for (i = 0; i < b.n; ++i)
+            knn_add(h, hit[i], distance(ref, hit[i]));
+    }
+    return n;
+}
+
+/* Sort the heap from nearest to farthest, and return the distance of
+   the farthest result.  */
+static unsigned
+knn_sort(struct knn *restrict h)
+{
+    struct knn_item *restrict a = h->heap, t;
+    size_t n, i, j;
+    for (n = h->n; n > 1; ) {
+        t = a[--n];
+        a[n] = a[0];
+        for (i = 0; (j = 2 * i + 1) < n; i = j) {
+            if (j + 1 < n && a[j + 1].d > a[j].d)
+                j++;
+            if (a[j].d <= t.d)
+                break;
+            a[i] = a[j];
+        }
+        a[i] = t;
+    }
+    return h->n ? a[h->n - 1].d : 0;
+}
+
+/* Approximate search ====================
+
+   An approximate range query gives up after a budget of key
+   comparisons, and returns the hits it has found so far.  So that
+   those are as many of the hits as possible, the subtrees are searched
+   best first, by the lower bound the triangle inequality gives on the
+   distance of their keys from the query.  A subtree whose keys could
+   all be within the radius is as likely as any to hold hits, and the
+   subtrees closer to the edge of the range are left for last.
+
+   A child's bound is never less than its parent's, so the queue is a
+   list of subtrees for each bound, and the lowest bound with any
+   subtrees only goes up.  Each list is last in first out, so the
+   search goes depth first among subtrees with the same bound, and
+   reaches the leaves soon.
+
+   Every key returned is a hit, so the recall of a query is just its
+   number of hits over the exact number.  */
+
+struct approx_item {
+    void *node;
+    /* Parent's distance from the query */
+    unsigned pd;
+    /* Next item in the same list, or free */
+    int next;
+    STAT_FRAME
+};
+
+enum { APPROX_LOCAL = 256, APPROX_END = -1 };
+
+struct approx {
+    struct approx_item *item;
+    int head[MAX_DISTANCE + 1], freelist;
+    unsigned n, a, lb, maxd;
+    struct approx_item local[APPROX_LOCAL];
+};
+
+static void
+approx_init(struct approx *restrict h, unsigned maxd)
+{
+    unsigned i;
+    h->item = h->local;
+    h->n = 0;
+    h->a = APPROX_LOCAL;
+    h->freelist = APPROX_END;
+    h->lb = 0;
+    h->maxd = maxd;
+    for (i = 0; i <= maxd; ++i)
+        h->head[i] = APPROX_END;
+}
+
+static void
+approx_free(struct approx *restrict h)
+{
+    if (h->item != h->local)
+        free(h->item);
+}
+
+/* Is the queue empty?  Moves on to the lowest bound with subtrees.  */
+static inline int
+approx_empty(struct approx *restrict h)
+{
+    while (h->lb <= h->maxd && h->head[h->lb] == APPROX_END)
+        h->lb++;
+    return h->lb > h->maxd;
+}
+
+static void
+approx_push(struct approx *restrict h, void *node, unsigned lb,
+            unsigned pd)
+{
+    struct approx_item *restrict it;
+    int i = h->freelist;
+    if (i != APPROX_END) {
+        h->freelist = h->item[i].next;
+    } else {
+        if (h->n == h->a) {
+            it = xmalloc(sizeof(*it) * h->a * 2);
+            memcpy(it, h->item, sizeof(*it) * h->n);
+            approx_free(h);
+            h->item = it;
+            h->a *= 2;
+        }
+        i = h->n++;
+    }
+    it = &h->item[i];
+    it->node = node;
+    it->pd = pd;
+    it->next = h->head[lb];
+    STAT_PUSH(it);
+    h->head[lb] = i;
+}
+
+/* Take the next subtree, from a queue which isn't empty.  Returns the
+   node, and sets its parent's distance and its bound.  */
+static inline void *
+approx_pop(struct approx *restrict h, unsigned *pd, unsigned *lb)
+{
+    int i = h->head[h->lb];
+    struct approx_item *restrict it = &h->item[i];
+    h->head[h->lb] = it->next;
+    it->next = h->freelist;
+    h->freelist = i;
+    *pd = it->pd;
+    *lb = h->lb;
+    STAT_POP(it);
+    return it->node;
+}
+
+/* Parallel build ====================
+
+   Subtrees are independent of each other, so large subtrees are
+   built on their own threads.  The histogram and partition passes
+   over the keys of a large node are also split into chunks which run
+   in parallel.  The number of extra threads in use at once is
+   bounded by the build's tokens.
+
+   A build's options and tokens are in a struct build, which each
+   thread working on it points to with build_cur, including the
+   threads started by task_fork().  A dynamic index keeps one for its
+   changes and rebuilds.  Other threads see no options.  */
+
+enum {
+    /* Smallest subtree which is built on its own thread */
+    BUILD_FORK_MIN = 1 << 14,
+    /* Smallest chunk of keys for a parallel pass */
+    BUILD_CHUNK_MIN = 1 << 16,
+    BUILD_MAX_CHUNKS = 64
+};
+
+struct tree_type;
+
+struct build {
+    struct mtree_opts opts;
+    unsigned tokens;
+    /* The type of each shard, with opts.shards */
+    const struct tree_type *shard_sub;
+};
+
+static struct build build_none;
+static __thread struct build *build_cur = &build_none;
+
+static int
+token_get(void)
+{
+    unsigned n = __atomic_load_n(&build_cur->tokens, __ATOMIC_RELAXED);
+    while (n)
+        if (__atomic_compare_exchange_n(&build_cur->tokens, &n, n - 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+static void
+token_put(void)
+{
+    __atomic_add_fetch(&build_cur->tokens, 1, __ATOMIC_RELEASE);
+}
+
+struct task {
+    void *(*fn)(void *);
+    void *arg;
+    struct build *build;
+    pthread_t thread;
+    int spawned;
+};
+
+static void *
+task_run(void *arg)
+{
+    struct task *t = arg;
+    build_cur = t->build;
+    return t->fn(t->arg);
+}
+
+/* Start running fn(arg) on another thread, if the job is big enough
+   and a thread is available.  Otherwise it runs in task_join().  */
+static void
+task_fork(struct task *t, void *(*fn)(void *), void *arg, size_t size)
+{
+    t->fn = fn;
+    t->arg = arg;
+    t->build = build_cur;
+    t->spawned = 0;
+    if (size >= BUILD_FORK_MIN && token_get()) {
+        if (pthread_create(&t->thread, NULL, task_run, t))
+            token_put();
+        else
+            t->spawned = 1;
+    }
+}
+
+static void
+task_join(struct task *t)
+{
+    if (t->spawned) {
+        pthread_join(t->thread, NULL);
+        token_put();
+    } else {
+        t->fn(t->arg);
+    }
+}
+
+/* A partition sorts keys into classes by their distance to a
+   vantage point, using a table which maps each distance to a class
+   or to CLASS_DROP.  It is done in two passes, first a histogram of
+   the distances, then the keys are permuted in place, so building a
+   tree takes no memory for copies of the keys.  */
+
+typedef unsigned short class_t;
+enum { CLASS_DROP = 0xffff };
+
+struct pass {
+    bkey_t vantage;
+    const bkey_t *keys;
+    size_t n;
+    /* Histogram of distances */
+    size_t cnt[MAX_DISTANCE + 1];
+};
+
+struct partition {
+    unsigned nchunks;
+    struct pass *chunk;
+    struct pass one;
+    size_t dcnt[MAX_DISTANCE + 1];
+};
+
+static void *
+pass_hist(void *arg)
+{
+    struct pass *p = arg;
+    size_t i;
+    for (i = 0; i <= MAX_DISTANCE; ++i)
+        p->cnt[i] = 0;
+    for (i = 0; i < p->n; ++i)
+        p->cnt[distance(p->vantage, p->keys[i])]++;
+    return NULL;
+}
+
+static void
+pass_run(struct partition *pt, void *(*fn)(void *))
+{
+    pthread_t th[BUILD_MAX_CHUNKS];
+    unsigned i, n = pt->nchunks;
+    int r;
+    for (i = 1; i < n; ++i) {
+        r = pthread_create(&th[i], NULL, fn, &pt->chunk[i]);
+        if (r) {
+            errno = r;
+            err(1, "pthread_create");
+        }
+    }
+    fn(&pt->chunk[0]);
+    for (i = 1; i < n; ++i)
+        pthread_join(th[i], NULL);
+}
+
+/* Compute the histogram of distances from the vantage point,
+   storing it in pt->dcnt.  */
+static void
+partition_hist(struct partition *pt, bkey_t vantage,
+               const bkey_t *keys, size_t n)
+{
+    unsigned i, nchunks = 1, d;
+    size_t want = n / BUILD_CHUNK_MIN;
+    struct pass *p;
+    if (want > BUILD_MAX_CHUNKS)
+        want = BUILD_MAX_CHUNKS;
+    while (nchunks < want && token_get())
+        nchunks++;
+    pt->nchunks = nchunks;
+    pt->chunk = nchunks > 1
+        ? xmalloc(sizeof(*pt->chunk) * nchunks) : &pt->one;
+    for (i = 0; i < nchunks; ++i) {
+        p = &pt->chunk[i];
+        p->vantage = vantage;
+        p->keys = keys + n * i / nchunks;
+        p->n = n * (i + 1) / nchunks - n * i / nchunks;
+    }
+    pass_run(pt, pass_hist);
+    for (d = 0; d <= MAX_DISTANCE; ++d) {
+        pt->dcnt[d] = 0;
+        for (i = 0; i < nchunks; ++i)
+            pt->dcnt[d] += pt->chunk[i].cnt[d];
+    }
+}
+
+/* Sort the keys by class, in place, and release the threads used by
+   the partition.  The dropped keys are moved to the end.  This is an
+   American flag sort, each key is moved directly to the next free
+   slot for its class, and the key it displaces is moved on in turn.  */
+static void
+partition_permute(struct partition *pt, const class_t *restrict cls,
+                  bkey_t *restrict keys)
+{
+    size_t head[MAX_DISTANCE + 2], end[MAX_DISTANCE + 2], a;
+    class_t map[MAX_DISTANCE + 1];
+    unsigned i, d, c, cc, ncls = 0;
+    bkey_t vantage = pt->chunk[0].vantage, k, t;
+
+    for (d = 0; d <= MAX_DISTANCE; ++d)
+        if (cls[d] != CLASS_DROP && cls[d] >= ncls)
+            ncls = cls[d] + 1;
+    for (c = 0; c <= ncls; ++c)
+        end[c] = 0;
+    for (d = 0; d <= MAX_DISTANCE; ++d) {
+        map[d] = cls[d] == CLASS_DROP ? ncls : cls[d];
+        end[map[d]] += pt->dcnt[d];
+    }
+    for (c = 0, a = 0; c <= ncls; ++c) {
+        head[c] = a;
+        end[c] = (a += end[c]);
+    }
+
+    for (c = 0; c < ncls; ++c) {
+        while (head[c] < end[c]) {
+            k = keys[head[c]];
+            cc = map[distance(vantage, k)];
+            while (cc != c) {
+                t = keys[head[cc]];
+                keys[head[cc]++] = k;
+                k = t;
+                cc = map[distance(vantage, k)];
+            }
+            keys[head[c]++] = k;
+        }
+    }
+
+    if (pt->nchunks > 1) {
+        for (i = 1; i < pt->nchunks; ++i)
+            token_put();
+        free(pt->chunk);
+    }
+}
+
+/* Linear search ==================== */
+
+struct linear {
+    size_t count;
+    bkey_t *keys;
+    /* Bit-sliced keys, or NULL */
+    slice_t *slices;
+};
+
+/* Slice the keys, if the build slices leaves.  */
+static void
+linear_slice(struct linear *restrict node)
+{
+    node->slices = NULL;
+    if (!build_cur->opts.slice_leaves)
+        return;
+    node->slices = xmalloc(slice_size(node->count));
+    slice_keys(node->slices, node->keys, node->count);
+}
+
+static struct linear *
+mktree_linear(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    struct linear* node;
+    (void)max_linear;
+    node = xmalloc(sizeof(*node));
+    node->count = n;
+    node->keys = keys;
+    linear_slice(node);
+    return node;
+}
+
+static void
+measure_linear(struct linear *root, struct mtree_stats *st)
+{
+    st->node_bytes += sizeof(*root) +
+        (root->slices ? slice_size(root->count) : 0);
+    stats_leaf(st, root->count, 0, 0);
+}
+
+static void
+free_linear(struct linear *root)
+{
+    free(root->slices);
+    free(root);
+}
+
+static size_t
+query_linear(struct buf *restrict b, struct linear *restrict root,
+             bkey_t ref, unsigned maxd)
+{
+    STAT_LEAF(root->count);
+    if (root->slices)
+        scan_sliced(b, root->keys, root->slices, 0, root->count, ref, maxd);
+    else
+        scan_keys(b, root->keys, root->count, ref, maxd);
+    return root->count;
+}
+
+static size_t
+knn_linear(struct knn *restrict h, struct linear *restrict root, bkey_t ref)
+{
+    return knn_scan(h, root->keys, root->count, ref);
+}
+
+/* Chunk of keys which stays in L1 while every query scans it */
+enum { LINEAR_CHUNK = 4096 };
+
+/* Scan a chunk at a time, stopping after the first with a hit.  */
+static size_t
+exists_linear(struct buf *restrict b, struct linear *restrict root,
+              bkey_t ref, unsigned maxd)
+{
+    size_t off, len;
+    for (off = 0; off < root->count && !b->n; off += len) {
+        len = root->count - off;
+        if (len > LINEAR_CHUNK)
+            len = LINEAR_CHUNK;
+        if (root->slices)
+            scan_sliced(b, root->keys, root->slices, off, off + len,
+                        ref, maxd);
+        else
+            scan_keys(b, root->keys + off, len, ref, maxd);
+    }
+    STAT_LEAF(off);
+    if (b->n > 1)
+        b->n = 1;
+    return off;
+}
+
+static void
+qblock_linear(struct buf *restrict b, struct linear *restrict root,
+              struct mtree_query *restrict q, size_t nq)
+{
+    size_t off, len, i;
+    for (off = 0; off < root->count; off += len) {
+        len = root->count - off;
+        if (len > LINEAR_CHUNK)
+            len = LINEAR_CHUNK;
+        for (i = 0; i < nq; ++i)
+            scan_keys(&b[i], root->keys + off, len, q[i].key, q[i].maxd);
+    }
+    for (i = 0; i < nq; ++i)
+        q[i].cmp += root->count;
+}
+
+/* Vantage points ====================
+
+   By default the first key of a node is its vantage point.  That
+   works for random keys, but keys from real data are often sorted or
+   clustered, and then the first key can be a poor choice.  With the
+   vantage_samples option, some candidates are sampled from the node and
+   each is scored by the spread (variance) of its distances to a
+   sample of the other keys, which is the shape of the histogram the
+   partition will use.  A wide spread splits the keys more evenly into
+   classes.  The samples are evenly spaced, so this is deterministic
+   and safe to run on several threads.  */
+
+enum { VANTAGE_TEST_KEYS = 256 };
+
+
+/* Choose the vantage point, and move it to the front.  */
+static bkey_t
+choose_vantage(bkey_t *keys, size_t n)
+{
+    size_t i, j, m, c, best = 0;
+    uint64_t sum, sum2, var, bestvar = 0;
+    unsigned ns = build_cur->opts.vantage_samples, d;
+    bkey_t t;
+    if (ns > n)
+        ns = n;
+    if (ns < 2)
+        return keys[0];
+    m = n < VANTAGE_TEST_KEYS ? n : VANTAGE_TEST_KEYS;
+    for (i = 0; i < ns; ++i) {
+        c = i * n / ns;
+        sum = sum2 = 0;
+        for (j = 0; j < m; ++j) {
+            d = distance(keys[c], keys[(j * n + n / 2) / m]);
+            sum += d;
+            sum2 += d * d;
+        }
+        /* m^2 times the variance */
+        var = m * sum2 - sum * sum;
+        if (var > bestvar) {
+            bestvar = var;
+            best = c;
+        }
+    }
+    t = keys[0];
+    keys[0] = keys[best];
+    keys[best] = t;
+    return keys[0];
+}
+
+/* Leaves ====================
+
+   Leaves of the BK-tree and VP-tree point into the key array the tree
+   was built from, and have an 'alloc' of zero.  A leaf gets its own
+   copy of its keys when a key is added to it.  A leaf whose 'linear'
+   field is LEAF_SLICED has its keys bit-sliced after the node as well,
+   and one of a VP-tree which is LEAF_PACKED has them packed there,
+   until any change to its keys, which sets it back to 1.  */
+
+enum { LEAF_SLICED = 2, LEAF_PACKED = 3 };
+
+/* Internal nodes count the keys in their subtree which a query could
+   return, so a count query can take a subtree which is inside its ball
+   as a whole, and an existence query stops at the first such subtree
+   which isn't empty.  A count too big for an unsigned is SUBTREE_MANY,
+   and that subtree is searched instead.  Both kinds of query take an
+   empty BUF_COUNT buffer, and an existence query leaves it with at
+   most one hit.  */
+#define SUBTREE_MANY ((unsigned) -1)
+
+static inline unsigned
+subtree_add(unsigned a, unsigned b)
+{
+    return a == SUBTREE_MANY || b >= SUBTREE_MANY - a ? SUBTREE_MANY : a + b;
+}
+
+static inline void
+subtree_remove(unsigned *size, unsigned n)
+{
+    if (*size != SUBTREE_MANY)
+        *size -= n;
+}
+
+static void
+leaf_grow(bkey_t **keys, unsigned count, unsigned *alloc)
+{
+    unsigned na;
+    bkey_t *np;
+    if (count < *alloc)
+        return;
+    na = count < 8 ? 8 : count + count / 2;
+    if (*alloc) {
+        np = realloc(*keys, sizeof(*np) * na);
+        if (!np)
+            err(1, "realloc");
+    } else {
+        np = xmalloc(sizeof(*np) * na);
+        memcpy(np, *keys, sizeof(*np) * count);
+    }
+    *keys = np;
+    *alloc = na;
+}
+
+static int
+leaf_find(const bkey_t *keys, unsigned count, bkey_t key)
+{
+    unsigned i;
+    for (i = 0; i < count; ++i)
+        if (!distance(keys[i], key))
+            return 1;
+    return 0;
+}
+
+/* Remove every copy of a key, and return the number removed.  */
+static unsigned
+leaf_remove(bkey_t *keys, unsigned *count, bkey_t key)
+{
+    unsigned i = 0, n = *count;
+    while (i < n) {
+        if (!distance(keys[i], key))
+            keys[i] = keys[--n];
+        else
+            i++;
+    }
+    i = *count - n;
+    *count = n;
+    return i;
+}
+
+/* Make a copy of keys for a leaf which owns them.  */
+static void
+leaf_own(bkey_t **keys, unsigned count, unsigned *alloc)
+{
+    bkey_t *np;
+    if (*alloc)
+        return;
+    np = xmalloc(sizeof(*np) * (count ? count : 1));
+    memcpy(np, *keys, sizeof(*np) * count);
+    *keys = np;
+    *alloc = count ? count : 1;
+}
+
+/* Node pools ====================
+
+   The nodes of a BK-tree or VP-tree are carved out of chunks from a
+   pool, rather than each being allocated with malloc(), so a build
+   makes a few dozen allocations rather than one per node, and the
+   nodes lie in memory in the order they were built.  The pool is kept
+   at the start of its first chunk, just before the root node, so the
+   whole tree is freed from its root in one go.
+
+   A build allocates from build_pool, which is per thread.  A subtree
+   built on a thread of its own starts a pool of its own, which the
+   parent's pool takes over once the subtree is joined.  */
+
+enum {
+    POOL_ALIGN = 8,
+    POOL_CHUNK_MIN = 4096,
+    POOL_CHUNK_MAX = 1 << 18
+};
+
+struct pool_chunk {
+    struct pool_chunk *next;
+    size_t size;
+};
+
+struct pool {
+    struct pool_chunk *chunks;
+    /* Free space in the current chunk */
+    char *ptr, *end;
+    /* Size of the next chunk */
+    size_t size;
+};
+
+static __thread struct pool *build_pool;
+
+static inline size_t
+pool_round(size_t n)
+{
+    return (n + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+}
+
+static void
+pool_init(struct pool *p)
+{
+    p->chunks = NULL;
+    p->ptr = NULL;
+    p->end = NULL;
+    p->size = POOL_CHUNK_MIN;
+}
+
+static void *
+pool_alloc(struct pool *p, size_t size)
+{
+    struct pool_chunk *c;
+    size_t head = pool_round(sizeof(*c)), csize;
+    void *r;
+    size = pool_round(size);
+    if ((size_t) (p->end - p->ptr) < size) {
+        csize = p->size;
+        if (p->size < POOL_CHUNK_MAX)
+            p->size *= 2;
+        if (csize < head + size)
+            csize = head + size;
+        c = xmalloc(csize);
+        c->next = p->chunks;
+        c->size = csize;
+        p->chunks = c;
+        p->ptr = (char *) c + head;
+        p->end = (char *) c + csize;
+    }
+    r = p->ptr;
+    p->ptr += size;
+    return r;
+}
+
+/* Start the pool of a new tree, whose root is the next thing
+   allocated from it.  */
+static struct pool *
+pool_new(void)
+{
+    struct pool tmp, *p;
+    pool_init(&tmp);
+    p = pool_alloc(&tmp, sizeof(*p));
+    *p = tmp;
+    return p;
+}
+
+static inline struct pool *
+pool_of(const void *root)
+{
+    return (struct pool *) ((char *) root - pool_round(sizeof(struct pool)));
+}
+
+/* Take over the chunks of another pool.  */
+static void
+pool_take(struct pool *restrict p, struct pool *restrict sub)
+{
+    struct pool_chunk *c = sub->chunks;
+    if (!c)
+        return;
+    while (c->next)
+        c = c->next;
+    c->next = p->chunks;
+    p->chunks = sub->chunks;
+    if (sub->end - sub->ptr > p->end - p->ptr) {
+        p->ptr = sub->ptr;
+        p->end = sub->end;
+    }
+    if (sub->size > p->size)
+        p->size = sub->size;
+}
+
+/* Count the chunks of a pool as slack, less the 'used' bytes of them
+   which are counted as nodes.  */
+static void
+stats_pool(struct mtree_stats *st, const struct pool *p, size_t used)
+{
+    const struct pool_chunk *c;
+    for (c = p->chunks; c; c = c->next)
+        st->slack += c->size;
+    st->slack -= used;
+}
+
+static void
+pool_free(struct pool *p)
+{
+    struct pool_chunk *c, *next;
+    for (c = p->chunks; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+}
+
+/* Called by a build job.  If it is on a thread of its own, its nodes
+   come from 'own'.  Returns whether they do.  */
+static int
+pool_enter(struct pool *own)
+{
+    if (build_pool)
+        return 0;
+    pool_init(own);
+    build_pool = own;
+    return 1;
+}
+
+static void
+pool_leave(int own)
+{
+    if (own)
+        build_pool = NULL;
+}
+
+/* Fixed radii ====================
+
+   The tree searches are inline functions taking the radius as an
+   argument, and a radius query calls one through FIXED_SWITCH(), which
+   passes the radius as a constant when it is below FIXED_RADII.  Each
+   of those radii gets a copy of the search with the pruning bounds
+   folded into it, and the search of the leaf ranges of a VP-tree
+   inlined, while the other radii share the copy taking any radius.
+   The leaf scans are left alone: they are called through scan_keys,
+   and broadcast the radius once for a whole leaf.  */
+
+#define FIXED_CASE(r, search)                                           \
+    case r:                                                             \
+        if (r < FIXED_RADII)                                            \
+            return search(r);                                           \
+        break;
+
+/* Return search(maxd), where search is a macro of the radius */
+#define FIXED_SWITCH(maxd, search)                                      \
+    switch (maxd) {                                                     \
+    FIXED_CASE(0, search) FIXED_CASE(1, search) FIXED_CASE(2, search)   \
+    FIXED_CASE(3, search) FIXED_CASE(4, search) FIXED_CASE(5, search)   \
+    FIXED_CASE(6, search) FIXED_CASE(7, search) FIXED_CASE(8, search)   \
+    FIXED_CASE(9, search) FIXED_CASE(10, search) FIXED_CASE(11, search) \
+    FIXED_CASE(12, search) FIXED_CASE(13, search)                       \
+    FIXED_CASE(14, search) FIXED_CASE(15, search)                       \
+    }                                                                   \
+    return search(maxd)
+
+/* BK-tree ==================== */
+
+struct bktree {
+    dist_t distance;
+    /* The key was removed, see "Dynamic indexes" */
+    unsigned char dead;
+    unsigned short linear;
+    /* Keys in the subtree of an internal node, see SUBTREE_MANY */
+    unsigned size;
+    union {
+        struct {
+            bkey_t key;
+            struct bktree *child;
+        } tree;
+        struct {
+            unsigned count;
+            /* Zero if the keys point into the array the tree was
+               built from */
+            unsigned alloc;
+            bkey_t *keys;
+        } linear;
+    } data;
+    struct bktree *sibling;
+};
+
+/* Number of keys under a node, or SUBTREE_MANY.  */
+static inline unsigned
+bk_size(const struct bktree *node)
+{
+    return node->linear ? node->data.linear.count : node->size;
+}
+
+/* Take n keys off the counts along the path to a key, which is in
+   the tree, down to the node 'end' if it is on the path.  */
+static void
+bk_uncount(struct bktree *root, const struct bktree *end, bkey_t key,
+           unsigned n)
+{
+    unsigned d;
+    while (root != end && !root->linear) {
+        subtree_remove(&root->size, n);
+        d = distance(root->data.tree.key, key);
+        if (!d)
+            return;
+        for (root = root->data.tree.child; root->distance != d;
+             root = root->sibling);
+    }
+}
+
+struct bk_job {
+    bkey_t *keys;
+    size_t n, max_linear;
+    struct bktree *tree;
+    struct pool pool;
+    int own;
+};
+
+static struct bktree *
+bk_build(bkey_t *restrict keys, size_t n, size_t max_linear);
+
+static void *
+bk_job_run(void *arg)
+{
+    struct bk_job *j = arg;
+    j->own = pool_enter(&j->pool);
+    j->tree = bk_build(j->keys, j->n, j->max_linear);
+    pool_leave(j->own);
+    return NULL;
+}
+
+/* Build a BK-tree in build_pool.  The keys are reordered, and the
+   leaves point into the key array, so it must not be freed while the
+   tree is in use.  */
+static struct bktree *
+bk_build(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    size_t dcnt[MAX_DISTANCE + 1], i, a, slices;
+    class_t cls[MAX_DISTANCE + 1];
+    bkey_t rootkey;
+    struct bktree *root, *child, *prev;
+    struct partition pt;
+    struct bk_job job[MAX_DISTANCE + 1];
+    struct task task[MAX_DISTANCE + 1];
+    int leaf;
+    assert(n > 0);
+
+    /* Build root */
+    leaf = n <= max_linear || n <= 1;
+    slices = leaf && build_cur->opts.slice_leaves ? slice_size(n) : 0;
+    root = pool_alloc(build_pool, sizeof(*root) + slices);
+    root->distance = 0;
+    root->dead = 0;
+    root->sibling = NULL;
+    if (leaf) {
+        root->linear = slices ? LEAF_SLICED : 1;
+        root->data.linear.count = n;
+        root->data.linear.alloc = 0;
+        root->data.linear.keys = keys;
+        if (slices)
+            slice_keys((slice_t *) (root + 1), keys, n);
+        return root;
+    }
+    rootkey = choose_vantage(keys, n);
+    root->linear = 0;
+    root->data.tree.key = rootkey;
+    root->size = 1;
+    root->data.tree.child = NULL;
+
+    n -= 1;
+    keys += 1;
+    if (!n)
+        return root;
+
+    /* Sort keys by distance to root, dropping copies of the root */
+    partition_hist(&pt, rootkey, keys, n);
+    cls[0] = CLASS_DROP;
+    for (i = 1; i <= MAX_DISTANCE; ++i)
+        cls[i] = i;
+    for (i = 1, a = 0, dcnt[0] = 0; i <= MAX_DISTANCE; ++i)
+        dcnt[i] = (a += pt.dcnt[i]);
+    partition_permute(&pt, cls, keys);
+    if (!a)
+        return root;
+
+    /* Add child nodes */
+    for (i = 1; i <= MAX_DISTANCE; ++i) {
+        job[i].keys = keys + dcnt[i-1];
+        job[i].n = dcnt[i] - dcnt[i-1];
+        job[i].max_linear = max_linear;
+        if (job[i].n)
+            task_fork(&task[i], bk_job_run, &job[i], job[i].n);
+    }
+    for (i = 1, prev = NULL; i <= MAX_DISTANCE; ++i) {
+        if (!job[i].n)
+            continue;
+        task_join(&task[i]);
+        if (job[i].own)
+            pool_take(build_pool, &job[i].pool);
+        child = job[i].tree;
+        child->distance = i;
+        if (prev)
+            prev->sibling = child;
+        else
+            root->data.tree.child = child;
+        prev = child;
+        root->size = subtree_add(root->size,
+                                           bk_size(child));
+    }
+
+    return root;
+}
+
+static struct bktree *
+mktree_bk(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    struct pool *saved = build_pool;
+    struct bktree *root;
+    build_pool = pool_new();
+    root = bk_build(keys, n, max_linear);
+    assert(pool_of(root) == build_pool);
+    build_pool = saved;
+    return root;
+}
+
+/* Free the keys of the leaves which own them.  */
+static void
+bk_free_keys(struct bktree *root)
+{
+    struct bktree *p;
+    if (root->linear) {
+        if (root->data.linear.alloc)
+            free(root->data.linear.keys);
+    } else {
+        for (p = root->data.tree.child; p; p = p->sibling)
+            bk_free_keys(p);
+    }
+}
+
+/* Free a BK-tree, but not the key array it was built from.  */
+static void
+free_bk(struct bktree *root)
+{
+    bk_free_keys(root);
+    pool_free(pool_of(root));
+}
+
+/* Measure a subtree, and return the bytes of its nodes, which are all
+   in the tree's pool.  */
+static size_t
+bk_measure(const struct bktree *root, struct mtree_stats *st, unsigned depth)
+{
+    const struct bktree *p;
+    size_t size;
+    if (root->linear) {
+        size = pool_round(sizeof(*root) +
+                          (root->linear == LEAF_SLICED
+                           ? slice_size(root->data.linear.count) : 0));
+        st->node_bytes += size;
+        stats_leaf(st, root->data.linear.count, root->data.linear.alloc,
+                   depth);
+        return size;
+    }
+    size = pool_round(sizeof(*root));
+    st->node_bytes += size;
+    st->nodes++;
+    st->keys += !root->dead;
+    for (p = root->data.tree.child; p; p = p->sibling)
+        size += bk_measure(p, st, depth + 1);
+    return size;
+}
+
+static void
+measure_bk(struct bktree *root, struct mtree_stats *st)
+{
+    stats_pool(st, pool_of(root), bk_measure(root, st, 0));
+}
+
+/* Give every leaf its own copy of its keys.  */
+static void
+bk_own(struct bktree *root)
+{
+    struct bktree *p;
+    if (root->linear)
+        leaf_own(&root->data.linear.keys, root->data.linear.count,
+                 &root->data.linear.alloc);
+    else
+        for (p = root->data.tree.child; p; p = p->sibling)
+            bk_own(p);
+}
+
+/* Add a key to a BK-tree, with new nodes from build_pool.  Leaves
+   which grow past max_linear keys are replaced with a subtree.
+   Returns 0 if the key is already there.  The counts are raised on
+   the way down, and put back if it is.  */
+static int
+bk_insert(struct bktree *root, bkey_t key, size_t max_linear)
+{
+    struct bktree **link, *leaf, *sub, *top = root;
+    bkey_t *keys;
+    unsigned d, m;
+    for (;;) {
+        if (root->linear) {
+            if (leaf_find(root->data.linear.keys, root->data.linear.count,
+                          key)) {
+                bk_uncount(top, NULL, key, 1);
+                return 0;
+            }
+            root->linear = 1;
+            leaf_grow(&root->data.linear.keys, root->data.linear.count,
+                      &root->data.linear.alloc);
+            keys = root->data.linear.keys;
+            keys[root->data.linear.count++] = key;
+            if (root->data.linear.count <= max_linear)
+                return 1;
+            sub = bk_build(keys, root->data.linear.count, max_linear);
+            bk_own(sub);
+            free(keys);
+            /* The subtree drops copies of its keys */
+            m = root->data.linear.count - bk_size(sub);
+            sub->distance = root->distance;
+            sub->sibling = root->sibling;
+            *root = *sub;
+            if (m)
+                bk_uncount(top, root, key, m);
+            return 1;
+        }
+        d = distance(root->data.tree.key, key);
+        root->size = subtree_add(root->size, 1);
+        if (!d) {
+            if (!root->dead) {
+                bk_uncount(top, NULL, key, 1);
+                return 0;
+            }
+            root->dead = 0;
+            return 1;
+        }
+        link = &root->data.tree.child;
+        while (*link && (*link)->distance < d)
+            link = &(*link)->sibling;
+        if (!*link || (*link)->distance != d) {
+            leaf = pool_alloc(build_pool, sizeof(*leaf));
+            leaf->distance = d;
+            leaf->dead = 0;
+            leaf->linear = 1;
+            leaf->data.linear.count = 1;
+            leaf->data.linear.alloc = 1;
+            leaf->data.linear.keys = xmalloc(sizeof(key));
+            leaf->data.linear.keys[0] = key;
+            leaf->sibling = *link;
+            *link = leaf;
+            return 1;
+        }
+        root = *link;
+    }
+}
+
+static int
+insert_bk(struct bktree *root, bkey_t key, size_t max_linear)
+{
+    struct pool *saved = build_pool;
+    int r;
+    build_pool = pool_of(root);
+    r = bk_insert(root, key, max_linear);
+    build_pool = saved;
+    return r;
+}
+
+/* Remove a key from a BK-tree.  Returns 0 if it isn't there.  */
+static int
+remove_bk(struct bktree *root, bkey_t key)
+{
+    struct bktree *p, *top = root;
+    unsigned d, m;
+    for (;;) {
+        if (root->linear) {
+            m = leaf_remove(root->data.linear.keys,
+                            &root->data.linear.count, key);
+            if (!m)
+                return 0;
+            root->linear = 1;
+            bk_uncount(top, NULL, key, m);
+            return 1;
+        }
+        d = distance(root->data.tree.key, key);
+        if (!d) {
+            if (root->dead)
+                return 0;
+            root->dead = 1;
+            bk_uncount(top, NULL, key, 1);
+            return 1;
+        }
+        for (p = root->data.tree.child; p && p->distance < d;
+             p = p->sibling);
+        if (!p || p->distance != d)
+            return 0;
+        root = p;
+    }
+}
+
+static inline size_t
+bk_leaf_query(struct buf *restrict b, const struct bktree *restrict leaf,
+              bkey_t ref, unsigned maxd)
+{
+    unsigned n = leaf->data.linear.count;
+    STAT_LEAF(n);
+    if (leaf->linear == LEAF_SLICED)
+        scan_sliced(b, leaf->data.linear.keys, (const slice_t *) (leaf + 1),
+                    0, n, ref, maxd);
+    else
+        scan_keys(b, leaf->data.linear.keys, n, ref, maxd);
+    return n;
+}
+
+static size_t
+bk_query(struct buf *restrict b, struct bktree *restrict root,
+         bkey_t ref, unsigned maxd)
+{
+    /* We are trying to find x that satisfy d(ref,x) <= maxd
+       By triangle inequality, we know: d(root,x) <= d(root,ref) + d(ref,x)
+       By algebra: d(root,x) - d(root,ref) <= d(ref,x)
+       By transitivity: d(root,x) - d(root,ref) <= maxd
+       By algebra: d(root,x) <= maxd + d(root,ref) */
+    if (root->linear) {
+        return bk_leaf_query(b, root, ref, maxd);
+    } else {
+        unsigned d = distance(root->data.tree.key, ref);
+        struct bktree *p = root->data.tree.child;
+        size_t nc = 1;
+        STAT_NODE();
+        if (d <= maxd && !root->dead)
+            addkey(b, root->data.tree.key);
+        for (; p && p->distance + maxd < d; p = p->sibling);
+        for (; p && p->distance <= maxd + d; p = p->sibling)
+            nc += DESCEND(bk_query(b, p, ref, maxd));
+        return nc;
+    }
+}
+
+/* As bk_query(), but only counting the hits.  The keys of a child are
+   all p->distance from this node's key, so if d + p->distance <= maxd
+   they are all hits.  */
+static size_t
+bk_count(struct buf *restrict b, struct bktree *restrict root,
+         bkey_t ref, unsigned maxd)
+{
+    if (root->linear) {
+        return bk_leaf_query(b, root, ref, maxd);
+    } else {
+        unsigned d = distance(root->data.tree.key, ref);
+        struct bktree *p = root->data.tree.child;
+        size_t nc = 1;
+        STAT_NODE();
+        if (d <= maxd && !root->dead)
+            addkey(b, root->data.tree.key);
+        for (; p && p->distance + maxd < d; p = p->sibling);
+        for (; p && p->distance <= maxd + d; p = p->sibling) {
+            if (d + p->distance <= maxd && bk_size(p) != SUBTREE_MANY)
+                b->n += bk_size(p);
+            else
+                nc += DESCEND(bk_count(b, p, ref, maxd));
+        }
+        return nc;
+    }
+}
+
+/* The queries of the pointer and flat trees keep the subtrees still
+   to visit on an explicit stack, rather than recursing, so the loop
+   keeps b, ref and maxd in registers.  Each subtree is prefetched when
+   it is pushed, so it is on its way while the current one is
+   searched.  A subtree which doesn't fit on the stack is searched by
+   the recursive version.  The recursive versions are kept for the
+   blocked queries' sake, and as the plainer statement of each
+   search.  */
+
+enum { QUERY_STACK = 256 };
+
+struct query_frame {
+    void *node;
+    uint32_t pos;
+    unsigned pd;
+    STAT_FRAME
+};
+
+/* As bk_query().  A frame holds the next child of a node to look at,
+   with the query's distance from the node, so the children are
+   searched in the same order as the recursion, and each sibling list
+   is only read as far as it needs to be.  The next sibling is
+   prefetched while the current child's subtree is searched.  With
+   'count' set it is bk_count() instead, and the children which are all
+   hits come first in each list.  */
+static inline __attribute__((always_inline)) size_t
+bk_search(struct buf *restrict b, struct bktree *restrict root,
+          bkey_t ref, unsigned maxd, int count)
+{
+    struct query_frame stack[QUERY_STACK], *sp = stack;
+    struct bktree *node = root, *p;
+    unsigned d;
+    size_t nc = 0;
+    STAT_SAVE(depth);
+    for (;;) {
+        if (node->linear) {
+            nc += bk_leaf_query(b, node, ref, maxd);
+        } else {
+            d = distance(node->data.tree.key, ref);
+            nc++;
+            STAT_NODE();
+            if (d <= maxd && !node->dead)
+                addkey(b, node->data.tree.key);
+            p = node->data.tree.child;
+            for (; p && p->distance + maxd < d; p = p->sibling);
+            for (; count && p && d + p->distance <= maxd &&
+                     bk_size(p) != SUBTREE_MANY; p = p->sibling)
+                b->n += bk_size(p);
+            if (p && p->distance <= maxd + d) {
+                if (sp != stack + QUERY_STACK) {
+                    if (p->sibling)
+                        __builtin_prefetch(p->sibling);
+                    sp->node = p->sibling;
+                    sp->pd = d;
+                    STAT_PUSH(sp);
+                    sp++;
+                    node = p;
+                    STAT_DOWN();
+                    continue;
+                }
+                for (; p && p->distance <= maxd + d; p = p->sibling)
+                    nc += DESCEND(count ? bk_count(b, p, ref, maxd)
+                                  : bk_query(b, p, ref, maxd));
+            }
+        }
+        /* Go on with the next child in range of the nearest node */
+        for (; sp != stack; --sp) {
+            p = sp[-1].node;
+            if (p && p->distance <= maxd + sp[-1].pd)
+                break;
+        }
+        if (sp == stack)
+            break;
+        if (p->sibling)
+            __builtin_prefetch(p->sibling);
+        sp[-1].node = p->sibling;
+        node = p;
+        STAT_POP(sp - 1);
+    }
+    STAT_RESTORE(depth);
+    return nc;
+}
+
+static size_t
+query_bk(struct buf *restrict b, struct bktree *restrict root,
+         bkey_t ref, unsigned maxd)
+{
+#define SEARCH(r) bk_search(b, root, ref, r, 0)
+    FIXED_SWITCH(maxd, SEARCH);
+#undef SEARCH
+}
+
+static size_t
+count_bk(struct buf *restrict b, struct bktree *restrict root,
+         bkey_t ref, unsigned maxd)
+{
+#define SEARCH(r) bk_search(b, root, ref, r, 1)
+    FIXED_SWITCH(maxd, SEARCH);
+#undef SEARCH
+}
+
+/* As query_bk(), but best first, stopping once 'budget' keys have
+   been compared.  Sets *partial if any of the tree was left out.  */
+static size_t
+approx_bk(struct buf *restrict b, struct bktree *restrict root,
+          bkey_t ref, unsigned maxd, size_t budget, int *partial)
+{
+    struct approx h;
+    struct bktree *node = root, *next, *p;
+    unsigned d, c, lb = 0, pd;
+    size_t nc = 0;
+    STAT_SAVE(depth);
+    approx_init(&h, maxd);
+    for (;;) {
+        next = NULL;
+        if (node->linear) {
+            nc += bk_leaf_query(b, node, ref, maxd);
+        } else {
+            d = distance(node->data.tree.key, ref);
+            nc++;
+            STAT_NODE();
+            if (d <= maxd && !node->dead)
+                addkey(b, node->data.tree.key);
+            p = node->data.tree.child;
+            for (; p && p->distance + maxd < d; p = p->sibling);
+            for (; p && p->distance <= maxd + d; p = p->sibling) {
+                /* The child's keys are all p->distance from this key */
+                c = p->distance > d ? p->distance - d : d - p->distance;
+                if (c <= lb && !next)
+                    next = p;
+                else
+                    approx_push(&h, p, c > lb ? c : lb, d);
+            }
+        }
+        /* A child with the same bound as this node goes next, since
+           nothing in the queue is better */
+        if (nc >= budget)
+            break;
+        if (next) {
+            node = next;
+            STAT_DOWN();
+        } else if (approx_empty(&h)) {
+            break;
+        } else {
+            node = approx_pop(&h, &pd, &lb);
+        }
+    }
+    *partial = next || !approx_empty(&h);
+    approx_free(&h);
+    STAT_RESTORE(depth);
+    return nc;
+}
+
+static size_t
+bk_exists(struct buf *restrict b, struct bktree *restrict root,
+          bkey_t ref, unsigned maxd)
+{
+    if (root->linear) {
+        return bk_leaf_query(b, root, ref, maxd);
+    } else {
+        unsigned d = distance(root->data.tree.key, ref);
+        struct bktree *p = root->data.tree.child;
+        size_t nc = 1;
+        STAT_NODE();
+        if (d <= maxd && !root->dead) {
+            addkey(b, root->data.tree.key);
+            return nc;
+        }
+        for (; p && p->distance + maxd < d; p = p->sibling);
+        for (; p && p->distance <= maxd + d; p = p->sibling) {
+            if (d + p->distance <= maxd) {
+                if (!bk_size(p))
+                    continue;
+                b->n++;
+                return nc;
+            }
+            nc += DESCEND(bk_exists(b, p, ref, maxd));
+            if (b->n)
+                return nc;
+        }
+        return nc;
+    }
+}
+
+/* As bk_count(), but stopping at the first hit.  */
+static size_t
+exists_bk(struct buf *restrict b, struct bktree *restrict root,
+          bkey_t ref, unsigned maxd)
+{
+    size_t nc = bk_exists(b, root, ref, maxd);
+    if (b->n > 1)
+        b->n = 1;
+    return nc;
+}
+
+/* Visit the children in order of how close their distance is to the
+   query's distance from this node, since those are the children which
+   are most likely to hold the nearest keys.  */
+static size_t
+knn_bk(struct knn *restrict h, struct bktree *restrict root, bkey_t ref)
+{
+    struct bktree *child[MAX_DISTANCE + 1], *p;
+    unsigned d, o;
+    int r;
+    size_t nc = 1;
+    if (root->linear)
+        return knn_scan(h, root->data.linear.keys,
+                        root->data.linear.count, ref);
+    d = distance(root->data.tree.key, ref);
+    if (!root->dead)
+        knn_add(h, root->data.tree.key, d);
+    for (o = 0; o <= MAX_DISTANCE; ++o)
+        child[o] = NULL;
+    for (p = root->data.tree.child; p; p = p->sibling)
+        child[p->distance] = p;
+    for (o = 0; o <= MAX_DISTANCE; ++o) {
+        r = knn_radius(h);
+        if ((int) o > r)
+            break;
+        if (d + o <= MAX_DISTANCE && child[d + o])
+            nc += knn_bk(h, child[d + o], ref);
+        if (o && o <= d && child[d - o] && (int) o <= knn_radius(h))
+            nc += knn_bk(h, child[d - o], ref);
+    }
+    return nc;
+}
+
+/* Push a block of queries down the tree.  At each node the block is
+   split into the queries which need each child.  */
+static void
+block_bk(struct buf *restrict b, struct bktree *restrict root,
+         struct mtree_query *restrict q, const unsigned short *restrict idx,
+         size_t nq)
+{
+    unsigned short sub[QBLOCK_MAX];
+    dist_t dq[QBLOCK_MAX];
+    struct bktree *p;
+    size_t i, j, ns;
+    unsigned d, lo, hi;
+    if (root->linear) {
+        for (i = 0; i < nq; ++i) {
+            j = idx[i];
+            scan_keys(&b[j], root->data.linear.keys,
+                      root->data.linear.count, q[j].key, q[j].maxd);
+            q[j].cmp += root->data.linear.count;
+        }
+        return;
+    }
+    lo = MAX_DISTANCE;
+    hi = 0;
+    for (i = 0; i < nq; ++i) {
+        j = idx[i];
+        d = distance(root->data.tree.key, q[j].key);
+        dq[i] = d;
+        q[j].cmp += 1;
+        if (d <= q[j].maxd && !root->dead)
+            addkey(&b[j], root->data.tree.key);
+        if (d < lo + q[j].maxd)
+            lo = d > q[j].maxd ? d - q[j].maxd : 0;
+        if (d + q[j].maxd > hi)
+            hi = d + q[j].maxd;
+    }
+    for (p = root->data.tree.child; p && p->distance < lo; p = p->sibling);
+    for (; p && p->distance <= hi; p = p->sibling) {
+        for (i = 0, ns = 0; i < nq; ++i) {
+            j = idx[i];
+            if (p->distance + q[j].maxd >= dq[i] &&
+                p->distance <= q[j].maxd + dq[i])
+                sub[ns++] = j;
+        }
+        if (ns)
+            block_bk(b, p, q, sub, ns);
+    }
+}
+
+static void
+qblock_bk(struct buf *restrict b, struct bktree *restrict root,
+          struct mtree_query *restrict q, size_t nq)
+{
+    unsigned short idx[QBLOCK_MAX];
+    size_t i;
+    assert(nq <= QBLOCK_MAX);
+    for (i = 0; i < nq; ++i)
+        idx[i] = i;
+    block_bk(b, root, q, idx, nq);
+}
+
+/* VP-tree ==================== */
+
+struct vptree {
+    unsigned short linear;
+    /* The vantage point was removed */
+    unsigned short dead;
+    /* Keys in the subtree of an internal node, see SUBTREE_MANY */
+    unsigned size;
+    union {
+        struct {
+            /* Closed ball (d = threshold is included) */
+            dist_t threshold;
+            /* Ball which holds every key of the subtree */
+            dist_t radius;
+            bkey_t vantage;
+            struct vptree *near;
+            struct vptree *far;
+        } tree;
+        struct {
+            unsigned count;
+            /* As for struct bktree */
+            unsigned alloc;
+            bkey_t *keys;
+            /* The keys are sorted by their distance from the parent's
+               vantage point.  Those at distance dmin + i are from
+               keys[start[i]] up to keys[start[i + 1]], and nd is the
+               number of distances, or 0 in a root leaf.  A query
+               only needs to scan the distances within maxd of its
+               own.  */
+            unsigned *start;
+            dist_t dmin;
+            unsigned short nd;
+        } linear;
+    } data;
+};
+
+/* As bk_size() */
+static inline unsigned
+vp_size(const struct vptree *node)
+{
+    return node->linear ? node->data.linear.count : node->size;
+}
+
+/* As bk_uncount() */
+static void
+vp_uncount(struct vptree *root, const struct vptree *end, bkey_t key,
+           unsigned n)
+{
+    unsigned d;
+    while (root != end && !root->linear) {
+        subtree_remove(&root->size, n);
+        d = distance(root->data.tree.vantage, key);
+        if (!d)
+            return;
+        root = d <= root->data.tree.threshold
+            ? root->data.tree.near : root->data.tree.far;
+    }
+}
+
+/* Split the keys around a vantage point, in place, into a near set
+   and a far set which follows it.  Copies of the vantage point itself
+   are moved to the end.  Returns the radius of the near ball, and
+   sets *radius_out, if given, to the distance of the farthest key.  */
+static unsigned
+vp_partition(bkey_t vantage, bkey_t *restrict keys, size_t n,
+             size_t *nnear_out, size_t *nfar_out, unsigned *radius_out)
+{
+    size_t dcnt[MAX_DISTANCE + 1], i, a;
+    class_t cls[MAX_DISTANCE + 1];
+    struct partition pt;
+    unsigned k;
+    size_t median;
+
+    /* Count keys inside the given ball */
+    partition_hist(&pt, vantage, keys, n);
+    for (i = 0, a = 0; i <= MAX_DISTANCE; ++i)
+        dcnt[i] = (a += pt.dcnt[i]);
+    assert(a == n);
+    median = dcnt[0] + (n - dcnt[0]) / 2;
+    for (k = 1; k < MAX_DISTANCE; ++k)
+        if (dcnt[k] > median)
+            break;
+    if (k != 1 && median - dcnt[k-1] <= dcnt[k] - median)
+        k--;
+
+    /* Sort keys into near and far sets */
+    cls[0] = CLASS_DROP;
+    for (i = 1; i <= MAX_DISTANCE; ++i)
+        cls[i] = i <= k ? 0 : 1;
+    partition_permute(&pt, cls, keys);
+
+    *nnear_out = dcnt[k] - dcnt[0];
+    *nfar_out = n - dcnt[k];
+    if (radius_out) {
+        for (i = MAX_DISTANCE; i > 0 && dcnt[i] == dcnt[i-1]; --i);
+        *radius_out = i;
+    }
+    return k;
+}
+
+/* Sort the keys in each leaf by their distance from the parent's
+   vantage point, so queries can skip the keys which are out of range.
+   This saves a fifth or so of the leaf comparisons on random keys,
+   which pays for wide keys, but the tables make the tree bigger and a
+   SIMD scan of a small leaf of narrow keys is cheap, so it is off by
+   default.  */
+
+/* Make a leaf.  Under a parent, if the build sorts leaves, the keys are
+   sorted by their distance from its vantage point, and the table of
+   where each distance starts follows the node, so it comes into the
+   cache with it.  The slices or the packed keys, if any, follow the
+   table.  */
+static struct vptree *
+vp_mkleaf(bkey_t *restrict keys, size_t n, const bkey_t *parent)
+{
+    class_t cls[MAX_DISTANCE + 1];
+    struct partition pt;
+    struct vptree *leaf;
+    const struct mtree_opts *opts = &build_cur->opts;
+    unsigned d, dmin = 0, nd = 0, i;
+    size_t a, table = 0, slices = 0, packed = 0;
+    if (opts->pack_leaves)
+        packed = pack_size(keys, n);
+    if (opts->slice_leaves && !packed)
+        slices = slice_size(n);
+    if (parent && opts->sort_leaves) {
+        partition_hist(&pt, *parent, keys, n);
+        for (dmin = 0; !pt.dcnt[dmin]; ++dmin);
+        for (d = MAX_DISTANCE; !pt.dcnt[d]; --d);
+        nd = d - dmin + 1;
+        for (d = 0; d <= MAX_DISTANCE; ++d)
+            cls[d] = d;
+        partition_permute(&pt, cls, keys);
+        table = pool_round(sizeof(unsigned) * (nd + 1));
+    }
+    leaf = pool_alloc(build_pool, sizeof(*leaf) + table + slices + packed);
+    leaf->linear = slices ? LEAF_SLICED : packed ? LEAF_PACKED : 1;
+    leaf->dead = 0;
+    leaf->data.linear.count = n;
+    leaf->data.linear.alloc = 0;
+    leaf->data.linear.keys = keys;
+    leaf->data.linear.start = nd ? (unsigned *) (leaf + 1) : NULL;
+    leaf->data.linear.dmin = dmin;
+    leaf->data.linear.nd = nd;
+    for (i = 0, a = 0; i < nd; ++i) {
+        leaf->data.linear.start[i] = a;
+        a += pt.dcnt[dmin + i];
+    }
+    if (nd)
+        leaf->data.linear.start[nd] = a;
+    if (slices)
+        slice_keys((slice_t *) ((char *) (leaf + 1) + table), keys, n);
+    if (packed)
+        pack_keys((struct packed *) ((char *) (leaf + 1) + table), keys, n);
+    return leaf;
+}
+
+static inline int
+vp_start_inline(const struct vptree *leaf)
+{
+    return leaf->data.linear.start == (const unsigned *) (leaf + 1);
+}
+
+/* What follows the table of a leaf whose table hasn't changed */
+static inline const void *
+vp_after_table(const struct vptree *leaf)
+{
+    unsigned nd = leaf->data.linear.nd;
+    return (const char *) (leaf + 1) +
+        (nd ? pool_round(sizeof(unsigned) * (nd + 1)) : 0);
+}
+
+/* The slices of a LEAF_SLICED leaf */
+static inline const slice_t *
+vp_slices(const struct vptree *leaf)
+{
+    return vp_after_table(leaf);
+}
+
+/* The packed keys of a LEAF_PACKED leaf */
+static inline const struct packed *
+vp_packed(const struct vptree *leaf)
+{
+    return vp_after_table(leaf);
+}
+
+/* Add a key to a leaf, d from the parent's vantage point.  */
+static void
+vp_leaf_add(struct vptree *restrict leaf, bkey_t key, unsigned d)
+{
+    unsigned n = leaf->data.linear.count, nd = leaf->data.linear.nd;
+    unsigned dmin = leaf->data.linear.dmin, lo, hi, i, pos;
+    unsigned *start = leaf->data.linear.start, *ns;
+    bkey_t *keys;
+    leaf->linear = 1;
+    leaf_grow(&leaf->data.linear.keys, n, &leaf->data.linear.alloc);
+    keys = leaf->data.linear.keys;
+    leaf->data.linear.count++;
+    if (!nd) {
+        keys[n] = key;
+        return;
+    }
+    if (d < dmin || d >= dmin + nd) {
+        /* Widen the table to take the new distance */
+        lo = d < dmin ? d : dmin;
+        hi = d >= dmin + nd ? d : dmin + nd - 1;
+        ns = xmalloc(sizeof(*ns) * (hi - lo + 2));
+        for (i = 0; i <= hi - lo + 1; ++i)
+            ns[i] = lo + i <= dmin ? 0
+                : lo + i >= dmin + nd ? n : start[lo + i - dmin];
+        if (!vp_start_inline(leaf))
+            free(start);
+        leaf->data.linear.start = start = ns;
+        leaf->data.linear.dmin = dmin = lo;
+        leaf->data.linear.nd = nd = hi - lo + 1;
+    }
+    pos = start[d - dmin + 1];
+    memmove(keys + pos + 1, keys + pos, sizeof(*keys) * (n - pos));
+    keys[pos] = key;
+    for (i = d - dmin + 1; i <= nd; ++i)
+        start[i]++;
+}
+
+/* Remove every copy of a key, d from the parent's vantage point, from
+   a leaf, and return the number removed.  */
+static unsigned
+vp_leaf_remove(struct vptree *restrict leaf, bkey_t key, unsigned d)
+{
+    unsigned *start = leaf->data.linear.start, nd = leaf->data.linear.nd;
+    unsigned dmin = leaf->data.linear.dmin, i, j, k, m;
+    bkey_t *keys = leaf->data.linear.keys;
+    if (!nd) {
+        m = leaf_remove(keys, &leaf->data.linear.count, key);
+        if (m)
+            leaf->linear = 1;
+        return m;
+    }
+    if (d < dmin || d >= dmin + nd)
+        return 0;
+    i = d - dmin;
+    for (j = k = start[i]; j < start[i + 1]; ++j)
+        if (distance(keys[j], key))
+            keys[k++] = keys[j];
+    m = start[i + 1] - k;
+    if (!m)
+        return 0;
+    memmove(keys + k, keys + start[i + 1],
+            sizeof(*keys) * (leaf->data.linear.count - start[i + 1]));
+    for (j = i + 1; j <= nd; ++j)
+        start[j] -= m;
+    leaf->data.linear.count -= m;
+    leaf->linear = 1;
+    return m;
+}
+
+struct vp_job {
+    bkey_t *keys;
+    size_t n, max_linear;
+    const bkey_t *parent;
+    struct vptree *tree;
+    struct pool pool;
+    int own;
+};
+
+static struct vptree *
+vp_build(bkey_t *restrict keys, size_t n, size_t max_linear,
+         const bkey_t *parent);
+
+static void *
+vp_job_run(void *arg)
+{
+    struct vp_job *j = arg;
+    j->own = pool_enter(&j->pool);
+    j->tree = vp_build(j->keys, j->n, j->max_linear, j->parent);
+    pool_leave(j->own);
+    return NULL;
+}
+
+/* Build a VP-tree in build_pool, under the vantage point 'parent' if
+   it isn't NULL.  Like bk_build(), the leaves point into the key
+   array.  */
+static struct vptree *
+vp_build(bkey_t *restrict keys, size_t n, size_t max_linear,
+         const bkey_t *parent)
+{
+    bkey_t rootkey;
+    struct vptree *root;
+    size_t nnear, nfar;
+    unsigned radius;
+    struct vp_job job;
+    struct task task;
+    assert(n > 0);
+
+    /* Build root */
+    if (n <= max_linear || n <= 1)
+        return vp_mkleaf(keys, n, parent);
+    root = pool_alloc(build_pool, sizeof(*root));
+    root->dead = 0;
+    root->size = 1;
+    rootkey = choose_vantage(keys, n);
+    root->linear = 0;
+    root->data.tree.threshold = 0;
+    root->data.tree.radius = 0;
+    root->data.tree.vantage = rootkey;
+    root->data.tree.near = NULL;
+    root->data.tree.far = NULL;
+
+    n -= 1;
+    keys += 1;
+    if (!n)
+        return root;
+
+    root->data.tree.threshold =
+        vp_partition(rootkey, keys, n, &nnear, &nfar, &radius);
+    root->data.tree.radius = radius;
+    if (nnear) {
+        job.keys = keys;
+        job.n = nnear;
+        job.max_linear = max_linear;
+        job.parent = &root->data.tree.vantage;
+        task_fork(&task, vp_job_run, &job, nnear);
+    }
+    if (nfar)
+        root->data.tree.far = vp_build(keys + nnear, nfar, max_linear,
+                                       &root->data.tree.vantage);
+    if (nnear) {
+        task_join(&task);
+        if (job.own)
+            pool_take(build_pool, &job.pool);
+        root->data.tree.near = job.tree;
+        root->size = subtree_add(root->size, vp_size(job.tree));
+    }
+    if (nfar)
+        root->size = subtree_add(root->size, vp_size(root->data.tree.far));
+    return root;
+}
+
+static struct vptree *
+mktree_vp(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    struct pool *saved = build_pool;
+    struct vptree *root;
+    build_pool = pool_new();
+    root = vp_build(keys, n, max_linear, NULL);
+    assert(pool_of(root) == build_pool);
+    build_pool = saved;
+    return root;
+}
+
+/* As bk_free_keys(), and the tables which were widened */
+static void
+vp_free_keys(struct vptree *root)
+{
+    if (root->linear) {
+        if (root->data.linear.alloc)
+            free(root->data.linear.keys);
+        if (root->data.linear.nd && !vp_start_inline(root))
+            free(root->data.linear.start);
+    } else {
+        if (root->data.tree.near)
+            vp_free_keys(root->data.tree.near);
+        if (root->data.tree.far)
+            vp_free_keys(root->data.tree.far);
+    }
+}
+
+static void
+free_vp(struct vptree *root)
+{
+    vp_free_keys(root);
+    pool_free(pool_of(root));
+}
+
+/* As bk_measure().  A leaf's table is in the pool until it is
+   widened, and its slices or packing until it changes.  */
+static size_t
+vp_measure(const struct vptree *root, struct mtree_stats *st, unsigned depth)
+{
+    unsigned n, nd;
+    size_t size, packed;
+    if (root->linear) {
+        n = root->data.linear.count;
+        nd = root->data.linear.nd;
+        size = sizeof(*root);
+        if (nd && vp_start_inline(root))
+            size += pool_round(sizeof(unsigned) * (nd + 1));
+        else if (nd)
+            st->node_bytes += sizeof(unsigned) * (nd + 1);
+        if (root->linear == LEAF_SLICED)
+            size += slice_size(n);
+        if (root->linear == LEAF_PACKED) {
+            packed = sizeof(struct packed) + vp_packed(root)->width * n;
+            st->packed_keys += n;
+            st->packed_bytes += packed;
+            size += packed;
+        }
+        size = pool_round(size);
+        st->node_bytes += size;
+        stats_leaf(st, n, root->data.linear.alloc, depth);
+        return size;
+    }
+    size = pool_round(sizeof(*root));
+    st->node_bytes += size;
+    st->nodes++;
+    st->keys += !root->dead;
+    if (root->data.tree.near)
+        size += vp_measure(root->data.tree.near, st, depth + 1);
+    if (root->data.tree.far)
+        size += vp_measure(root->data.tree.far, st, depth + 1);
+    return size;
+}
+
+static void
+measure_vp(struct vptree *root, struct mtree_stats *st)
+{
+    stats_pool(st, pool_of(root), vp_measure(root, st, 0));
+}
+
+static void
+vp_own(struct vptree *root)
+{
+    if (root->linear) {
+        leaf_own(&root->data.linear.keys, root->data.linear.count,
+                 &root->data.linear.alloc);
+    } else {
+        if (root->data.tree.near)
+            vp_own(root->data.tree.near);
+        if (root->data.tree.far)
+            vp_own(root->data.tree.far);
+    }
+}
+
+/* As bk_insert().  The thresholds stay the same, so new keys always
+   go on the side of each vantage point where queries look for
+   them.  */
+static int
+vp_insert(struct vptree *root, bkey_t key, size_t max_linear)
+{
+    struct vptree **link, *leaf, *sub, *top = root;
+    bkey_t *keys;
+    unsigned d = 0, m;
+    for (;;) {
+        if (root->linear) {
+            if (leaf_find(root->data.linear.keys, root->data.linear.count,
+                          key)) {
+                vp_uncount(top, NULL, key, 1);
+                return 0;
+            }
+            /* d is still the distance from the parent */
+            vp_leaf_add(root, key, d);
+            if (root->data.linear.count <= max_linear)
+                return 1;
+            sub = vp_build(root->data.linear.keys, root->data.linear.count,
+                           max_linear, NULL);
+            vp_own(sub);
+            free(root->data.linear.keys);
+            if (root->data.linear.nd && !vp_start_inline(root))
+                free(root->data.linear.start);
+            m = root->data.linear.count - vp_size(sub);
+            *root = *sub;
+            if (m)
+                vp_uncount(top, root, key, m);
+            return 1;
+        }
+        d = distance(root->data.tree.vantage, key);
+        root->size = subtree_add(root->size, 1);
+        if (!d) {
+            if (!root->dead) {
+                vp_uncount(top, NULL, key, 1);
+                return 0;
+            }
+            root->dead = 0;
+            return 1;
+        }
+        if (d > root->data.tree.radius)
+            root->data.tree.radius = d;
+        link = d <= root->data.tree.threshold
+            ? &root->data.tree.near : &root->data.tree.far;
+        if (!*link) {
+            keys = xmalloc(sizeof(key));
+            keys[0] = key;
+            leaf = vp_mkleaf(keys, 1, &root->data.tree.vantage);
+            leaf->data.linear.alloc = 1;
+            *link = leaf;
+            return 1;
+        }
+        root = *link;
+    }
+}
+
+static int
+insert_vp(struct vptree *root, bkey_t key, size_t max_linear)
+{
+    struct pool *saved = build_pool;
+    int r;
+    build_pool = pool_of(root);
+    r = vp_insert(root, key, max_linear);
+    build_pool = saved;
+    return r;
+}
+
+static int
+remove_vp(struct vptree *root, bkey_t key)
+{
+    struct vptree *next, *top = root;
+    unsigned d = 0, m;
+    for (;;) {
+        if (root->linear) {
+            m = vp_leaf_remove(root, key, d);
+            if (m)
+                vp_uncount(top, NULL, key, m);
+            return m != 0;
+        }
+        d = distance(root->data.tree.vantage, key);
+        if (!d) {
+            if (root->dead)
+                return 0;
+            root->dead = 1;
+            vp_uncount(top, NULL, key, 1);
+            return 1;
+        }
+        next = d <= root->data.tree.threshold
+            ? root->data.tree.near : root->data.tree.far;
+        if (!next)
+            return 0;
+        root = next;
+    }
+}
+
+/* Scan a leaf, pd being the query's distance from the parent's
+   vantage point.  By the triangle inequality a key x can only be a
+   hit if |pd - d(parent,x)| <= maxd, and those keys are next to each
+   other in the leaf.  */
+static size_t
+vp_leaf_query(struct buf *restrict b, const struct vptree *restrict leaf,
+              bkey_t ref, unsigned maxd, unsigned pd)
+{
+    const unsigned *start = leaf->data.linear.start;
+    unsigned n = leaf->data.linear.count, lo = 0, hi = n;
+    int nd = leaf->data.linear.nd, a, z;
+    if (nd) {
+        /* Indexes in start of pd - maxd, and the one after pd + maxd */
+        a = (int) pd - (int) maxd - (int) leaf->data.linear.dmin;
+        z = a + 2 * (int) maxd + 1;
+        lo = a <= 0 ? 0 : a >= nd ? n : start[a];
+        hi = z <= 0 ? 0 : z >= nd ? n : start[z];
+    }
+    STAT_LEAF(hi - lo);
+    if (leaf->linear == LEAF_SLICED)
+        scan_sliced(b, leaf->data.linear.keys, vp_slices(leaf), lo, hi,
+                    ref, maxd);
+    else if (leaf->linear == LEAF_PACKED)
+        scan_packed(b, vp_packed(leaf), lo, hi, ref, maxd);
+    else
+        scan_keys(b, leaf->data.linear.keys + lo, hi - lo, ref, maxd);
+    return hi - lo;
+}
+
+static size_t
+vp_query(struct buf *restrict b, struct vptree *restrict root,
+         bkey_t ref, unsigned maxd, unsigned pd)
+{
+    /* We are trying to find x that satisfy d(ref,x) <= maxd
+       By triangle inequality, we know: d(root,x) <= d(root,ref) + d(ref,x)
+       By algebra: d(root,x) - d(root,ref) <= d(ref,x)
+       By transitivity: d(root,x) - d(root,ref) <= maxd
+       By algebra: d(root,x) <= maxd + d(root,ref) */
+    if (root->linear) {
+        return vp_leaf_query(b, root, ref, maxd, pd);
+    } else {
+        unsigned d = distance(root->data.tree.vantage, ref);
+        unsigned thr = root->data.tree.threshold;
+        size_t nc = 1;
+        STAT_NODE();
+        if (d <= maxd + thr) {
+            if (root->data.tree.near)
+                nc += DESCEND(vp_query(b, root->data.tree.near, ref, maxd,
+                                       d));
+            if (d <= maxd && !root->dead)
+                addkey(b, root->data.tree.vantage);
+        }
+        if (d + maxd > thr && root->data.tree.far)
+            nc += DESCEND(vp_query(b, root->data.tree.far, ref, maxd, d));
+        return nc;
+    }
+}
+
+/* As vp_query(), but only counting the hits.  The keys of the near
+   subtree are within the threshold of the vantage point and those of
+   the whole subtree are within its radius, so if d plus either is at
+   most maxd that subtree is all hits.  */
+static size_t
+vp_count(struct buf *restrict b, struct vptree *restrict root,
+         bkey_t ref, unsigned maxd, unsigned pd)
+{
+    struct vptree *near, *far;
+    unsigned d, thr;
+    size_t nc = 1;
+    if (root->linear)
+        return vp_leaf_query(b, root, ref, maxd, pd);
+    d = distance(root->data.tree.vantage, ref);
+    thr = root->data.tree.threshold;
+    near = root->data.tree.near;
+    far = root->data.tree.far;
+    STAT_NODE();
+    if (d <= maxd && !root->dead)
+        addkey(b, root->data.tree.vantage);
+    if (near && d <= maxd + thr) {
+        if (d + thr <= maxd && vp_size(near) != SUBTREE_MANY)
+            b->n += vp_size(near);
+        else
+            nc += DESCEND(vp_count(b, near, ref, maxd, d));
+    }
+    if (far && d + maxd > thr) {
+        if (d + root->data.tree.radius <= maxd &&
+            vp_size(far) != SUBTREE_MANY)
+            b->n += vp_size(far);
+        else
+            nc += DESCEND(vp_count(b, far, ref, maxd, d));
+    }
+    return nc;
+}
+
+/* As vp_query(), with a stack like query_bk().  The near subtree is
+   searched next and the far one is pushed.  With 'count' set it is
+   vp_count() instead.  */
+static inline __attribute__((always_inline)) size_t
+vp_search(struct buf *restrict b, struct vptree *restrict root,
+          bkey_t ref, unsigned maxd, int count)
+{
+    struct query_frame stack[QUERY_STACK], *sp = stack;
+    struct vptree *node = root, *near, *far;
+    unsigned d, thr, pd = 0;
+    size_t nc = 0;
+    STAT_SAVE(depth);
+    for (;;) {
+        if (node->linear) {
+            nc += vp_leaf_query(b, node, ref, maxd, pd);
+        } else {
+            d = distance(node->data.tree.vantage, ref);
+            thr = node->data.tree.threshold;
+            nc++;
+            STAT_NODE();
+            if (d <= maxd && !node->dead)
+                addkey(b, node->data.tree.vantage);
+            near = d <= maxd + thr ? node->data.tree.near : NULL;
+            far = d + maxd > thr ? node->data.tree.far : NULL;
+            pd = d;
+            if (count && near && d + thr <= maxd &&
+                vp_size(near) != SUBTREE_MANY) {
+                b->n += vp_size(near);
+                near = NULL;
+            }
+            if (count && far && d + node->data.tree.radius <= maxd &&
+                vp_size(far) != SUBTREE_MANY) {
+                b->n += vp_size(far);
+                far = NULL;
+            }
+            if (near && far) {
+                if (sp == stack + QUERY_STACK) {
+                    nc += DESCEND(count ? vp_count(b, far, ref, maxd, d)
+                                  : vp_query(b, far, ref, maxd, d));
+                } else {
+                    __builtin_prefetch(far);
+                    sp->node = far;
+                    sp->pd = d;
+                    STAT_PUSH(sp);
+                    sp++;
+                }
+            }
+            if (near || far) {
+                node = near ? near : far;
+                STAT_DOWN();
+                continue;
+            }
+        }
+        if (sp == stack)
+            break;
+        --sp;
+        node = sp->node;
+        pd = sp->pd;
+        STAT_POP(sp);
+    }
+    STAT_RESTORE(depth);
+    return nc;
+}
+
+static size_t
+query_vp(struct buf *restrict b, struct vptree *restrict root,
+         bkey_t ref, unsigned maxd)
+{
+#define SEARCH(r) vp_search(b, root, ref, r, 0)
+    FIXED_SWITCH(maxd, SEARCH);
+#undef SEARCH
+}
+
+static size_t
+count_vp(struct buf *restrict b, struct vptree *restrict root,
+         bkey_t ref, unsigned maxd)
+{
+#define SEARCH(r) vp_search(b, root, ref, r, 1)
+    FIXED_SWITCH(maxd, SEARCH);
+#undef SEARCH
+}
+
+/* As approx_bk().  The keys in the near ball are at least d - thr
+   from the query, and those outside it at least thr + 1 - d.  A child
+   with the same bound as this node goes next.  */
+static size_t
+approx_vp(struct buf *restrict b, struct vptree *restrict root,
+          bkey_t ref, unsigned maxd, size_t budget, int *partial)
+{
+    struct approx h;
+    struct vptree *node = root, *next;
+    unsigned d = 0, thr, c, lb = 0, pd = 0;
+    size_t nc = 0;
+    STAT_SAVE(depth);
+    approx_init(&h, maxd);
+    for (;;) {
+        next = NULL;
+        if (node->linear) {
+            nc += vp_leaf_query(b, node, ref, maxd, pd);
+        } else {
+            d = distance(node->data.tree.vantage, ref);
+            thr = node->data.tree.threshold;
+            nc++;
+            STAT_NODE();
+            if (d <= maxd && !node->dead)
+                addkey(b, node->data.tree.vantage);
+            if (d <= maxd + thr && node->data.tree.near) {
+                c = d > thr + lb ? d - thr : lb;
+                if (c == lb)
+                    next = node->data.tree.near;
+                else
+                    approx_push(&h, node->data.tree.near, c, d);
+            }
+            if (d + maxd > thr && node->data.tree.far) {
+                c = thr + 1 > d + lb ? thr + 1 - d : lb;
+                if (c == lb && !next)
+                    next = node->data.tree.far;
+                else
+                    approx_push(&h, node->data.tree.far, c, d);
+            }
+        }
+        if (nc >= budget)
+            break;
+        if (next) {
+            node = next;
+            pd = d;
+            STAT_DOWN();
+        } else if (approx_empty(&h)) {
+            break;
+        } else {
+            node = approx_pop(&h, &pd, &lb);
+        }
+    }
+    *partial = next || !approx_empty(&h);
+    approx_free(&h);
+    STAT_RESTORE(depth);
+    return nc;
+}
+
+/* Visit the child on the query's side of the threshold first.  */
+static size_t
+knn_vp(struct knn *restrict h, struct vptree *restrict root, bkey_t ref)
+{
+    struct vptree *near, *far;
+    unsigned d, thr;
+    size_t nc = 1;
+    if (root->linear)
+        return knn_scan(h, root->data.linear.keys,
+                        root->data.linear.count, ref);
+    d = distance(root->data.tree.vantage, ref);
+    thr = root->data.tree.threshold;
+    near = root->data.tree.near;
+    far = root->data.tree.far;
+    if (!root->dead)
+        knn_add(h, root->data.tree.vantage, d);
+    if (d <= thr) {
+        if (near)
+            nc += knn_vp(h, near, ref);
+        if (far && (int) (d + knn_radius(h)) > (int) thr)
+            nc += knn_vp(h, far, ref);
+    } else {
+        if (far)
+            nc += knn_vp(h, far, ref);
+        if (near && (int) d <= knn_radius(h) + (int) thr)
+            nc += knn_vp(h, near, ref);
+    }
+    return nc;
+}
+
+/* As vp_count(), but stopping at the first hit.  The subtrees which
+   are all hits go first, then the side of the threshold the query is
+   on, which is where it is most likely to find one.  */
+static size_t
+vp_exists(struct buf *restrict b, struct vptree *restrict root,
+          bkey_t ref, unsigned maxd, unsigned pd)
+{
+    struct vptree *child[2];
+    unsigned d, thr, reach[2], i, j;
+    int visit[2];
+    size_t nc = 1;
+    if (root->linear)
+        return vp_leaf_query(b, root, ref, maxd, pd);
+    d = distance(root->data.tree.vantage, ref);
+    thr = root->data.tree.threshold;
+    STAT_NODE();
+    if (d <= maxd && !root->dead) {
+        addkey(b, root->data.tree.vantage);
+        return nc;
+    }
+    child[0] = root->data.tree.near;
+    child[1] = root->data.tree.far;
+    visit[0] = child[0] && d <= maxd + thr;
+    visit[1] = child[1] && d + maxd > thr;
+    reach[0] = d + thr;
+    reach[1] = d + root->data.tree.radius;
+    for (i = 0; i < 2; ++i) {
+        if (visit[i] && reach[i] <= maxd) {
+            visit[i] = 0;
+            if (vp_size(child[i])) {
+                b->n++;
+                return nc;
+            }
+        }
+    }
+    for (j = 0; j < 2; ++j) {
+        i = j ^ (d > thr);
+        if (!visit[i])
+            continue;
+        nc += DESCEND(vp_exists(b, child[i], ref, maxd, d));
+        if (b->n)
+            return nc;
+    }
+    return nc;
+}
+
+static size_t
+exists_vp(struct buf *restrict b, struct vptree *restrict root,
+          bkey_t ref, unsigned maxd)
+{
+    size_t nc = vp_exists(b, root, ref, maxd, 0);
+    if (b->n > 1)
+        b->n = 1;
+    return nc;
+}
+
+/* Each query in idx comes with its distance from the parent's
+   vantage point in pd, for the leaves.  */
+static void
+block_vp(struct buf *restrict b, struct vptree *restrict root,
+         struct mtree_query *restrict q, const unsigned short *restrict idx,
+         const dist_t *restrict pd, size_t nq)
+{
+    unsigned short near[QBLOCK_MAX], far[QBLOCK_MAX];
+    dist_t dnear[QBLOCK_MAX], dfar[QBLOCK_MAX];
+    size_t i, j, nn, nf;
+    unsigned d, thr;
+    if (root->linear) {
+        for (i = 0; i < nq; ++i) {
+            j = idx[i];
+            q[j].cmp += vp_leaf_query(&b[j], root, q[j].key, q[j].maxd,
+                                      pd[i]);
+        }
+        return;
+    }
+    thr = root->data.tree.threshold;
+    for (i = 0, nn = 0, nf = 0; i < nq; ++i) {
+        j = idx[i];
+        d = distance(root->data.tree.vantage, q[j].key);
+        q[j].cmp += 1;
+        if (d <= q[j].maxd + thr) {
+            dnear[nn] = d;
+            near[nn++] = j;
+            if (d <= q[j].maxd && !root->dead)
+                addkey(&b[j], root->data.tree.vantage);
+        }
+        if (d + q[j].maxd > thr) {
+            dfar[nf] = d;
+            far[nf++] = j;
+        }
+    }
+    if (nn && root->data.tree.near)
+        block_vp(b, root->data.tree.near, q, near, dnear, nn);
+    if (nf && root->data.tree.far)
+        block_vp(b, root->data.tree.far, q, far, dfar, nf);
+}
+
+static void
+qblock_vp(struct buf *restrict b, struct vptree *restrict root,
+          struct mtree_query *restrict q, size_t nq)
+{
+    unsigned short idx[QBLOCK_MAX];
+    dist_t pd[QBLOCK_MAX];
+    size_t i;
+    assert(nq <= QBLOCK_MAX);
+    for (i = 0; i < nq; ++i) {
+        idx[i] = i;
+        pd[i] = 0;
+    }
+    block_vp(b, root, q, idx, pd, nq);
+}
+
+/* Flat arenas ====================
+
+   A flat tree is laid out in preorder in a single arena instead of
+   one allocation per node.  Links are 32-bit offsets relative to the
+   node they are in, rather than pointers, so a subtree can be built
+   in its own arena and copied into place, and a whole tree can be
+   written to a file and mapped back into memory as it is.  Leaf keys
+   are stored inline after the leaf header, so a leaf scan reads one
+   contiguous block.  */
+
+/* Offsets count units of this size from the start of the arena */
+#if KEY_BITS == 32
+typedef uint32_t flat_unit_t;
+#else
+typedef uint64_t flat_unit_t;
+#endif
+
+struct flat {
+    flat_unit_t *arena;
+    size_t size, alloc;         /* In units */
+};
+
+static void
+flat_init(struct flat *restrict t)
+{
+    t->arena = NULL;
+    t->size = 0;
+    t->alloc = 0;
+}
+
+static size_t
+flat_alloc(struct flat *restrict t, size_t bytes)
+{
+    size_t units = (bytes + sizeof(flat_unit_t) - 1) / sizeof(flat_unit_t);
+    size_t pos = t->size, na;
+    flat_unit_t *np;
+    if (pos + units > t->alloc) {
+        na = t->alloc ? t->alloc : 1024;
+        while (na < pos + units)
+            na *= 2;
+        np = realloc(t->arena, sizeof(*np) * na);
+        if (!np)
+            err(1, "realloc");
+        t->arena = np;
+        t->alloc = na;
+    }
+    if (pos + units > UINT32_MAX)
+        errx(1, "flat tree is too large for 32-bit offsets");
+    t->size = pos + units;
+    return pos;
+}
+
+/* Append a separately built subtree.  Offsets are relative, so the
+   subtree can be copied as it is.  */
+static void
+flat_append(struct flat *restrict t, struct flat *restrict sub)
+{
+    size_t pos = flat_alloc(t, sizeof(*sub->arena) * sub->size);
+    memcpy(t->arena + pos, sub->arena, sizeof(*sub->arena) * sub->size);
+    free(sub->arena);
+}
+
+/* Shrink the arena to fit.  */
+static struct flat *
+flat_finish(struct flat *restrict t)
+{
+    struct flat *r = xmalloc(sizeof(*r));
+    r->arena = realloc(t->arena, sizeof(*t->arena) * t->size);
+    r->size = t->size;
+    r->alloc = t->size;
+    return r;
+}
+
+/* Count the arena, after a walk which counted 'keys' bytes of keys
+   in its leaves.  The rest of it is nodes.  */
+static void
+stats_flat(struct mtree_stats *st, const struct flat *t, size_t keys)
+{
+    st->node_bytes += sizeof(*t) + sizeof(*t->arena) * t->size - keys;
+    if (t->alloc)
+        st->slack += sizeof(*t->arena) * (t->alloc - t->size);
+}
+
+/* Loaded indexes point into a mapping, and have an alloc of 0 */
+static void
+free_flat(struct flat *root)
+{
+    if (root->alloc)
+        free(root->arena);
+    free(root);
+}
+
+/* Flat VP-tree ====================
+
+   The VP-tree, as a flat tree.  Each node is followed directly by its
+   near subtree, so only the far child needs a link.  */
+
+enum {
+    VPF_LEAF = 1,               /* Node is a leaf */
+    VPF_NEAR = 2,               /* Near child follows this node */
+    VPF_DEAD = 4                /* Vantage point was removed */
+};
+
+struct vpf_node {
+    bkey_t vantage;
+    unsigned short threshold;
+    unsigned short flags;
+    /* Leaf: number of keys following the node.
+       Internal: offset of the far child relative to this node, or 0
+       if there is none.  */
+    uint32_t arg;
+};
+
+static inline struct vpf_node *
+vpf_node(const struct flat *restrict t, size_t pos)
+{
+    return (struct vpf_node *) (t->arena + pos);
+}
+
+static void
+vpf_build(struct flat *restrict t, bkey_t *restrict keys,
+          size_t n, size_t max_linear);
+
+struct vpf_job {
+    struct flat t;
+    bkey_t *keys;
+    size_t n, max_linear;
+};
+
+static void *
+vpf_job_run(void *arg)
+{
+    struct vpf_job *j = arg;
+    vpf_build(&j->t, j->keys, j->n, j->max_linear);
+    return NULL;
+}
+
+static void
+vpf_build(struct flat *restrict t, bkey_t *restrict keys,
+          size_t n, size_t max_linear)
+{
+    bkey_t rootkey;
+    size_t pos, nnear, nfar;
+    struct vpf_node *node;
+    struct vpf_job near, far;
+    struct task task;
+    unsigned k;
+
+    if (n <= max_linear || n <= 1) {
+        if (n > UINT32_MAX)
+            errx(1, "flat VP-tree leaf is too large");
+        pos = flat_alloc(t, sizeof(*node) + sizeof(bkey_t) * n);
+        node = vpf_node(t, pos);
+        memset(&node->vantage, 0, sizeof(node->vantage));
+        node->threshold = 0;
+        node->flags = VPF_LEAF;
+        node->arg = n;
+        memcpy(node + 1, keys, sizeof(bkey_t) * n);
+        return;
+    }
+
+    pos = flat_alloc(t, sizeof(*node));
+    rootkey = choose_vantage(keys, n);
+    n -= 1;
+    keys += 1;
+    k = vp_partition(rootkey, keys, n, &nnear, &nfar, NULL);
+    node = vpf_node(t, pos);
+    node->vantage = rootkey;
+    node->threshold = k;
+    node->flags = nnear ? VPF_NEAR : 0;
+    node->arg = 0;
+    if (nnear >= BUILD_FORK_MIN && nfar) {
+        /* Build the near subtree in its own arena, so the far subtree
+           can be built at the same time.  */
+        flat_init(&near.t);
+        near.keys = keys;
+        near.n = nnear;
+        near.max_linear = max_linear;
+        task_fork(&task, vpf_job_run, &near, nnear);
+        if (task.spawned) {
+            flat_init(&far.t);
+            vpf_build(&far.t, keys + nnear, nfar, max_linear);
+            task_join(&task);
+            flat_append(t, &near.t);
+            vpf_node(t, pos)->arg = t->size - pos;
+            flat_append(t, &far.t);
+            return;
+        }
+    }
+    if (nnear)
+        vpf_build(t, keys, nnear, max_linear);
+    if (nfar) {
+        /* The arena may have moved */
+        vpf_node(t, pos)->arg = t->size - pos;
+        vpf_build(t, keys + nnear, nfar, max_linear);
+    }
+}
+
+/* The leaves of a flat tree are copies, so this frees the keys.  */
+static struct flat *
+mktree_vpflat(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    struct flat t;
+    assert(n > 0);
+    flat_init(&t);
+    vpf_build(&t, keys, n, max_linear);
+    free(keys);
+    return flat_finish(&t);
+}
+
+static void
+vpf_measure(const flat_unit_t *restrict arena, uint32_t pos,
+            struct mtree_stats *st, unsigned depth)
+{
+    const struct vpf_node *node = (const struct vpf_node *) (arena + pos);
+    if (node->flags & VPF_LEAF) {
+        stats_leaf(st, node->arg, 0, depth);
+        return;
+    }
+    st->nodes++;
+    st->keys += !(node->flags & VPF_DEAD);
+    if (node->flags & VPF_NEAR)
+        vpf_measure(arena, pos + sizeof(*node) / sizeof(flat_unit_t), st,
+                    depth + 1);
+    if (node->arg)
+        vpf_measure(arena, pos + node->arg, st, depth + 1);
+}
+
+static void
+measure_vpflat(struct flat *root, struct mtree_stats *st)
+{
+    size_t keys = st->key_bytes;
+    vpf_measure(root->arena, 0, st, 0);
+    stats_flat(st, root, st->key_bytes - keys);
+}
+
+/* Convert a VP-tree to a flat VP-tree.  */
+static void
+vpf_from_vp(struct flat *restrict t, const struct vptree *restrict root)
+{
+    struct vpf_node *node;
+    size_t pos;
+    unsigned n;
+    if (root->linear) {
+        n = root->data.linear.count;
+        pos = flat_alloc(t, sizeof(*node) + sizeof(bkey_t) * n);
+        node = vpf_node(t, pos);
+        memset(&node->vantage, 0, sizeof(node->vantage));
+        node->threshold = 0;
+        node->flags = VPF_LEAF;
+        node->arg = n;
+        memcpy(node + 1, root->data.linear.keys, sizeof(bkey_t) * n);
+        return;
+    }
+    pos = flat_alloc(t, sizeof(*node));
+    node = vpf_node(t, pos);
+    node->vantage = root->data.tree.vantage;
+    node->threshold = root->data.tree.threshold;
+    node->flags = (root->data.tree.near ? VPF_NEAR : 0) |
+        (root->dead ? VPF_DEAD : 0);
+    node->arg = 0;
+    if (root->data.tree.near)
+        vpf_from_vp(t, root->data.tree.near);
+    if (root->data.tree.far) {
+        vpf_node(t, pos)->arg = t->size - pos;
+        vpf_from_vp(t, root->data.tree.far);
+    }
+}
+
+static size_t
+query_vpf(struct buf *restrict b, const flat_unit_t *restrict arena,
+          uint32_t pos, bkey_t ref, unsigned maxd)
+{
+    const struct vpf_node *node = (const struct vpf_node *) (arena + pos);
+    unsigned d, thr;
+    size_t nc = 1;
+    if (node->flags & VPF_LEAF) {
+        STAT_LEAF(node->arg);
+        scan_keys(b, (const bkey_t *) (node + 1), node->arg, ref, maxd);
+        return node->arg;
+    }
+    STAT_NODE();
+    d = distance(node->vantage, ref);
+    thr = node->threshold;
+    if (d <= maxd + thr) {
+        if (node->flags & VPF_NEAR)
+            nc += DESCEND(query_vpf(b, arena,
+                                    pos + sizeof(*node) / sizeof(flat_unit_t),
+                                    ref, maxd));
+        if (d <= maxd && !(node->flags & VPF_DEAD))
+            addkey(b, node->vantage);
+    }
+    if (d + maxd > thr && node->arg)
+        nc += DESCEND(query_vpf(b, arena, pos + node->arg, ref, maxd));
+    return nc;
+}
+
+/* As query_vpf(), with a stack like query_bk().  The near subtree
+   follows the node in the arena, so only the far one needs
+   prefetching.  */
+static inline __attribute__((always_inline)) size_t
+vpflat_search(struct buf *restrict b, struct flat *restrict root,
+              bkey_t ref, unsigned maxd)
+{
+    struct query_frame stack[QUERY_STACK], *sp = stack;
+    const flat_unit_t *restrict arena = root->arena;
+    const struct vpf_node *node;
+    unsigned d, thr, near, far;
+    uint32_t pos = 0;
+    size_t nc = 0;
+    STAT_SAVE(depth);
+    for (;;) {
+        node = (const struct vpf_node *) (arena + pos);
+        if (node->flags & VPF_LEAF) {
+            STAT_LEAF(node->arg);
+            scan_keys(b, (const bkey_t *) (node + 1), node->arg, ref, maxd);
+            nc += node->arg;
+        } else {
+            d = distance(node->vantage, ref);
+            thr = node->threshold;
+            nc++;
+            STAT_NODE();
+            if (d <= maxd && !(node->flags & VPF_DEAD))
+                addkey(b, node->vantage);
+            near = d <= maxd + thr && (node->flags & VPF_NEAR);
+            far = d + maxd > thr && node->arg;
+            if (near && far) {
+                if (sp == stack + QUERY_STACK) {
+                    nc += DESCEND(query_vpf(b, arena, pos + node->arg,
+                                            ref, maxd));
+                } else {
+                    __builtin_prefetch(arena + pos + node->arg);
+                    sp->pos = pos + node->arg;
+                    STAT_PUSH(sp);
+                    sp++;
+                }
+                far = 0;
+            }
+            if (near || far) {
+                pos += near ? sizeof(*node) / sizeof(flat_unit_t)
+                    : node->arg;
+                STAT_DOWN();
+                continue;
+            }
+        }
+        if (sp == stack)
+            break;
+        --sp;
+        pos = sp->pos;
+        STAT_POP(sp);
+    }
+    STAT_RESTORE(depth);
+    return nc;
+}
+
+static size_t
+query_vpflat(struct buf *restrict b, struct flat *restrict root,
+             bkey_t ref, unsigned maxd)
+{
+#define SEARCH(r) vpflat_search(b, root, ref, r)
+    FIXED_SWITCH(maxd, SEARCH);
+#undef SEARCH
+}
+
+static void
+block_vpf(struct buf *restrict b, const flat_unit_t *restrict arena,
+          uint32_t pos, struct mtree_query *restrict q,
+          const unsigned short *restrict idx, size_t nq)
+{
+    const struct vpf_node *node = (const struct vpf_node *) (arena + pos);
+    unsigned short near[QBLOCK_MAX], far[QBLOCK_MAX];
+    size_t i, j, nn, nf;
+    unsigned d, thr;
+    if (node->flags & VPF_LEAF) {
+        for (i = 0; i < nq; ++i) {
+            j = idx[i];
+            scan_keys(&b[j], (const bkey_t *) (node + 1), node->arg,
+                      q[j].key, q[j].maxd);
+            q[j].cmp += node->arg;
+        }
+        return;
+    }
+    thr = node->threshold;
+    for (i = 0, nn = 0, nf = 0; i < nq; ++i) {
+        j = idx[i];
+        d = distance(node->vantage, q[j].key);
+        q[j].cmp += 1;
+        if (d <= q[j].maxd + thr) {
+            near[nn++] = j;
+            if (d <= q[j].maxd && !(node->flags & VPF_DEAD))
+                addkey(&b[j], node->vantage);
+        }
+        if (d + q[j].maxd > thr)
+            far[nf++] = j;
+    }
+    if (nn && (node->flags & VPF_NEAR))
+        block_vpf(b, arena, pos + sizeof(*node) / sizeof(flat_unit_t),
+                  q, near, nn);
+    if (nf && node->arg)
+        block_vpf(b, arena, pos + node->arg, q, far, nf);
+}
+
+static void
+qblock_vpflat(struct buf *restrict b, struct flat *restrict root,
+              struct mtree_query *restrict q, size_t nq)
+{
+    unsigned short idx[QBLOCK_MAX];
+    size_t i;
+    assert(nq <= QBLOCK_MAX);
+    for (i = 0; i < nq; ++i)
+        idx[i] = i;
+    block_vpf(b, root->arena, 0, q, idx, nq);
+}
+
+/* Flat BK-tree ====================
+
+   The BK-tree, as a flat tree.  The first child of each node follows
+   it directly, and each child links to its next sibling.  This is
+   built by converting a BK-tree, so the build is parallel.  */
+
+enum {
+    BKF_LEAF = 1,               /* Node is a leaf */
+    BKF_CHILD = 2,              /* First child follows this node */
+    BKF_DEAD = 4                /* Key was removed */
+};
+
+struct bkf_node {
+    bkey_t key;
+    unsigned short distance;
+    unsigned short flags;
+    /* Offset of the next sibling relative to this node, or 0 */
+    uint32_t sibling;
+    /* Leaf: number of keys following the node */
+    uint32_t count;
+};
+
+static inline struct bkf_node *
+bkf_node(const struct flat *restrict t, size_t pos)
+{
+    return (struct bkf_node *) (t->arena + pos);
+}
+
+static void
+bkf_from_bk(struct flat *restrict t, const struct bktree *restrict root)
+{
+    size_t pos, cpos, prev = 0;
+    struct bkf_node *node;
+    const struct bktree *p;
+    unsigned n;
+    if (root->linear) {
+        n = root->data.linear.count;
+        pos = flat_alloc(t, sizeof(*node) + sizeof(bkey_t) * n);
+        node = bkf_node(t, pos);
+        memset(&node->key, 0, sizeof(node->key));
+        node->distance = root->distance;
+        node->flags = BKF_LEAF;
+        node->sibling = 0;
+        node->count = n;
+        memcpy(node + 1, root->data.linear.keys, sizeof(bkey_t) * n);
+        return;
+    }
+    pos = flat_alloc(t, sizeof(*node));
+    node = bkf_node(t, pos);
+    node->key = root->data.tree.key;
+    node->distance = root->distance;
+    node->flags = (root->data.tree.child ? BKF_CHILD : 0) |
+        (root->dead ? BKF_DEAD : 0);
+    node->sibling = 0;
+    node->count = 0;
+    for (p = root->data.tree.child; p; p = p->sibling) {
+        cpos = t->size;
+        bkf_from_bk(t, p);
+        if (prev)
+            bkf_node(t, prev)->sibling = cpos - prev;
+        prev = cpos;
+    }
+}
+
+static struct flat *
+mktree_bkflat(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    struct bktree *bk;
+    struct flat t;
+    bk = mktree_bk(keys, n, max_linear);
+    flat_init(&t);
+    bkf_from_bk(&t, bk);
+    free_bk(bk);
+    free(keys);
+    return flat_finish(&t);
+}
+
+static void
+bkf_measure(const flat_unit_t *restrict arena, uint32_t pos,
+            struct mtree_stats *st, unsigned depth)
+{
+    const struct bkf_node *node = (const struct bkf_node *) (arena + pos);
+    uint32_t cpos;
+    if (node->flags & BKF_LEAF) {
+        stats_leaf(st, node->count, 0, depth);
+        return;
+    }
+    st->nodes++;
+    st->keys += !(node->flags & BKF_DEAD);
+    if (!(node->flags & BKF_CHILD))
+        return;
+    cpos = pos + sizeof(*node) / sizeof(flat_unit_t);
+    for (;;) {
+        bkf_measure(arena, cpos, st, depth + 1);
+        node = (const struct bkf_node *) (arena + cpos);
+        if (!node->sibling)
+            break;
+        cpos += node->sibling;
+    }
+}
+
+static void
+measure_bkflat(struct flat *root, struct mtree_stats *st)
+{
+    size_t keys = st->key_bytes;
+    bkf_measure(root->arena, 0, st, 0);
+    stats_flat(st, root, st->key_bytes - keys);
+}
+
+static size_t
+query_bkf(struct buf *restrict b, const flat_unit_t *restrict arena,
+          uint32_t pos, bkey_t ref, unsigned maxd)
+{
+    const struct bkf_node *node = (const struct bkf_node *) (arena + pos);
+    const struct bkf_node *p;
+    unsigned d;
+    size_t nc = 1;
+    uint32_t cpos;
+    if (node->flags & BKF_LEAF) {
+        STAT_LEAF(node->count);
+        scan_keys(b, (const bkey_t *) (node + 1), node->count, ref, maxd);
+        return node->count;
+    }
+    STAT_NODE();
+    d = distance(node->key, ref);
+    if (d <= maxd && !(node->flags & BKF_DEAD))
+        addkey(b, node->key);
+    if (!(node->flags & BKF_CHILD))
+        return nc;
+    /* See query_bk() */
+    cpos = pos + sizeof(*node) / sizeof(flat_unit_t);
+    for (;;) {
+        p = (const struct bkf_node *) (arena + cpos);
+        if (p->distance > maxd + d)
+            break;
+        if (p->distance + maxd >= d)
+            nc += DESCEND(query_bkf(b, arena, cpos, ref, maxd));
+        if (!p->sibling)
+            break;
+        cpos += p->sibling;
+    }
+    return nc;
+}
+
+/* As query_bkf(), with a stack like query_bk().  A frame holds the
+   position of the next sibling, or 0 if there is none.  */
+static inline __attribute__((always_inline)) size_t
+bkflat_search(struct buf *restrict b, struct flat *restrict root,
+              bkey_t ref, unsigned maxd)
+{
+    struct query_frame stack[QUERY_STACK], *sp = stack;
+    const flat_unit_t *restrict arena = root->arena;
+    const struct bkf_node *node, *p = NULL;
+    uint32_t pos = 0, cpos;
+    unsigned d;
+    size_t nc = 0;
+    STAT_SAVE(depth);
+    for (;;) {
+        node = (const struct bkf_node *) (arena + pos);
+        if (node->flags & BKF_LEAF) {
+            STAT_LEAF(node->count);
+            scan_keys(b, (const bkey_t *) (node + 1), node->count, ref, maxd);
+            nc += node->count;
+        } else {
+            d = distance(node->key, ref);
+            nc++;
+            STAT_NODE();
+            if (d <= maxd && !(node->flags & BKF_DEAD))
+                addkey(b, node->key);
+            cpos = 0;
+            if (node->flags & BKF_CHILD) {
+                cpos = pos + sizeof(*node) / sizeof(flat_unit_t);
+                for (;;) {
+                    p = (const struct bkf_node *) (arena + cpos);
+                    if (p->distance + maxd >= d || !p->sibling)
+                        break;
+                    cpos += p->sibling;
+                }
+                if (p->distance + maxd < d || p->distance > maxd + d)
+                    cpos = 0;
+            }
+            if (cpos && sp != stack + QUERY_STACK) {
+                if (p->sibling)
+                    __builtin_prefetch(arena + cpos + p->sibling);
+                sp->pos = p->sibling ? cpos + p->sibling : 0;
+                sp->pd = d;
+                STAT_PUSH(sp);
+                sp++;
+                pos = cpos;
+                STAT_DOWN();
+                continue;
+            }
+            for (; cpos; cpos = p->sibling ? cpos + p->sibling : 0) {
+                p = (const struct bkf_node *) (arena + cpos);
+                if (p->distance > maxd + d)
+                    break;
+                nc += DESCEND(query_bkf(b, arena, cpos, ref, maxd));
+            }
+        }
+        /* Go on with the next child in range of the nearest node */
+        for (; sp != stack; --sp) {
+            if (!sp[-1].pos)
+                continue;
+            p = (const struct bkf_node *) (arena + sp[-1].pos);
+            if (p->distance <= maxd + sp[-1].pd)
+                break;
+        }
+        if (sp == stack)
+            break;
+        cpos = sp[-1].pos;
+        if (p->sibling)
+            __builtin_prefetch(arena + cpos + p->sibling);
+        sp[-1].pos = p->sibling ? cpos + p->sibling : 0;
+        pos = cpos;
+        STAT_POP(sp - 1);
+    }
+    STAT_RESTORE(depth);
+    return nc;
+}
+
+static size_t
+query_bkflat(struct buf *restrict b, struct flat *restrict root,
+             bkey_t ref, unsigned maxd)
+{
+#define SEARCH(r) bkflat_search(b, root, ref, r)
+    FIXED_SWITCH(maxd, SEARCH);
+#undef SEARCH
+}
+
+/* Multi-index hashing ====================
+
+   The keys are split into m substrings, and there is a table for each
+   substring which sorts the keys by the value of that substring.  If
+   two keys are within distance r, then by the pigeonhole principle at
+   least one of their substrings is within distance r/m (rounded down),
+   so a query looks up every value within that distance of each of its
+   substrings, and checks the keys it finds with distance().  A key
+   can be found through more than one substring, so it is only
+   reported by the first substring which finds it.
+
+   Each table is an array of keys in order of substring, with a table
+   of where each substring value starts, so a lookup is two loads and a
+   scan over contiguous keys.  The tables hold copies of the keys,
+   which costs memory but keeps the scan local.  This is much faster
+   than the trees for small radii, but the number of lookups grows
+   quickly with r/m, so larger queries fall back to a linear scan.  */
+
+enum {
+    MIH_MAX_WIDTH = 24,
+    /* Scan everything if a query would look at more than 1/MIH_SCAN
+       of the keys, since a scan is that much faster per key */
+    MIH_SCAN = 32
+};
+
+struct mih_table {
+    unsigned pos, width;
+    /* Index into keys for each substring value, and one past the last */
+    uint32_t *start;
+    bkey_t *keys;
+};
+
+struct mih {
+    size_t count;
+    bkey_t *keys;
+    unsigned m;
+    struct mih_table *table;
+};
+
+/* Extract the substring of 'width' bits at 'pos'.  */
+static inline uint32_t
+key_sub(bkey_t k, unsigned pos, unsigned width)
+{
+    uint64_t x, mask = ((uint64_t) 1 << width) - 1;
+#if KEY_WIDE
+    x = k.w[pos / 64] >> (pos % 64);
+    if (pos % 64 + width > 64)
+        x |= k.w[pos / 64 + 1] << (64 - pos % 64);
+#else
+    x = (uint64_t) k >> pos;
+#endif
+    return x & mask;
+}
+
+struct mih_job {
+    struct mih_table *t;
+    const bkey_t *keys;
+    size_t n;
+};
+
+/* Sort the keys into a table by counting.  */
+static void *
+mih_job_run(void *arg)
+{
+    struct mih_job *j = arg;
+    struct mih_table *t = j->t;
+    size_t i, nv = (size_t) 1 << t->width;
+    uint32_t a, c, *pos;
+    t->start = xmalloc(sizeof(*t->start) * (nv + 1));
+    t->keys = xmalloc(sizeof(*t->keys) * j->n);
+    memset(t->start, 0, sizeof(*t->start) * (nv + 1));
+    for (i = 0; i < j->n; ++i)
+        t->start[key_sub(j->keys[i], t->pos, t->width)]++;
+    for (i = 0, a = 0; i <= nv; ++i) {
+        c = t->start[i];
+        t->start[i] = a;
+        a += c;
+    }
+    pos = xmalloc(sizeof(*pos) * nv);
+    memcpy(pos, t->start, sizeof(*pos) * nv);
+    for (i = 0; i < j->n; ++i)
+        t->keys[pos[key_sub(j->keys[i], t->pos, t->width)]++] = j->keys[i];
+    free(pos);
+    return NULL;
+}
+
+/* For "mih", max_linear is the number of substrings, or 0 to choose
+   substrings of about log2(n) bits.  */
+static struct mih *
+mktree_mih(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    struct mih_job job[KEY_BITS];
+    struct task task[KEY_BITS];
+    struct mih *root;
+    unsigned i, m = max_linear, w, lg = 1, wmax, mmin, mmax;
+    assert(n > 0);
+    if (n > UINT32_MAX)
+        errx(1, "too many keys for mih");
+    while (lg < 63 && ((size_t) 1 << lg) < n)
+        lg++;
+    /* Keep the start tables within a few times the size of the keys */
+    wmax = lg + 4 < MIH_MAX_WIDTH ? lg + 4 : MIH_MAX_WIDTH;
+    mmin = (KEY_BITS + wmax - 1) / wmax;
+    mmax = KEY_BITS / 4;
+    if (!m)
+        m = (KEY_BITS + lg / 2) / lg;
+    if (m < mmin)
+        m = mmin;
+    if (m > mmax)
+        m = mmax;
+    w = (KEY_BITS + m - 1) / m;
+
+    root = xmalloc(sizeof(*root));
+    root->count = n;
+    root->keys = keys;
+    root->m = m;
+    root->table = xmalloc(sizeof(*root->table) * m);
+    for (i = 0; i < m; ++i) {
+        root->table[i].pos = i * w;
+        root->table[i].width = KEY_BITS - i * w < w ? KEY_BITS - i * w : w;
+        job[i].t = &root->table[i];
+        job[i].keys = keys;
+        job[i].n = n;
+        task_fork(&task[i], mih_job_run, &job[i], n);
+    }
+    for (i = 0; i < m; ++i)
+        task_join(&task[i]);
+    return root;
+}
+
+/* The keys are counted once for the array and once for each table */
+static void
+measure_mih(struct mih *root, struct mtree_stats *st)
+{
+    unsigned i;
+    st->keys += root->count;
+    st->key_bytes += sizeof(bkey_t) * root->count * (root->m + 1);
+    st->node_bytes += sizeof(*root) + sizeof(*root->table) * root->m;
+    for (i = 0; i < root->m; ++i)
+        st->node_bytes += sizeof(uint32_t) *
+            (((size_t) 1 << root->table[i].width) + 1);
+}
+
+static void
+free_mih(struct mih *root)
+{
+    unsigned i;
+    for (i = 0; i < root->m; ++i) {
+        free(root->table[i].start);
+        free(root->table[i].keys);
+    }
+    free(root->table);
+    free(root);
+}
+
+struct mih_query {
+    struct buf *b;
+    const struct mih *t;
+    bkey_t ref;
+    unsigned maxd, r;
+    size_t nc;
+    uint32_t sub[KEY_BITS];
+};
+
+/* Check the keys with substring 'v' in table 'i'.  */
+static void
+mih_bucket(struct mih_query *q, unsigned i, uint32_t v)
+{
+    const struct mih_table *t = &q->t->table[i];
+    const bkey_t *p = t->keys + t->start[v], *e = t->keys + t->start[v + 1];
+    const struct mih_table *u;
+    unsigned j;
+    STAT_LEAF(e - p);
+    q->nc += e - p;
+    for (; p < e; ++p) {
+        if (distance(*p, q->ref) > q->maxd)
+            continue;
+        /* Was it found in an earlier table? */
+        for (j = 0; j < i; ++j) {
+            u = &q->t->table[j];
+            if (popcount64_swar(key_sub(*p, u->pos, u->width) ^ q->sub[j])
+                <= q->r)
+                break;
+        }
+        if (j == i)
+            addkey(q->b, *p);
+    }
+}
+
+/* Look up every value within 'left' more bit flips of v, flipping
+   only the bits from 'first' up, so each value is visited once.  */
+static void
+mih_probe(struct mih_query *q, unsigned i, uint32_t v, unsigned first,
+          unsigned left)
+{
+    unsigned bit;
+    mih_bucket(q, i, v);
+    if (left)
+        for (bit = first; bit < q->t->table[i].width; ++bit)
+            mih_probe(q, i, v ^ ((uint32_t) 1 << bit), bit + 1, left - 1);
+}
+
+static size_t
+query_mih(struct buf *restrict b, struct mih *restrict root,
+          bkey_t ref, unsigned maxd)
+{
+    struct mih_query q;
+    double probes = 0, c;
+    unsigned i, j, w;
+    q.b = b;
+    q.t = root;
+    q.ref = ref;
+    q.maxd = maxd;
+    q.r = maxd / root->m;
+    for (i = 0; i < root->m; ++i) {
+        w = root->table[i].width;
+        for (j = 0, c = 1; j <= q.r && j <= w; ++j) {
+            probes += c * (1 + root->count / ((double) ((size_t) 1 << w)));
+            c = c * (w - j) / (j + 1);
+        }
+    }
+    if (probes * MIH_SCAN > root->count) {
+        STAT_LEAF(root->count);
+        scan_keys(b, root->keys, root->count, ref, maxd);
+        return root->count;
+    }
+    q.nc = 0;
+    for (i = 0; i < root->m; ++i)
+        q.sub[i] = key_sub(ref, root->table[i].pos, root->table[i].width);
+    for (i = 0; i < root->m; ++i)
+        mih_probe(&q, i, q.sub[i], 0, q.r);
+    return q.nc;
+}
+
+/* Index files ====================
+
+   An index file holds a flat tree, or the keys of a linear index,
+   after a header.  The data is aligned for SIMD, and it is mapped
+   into memory and queried in place, so loading an index takes no
+   time beyond the page faults.  Pointer trees are converted to the
+   equivalent flat tree when they are saved.  Files are in native byte
+   order, and the header records the byte order and key width.  */
+
+#define INDEX_MAGIC "MTREEIDX"
+
+enum {
+    INDEX_VERSION = 1,
+    INDEX_BYTE_ORDER = 0x01020304,
+    INDEX_ALIGN = 64
+};
+
+enum {
+    INDEX_LINEAR = 1,
+    INDEX_VPFLAT = 2,
+    INDEX_BKFLAT = 3
+};
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_bits;
+    uint32_t format;
+    uint32_t unit;
+    uint32_t reserved;
+    /* Number of keys the index was built from */
+    uint64_t nkeys;
+    /* Keys in a linear index, or units in a flat tree */
+    uint64_t count;
+    /* Position and size of the data in bytes */
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* The data for an index file */
+struct index_image {
+    uint32_t format;
+    const void *data;
+    size_t count;
+    size_t size;
+    /* Flat tree built for the file, if any */
+    struct flat tmp;
+};
+
+typedef void (*image_t)(struct index_image *, void *);
+
+static void
+image_linear(struct index_image *im, struct linear *root)
+{
+    im->format = INDEX_LINEAR;
+    im->data = root->keys;
+    im->count = root->count;
+    im->size = sizeof(bkey_t) * root->count;
+}
+
+static void
+image_flat(struct index_image *im, uint32_t format, const struct flat *t)
+{
+    im->format = format;
+    im->data = t->arena;
+    im->count = t->size;
+    im->size = sizeof(flat_unit_t) * t->size;
+}
+
+static void
+image_vpflat(struct index_image *im, struct flat *root)
+{
+    image_flat(im, INDEX_VPFLAT, root);
+}
+
+static void
+image_bkflat(struct index_image *im, struct flat *root)
+{
+    image_flat(im, INDEX_BKFLAT, root);
+}
+
+static void
+image_vp(struct index_image *im, struct vptree *root)
+{
+    vpf_from_vp(&im->tmp, root);
+    image_flat(im, INDEX_VPFLAT, &im->tmp);
+}
+
+static void
+image_bk(struct index_image *im, struct bktree *root)
+{
+    bkf_from_bk(&im->tmp, root);
+    image_flat(im, INDEX_BKFLAT, &im->tmp);
+}
+
+/* Write all of a buffer, or return -1.  */
+static int
+xwrite(int fd, const void *p, size_t n)
+{
+    ssize_t r;
+    while (n) {
+        r = write(fd, p, n);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p = (const char *) p + r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* Write an index to a file.  It is written to a temporary file first,
+   so processes which have the old file mapped are not affected.
+   Returns 0, or -1 if the file can't be written.  */
+static int
+index_save(const char *path, image_t image, void *root, size_t nkeys)
+{
+    static const char zero[INDEX_ALIGN];
+    struct index_header h;
+    struct index_image im;
+    char *tmp;
+    size_t len = strlen(path);
+    int fd, r, e;
+
+    flat_init(&im.tmp);
+    image(&im, root);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.version = INDEX_VERSION;
+    h.byte_order = INDEX_BYTE_ORDER;
+    h.key_bits = KEY_BITS;
+    h.format = im.format;
+    h.unit = sizeof(flat_unit_t);
+    h.nkeys = nkeys;
+    h.count = im.count;
+    h.offset = INDEX_ALIGN;
+    h.size = im.size;
+
+    tmp = xmalloc(len + 5);
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    r = fd < 0 ? -1 : 0;
+    if (!r) {
+        r = xwrite(fd, &h, sizeof(h)) ||
+            xwrite(fd, zero, h.offset - sizeof(h)) ||
+            xwrite(fd, im.data, im.size) ? -1 : 0;
+        e = errno;
+        if (close(fd) && !r) {
+            r = -1;
+            e = errno;
+        }
+        if (!r && rename(tmp, path)) {
+            r = -1;
+            e = errno;
+        }
+        if (r)
+            unlink(tmp);
+        errno = e;
+    }
+    free(tmp);
+    free(im.tmp.arena);
+    return r;
+}
+
+/* Units of a node with 'keys' keys after it, or 0 if it doesn't fit
+   in 'room' */
+static uint64_t
+flat_check_units(uint64_t header, uint64_t keys, uint64_t room)
+{
+    uint64_t units;
+    if (keys > room * sizeof(flat_unit_t) / sizeof(bkey_t))
+        return 0;
+    units = (header + sizeof(bkey_t) * keys + sizeof(flat_unit_t) - 1) /
+        sizeof(flat_unit_t);
+    return units <= room ? units : 0;
+}
+
+static uint64_t *
+flat_check_push(uint64_t *stack, size_t *sp, size_t *alloc, uint64_t pos)
+{
+    if (*sp == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 64;
+        stack = realloc(stack, sizeof(*stack) * *alloc);
+        if (!stack)
+            err(1, "realloc");
+    }
+    stack[(*sp)++] = pos;
+    return stack;
+}
+
+/* Check that a flat tree from a file is laid out as it is built, in
+   preorder, with each subtree right after the one before it, so that
+   every link and leaf stays inside its 'size' units.  A subtree can
+   only be where the one before it ends, so this is one pass over the
+   nodes, with a stack of its own so that a file can't make it recurse
+   without bound.  Returns 0, or -1 if the tree is corrupt.  */
+static int
+flat_check(uint32_t format, const flat_unit_t *arena, uint64_t size)
+{
+    const struct vpf_node *vn;
+    const struct bkf_node *bn;
+    uint64_t *stack = NULL, pos = 0, end, n;
+    size_t sp = 0, alloc = 0;
+    int r = -1;
+
+    for (;;) {
+        /* Look at the node at pos, and find where it ends if it has
+           no subtrees */
+        if (format == INDEX_VPFLAT) {
+            n = flat_check_units(sizeof(*vn), 0, size - pos);
+            if (!n)
+                break;
+            vn = (const struct vpf_node *) (arena + pos);
+            if (vn->flags & VPF_LEAF) {
+                n = flat_check_units(sizeof(*vn), vn->arg, size - pos);
+                if (!n)
+                    break;
+                end = pos + n;
+            } else if (vn->flags & VPF_NEAR) {
+                if (vn->arg) {
+                    /* Where the far subtree has to start */
+                    if (vn->arg <= n || vn->arg >= size - pos)
+                        break;
+                    stack = flat_check_push(stack, &sp, &alloc,
+                                            pos + vn->arg);
+                }
+                pos += n;
+                continue;
+            } else if (vn->arg) {
+                if (vn->arg != n)
+                    break;
+                pos += n;
+                continue;
+            } else {
+                end = pos + n;
+            }
+            /* Go on with the far subtree this one comes before */
+            if (sp && stack[sp - 1] != end)
+                break;
+        } else {
+            n = flat_check_units(sizeof(*bn), 0, size - pos);
+            if (!n)
+                break;
+            bn = (const struct bkf_node *) (arena + pos);
+            if (!pos && bn->sibling)
+                break;
+            if (!(bn->flags & BKF_LEAF) && (bn->flags & BKF_CHILD)) {
+                /* The stack holds each child being walked */
+                stack = flat_check_push(stack, &sp, &alloc, pos + n);
+                pos += n;
+                continue;
+            }
+            if (bn->flags & BKF_LEAF) {
+                n = flat_check_units(sizeof(*bn), bn->count, size - pos);
+                if (!n)
+                    break;
+            }
+            end = pos + n;
+            /* Go up to the nearest child with a next sibling, which
+               has to be where this subtree ends */
+            for (; sp; --sp) {
+                bn = (const struct bkf_node *) (arena + stack[sp - 1]);
+                if (bn->sibling)
+                    break;
+            }
+            if (sp) {
+                if (stack[sp - 1] + bn->sibling != end)
+                    break;
+                stack[sp - 1] = end;
+                pos = end;
+                continue;
+            }
+        }
+        if (!sp) {
+            r = end == size ? 0 : -1;
+            break;
+        }
+        pos = end;
+        if (format == INDEX_VPFLAT)
+            --sp;
+    }
+    free(stack);
+    return r;
+}
+
+/* Check the header of a mapped index file of 'size' bytes.  Returns
+   0, or an errno: EINVAL if it isn't an index file or is corrupt, and
+   ENOTSUP if it is from another build.  */
+static int
+index_check(const struct index_header *h, uint64_t size)
+{
+    const flat_unit_t *arena = (const flat_unit_t *)
+        ((const char *) h + h->offset);
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)))
+        return EINVAL;
+    if (h->version != INDEX_VERSION || h->byte_order != INDEX_BYTE_ORDER ||
+        h->key_bits != KEY_BITS)
+        return ENOTSUP;
+    if (h->unit != sizeof(flat_unit_t) || h->offset % INDEX_ALIGN ||
+        h->offset > size || h->size > size - h->offset)
+        return EINVAL;
+    switch (h->format) {
+    case INDEX_LINEAR:
+        return h->size == sizeof(bkey_t) * h->count ? 0 : EINVAL;
+    case INDEX_VPFLAT:
+    case INDEX_BKFLAT:
+        if (h->size != sizeof(flat_unit_t) * h->count || !h->count ||
+            h->count > UINT32_MAX || flat_check(h->format, arena, h->count))
+            return EINVAL;
+        return 0;
+    default:
+        return ENOTSUP;
+    }
+}
+
+/* Map an index file into memory.  Returns the format and the index,
+   which points into the mapping, and the mapping, to unmap once the
+   index is freed.  Returns NULL if the file can't be read, or fails
+   index_check().  */
+static void *
+index_load(const char *path, uint32_t *format, size_t *nkeys,
+           void **mapping, size_t *mapsize)
+{
+    const struct index_header *h;
+    struct linear *lin;
+    struct flat *t;
+    struct stat st;
+    const char *map;
+    int fd, e;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    e = fstat(fd, &st) ? errno
+        : (size_t) st.st_size < sizeof(*h) ? EINVAL : 0;
+    if (e) {
+        close(fd);
+        errno = e;
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    e = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = e;
+        return NULL;
+    }
+    h = (const struct index_header *) map;
+    e = index_check(h, st.st_size);
+    if (e) {
+        munmap((void *) map, st.st_size);
+        errno = e;
+        return NULL;
+    }
+
+    *mapping = (void *) map;
+    *mapsize = st.st_size;
+    *format = h->format;
+    *nkeys = h->nkeys;
+    if (h->format == INDEX_LINEAR) {
+        lin = xmalloc(sizeof(*lin));
+        lin->count = h->count;
+        lin->keys = (bkey_t *) (map + h->offset);
+        linear_slice(lin);
+        return lin;
+    }
+    t = xmalloc(sizeof(*t));
+    t->arena = (flat_unit_t *) (map + h->offset);
+    t->size = h->count;
+    t->alloc = 0;
+    return t;
+}
+
+/* Key files ====================
+
+   Keys can be read from a file instead of being generated.  In a
+   binary file, each key is a little-endian integer of KEY_BITS / 8
+   bytes.  In a hex file, each key is a hex number of up to
+   KEY_BITS / 4 digits, and keys are separated by whitespace.  Files
+   are read in large chunks and decoded straight into the key array,
+   which is sized from the file size up front where possible, so
+   reading keys takes little more memory than the keys themselves.
+   Pipes work too.  */
+
+enum {
+    KEY_BYTES = KEY_BITS / 8,
+    KEY_DIGITS = KEY_BITS / 4,
+    READ_CHUNK = 1 << 20
+};
+
+/* Decode a key stored as a little-endian integer.  The compiler turns
+   this into a plain load on little-endian machines.  */
+static inline bkey_t
+key_load_le(const unsigned char *p)
+{
+    bkey_t k;
+    unsigned j;
+#if KEY_WIDE
+    unsigned i;
+    for (i = 0; i < KEY_WORDS; ++i) {
+        k.w[i] = 0;
+        for (j = 0; j < 8; ++j)
+            k.w[i] |= (uint64_t) p[8 * i + j] << (8 * j);
+    }
+#else
+    k = 0;
+    for (j = 0; j < KEY_BYTES; ++j)
+        k |= (bkey_t) p[j] << (8 * j);
+#endif
+    return k;
+}
+
+/* The inverse of key_load_le() */
+static inline void
+key_store_le(unsigned char *p, bkey_t k)
+{
+    unsigned j;
+#if KEY_WIDE
+    unsigned i;
+    for (i = 0; i < KEY_WORDS; ++i)
+        for (j = 0; j < 8; ++j)
+            p[8 * i + j] = k.w[i] >> (8 * j);
+#else
+    for (j = 0; j < KEY_BYTES; ++j)
+        p[j] = k >> (8 * j);
+#endif
+}
+
+struct key_reader {
+    int fd;
+    int eof;
+    int error;
+    unsigned char *buf;
+    size_t pos, len;
+};
+
+/* Read more data, after moving the unused data to the start of the
+   buffer.  Returns the number of bytes in the buffer.  A read error
+   is kept in 'error' and ends the file.  */
+static size_t
+reader_fill(struct key_reader *r)
+{
+    ssize_t n;
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    while (!r->eof && r->len < READ_CHUNK) {
+        n = read(r->fd, r->buf + r->len, READ_CHUNK - r->len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            r->error = errno;
+            r->eof = 1;
+            break;
+        }
+        if (!n)
+            r->eof = 1;
+        r->len += n;
+    }
+    return r->len;
+}
+
+static int
+hexdigit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int
+is_space(int c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' ||
+        c == '\v' || c == '\f';
+}
+
+/* Read the next key from a hex file.  Returns 0 at the end, or -1
+   with 'error' set if the file isn't valid.  */
+static int
+read_hex(struct key_reader *r, bkey_t *key)
+{
+    unsigned char bytes[KEY_BYTES];
+    const unsigned char *p, *e;
+    size_t len, j;
+    int v;
+    for (;;) {
+        while (r->pos < r->len && is_space(r->buf[r->pos]))
+            r->pos++;
+        if (r->pos == r->len && !reader_fill(r))
+            return 0;
+        for (len = 0; r->pos + len < r->len; ++len)
+            if (is_space(r->buf[r->pos + len]))
+                break;
+        if (r->pos + len < r->len || r->eof)
+            break;
+        if (!r->pos) {
+            r->error = EINVAL;
+            return -1;
+        }
+        reader_fill(r);
+    }
+    p = r->buf + r->pos;
+    e = p + len;
+    r->pos += len;
+    if (e - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+    if (e - p > KEY_DIGITS) {
+        r->error = EINVAL;
+        return -1;
+    }
+    memset(bytes, 0, sizeof(bytes));
+    for (j = 0; e > p; ++j) {
+        v = hexdigit(*--e);
+        if (v < 0) {
+            r->error = EINVAL;
+            return -1;
+        }
+        bytes[j / 2] |= v << (4 * (j & 1));
+    }
+    *key = key_load_le(bytes);
+    return 1;
+}
+
+/* Read the next key from a binary file.  Returns 0 at the end, or
+   -1 with 'error' set if it ends with a partial key.  */
+static int
+read_bin(struct key_reader *r, bkey_t *key)
+{
+    if (r->len - r->pos < KEY_BYTES && reader_fill(r) < KEY_BYTES) {
+        if (!r->len)
+            return 0;
+        if (!r->error)
+            r->error = EINVAL;
+        return -1;
+    }
+    *key = key_load_le(r->buf + r->pos);
+    r->pos += KEY_BYTES;
+    return 1;
+}
+
+mtree_key_t *
+mtree_keys_read(const char *spec, size_t max, size_t *count)
+{
+    int (*next)(struct key_reader *, bkey_t *) = read_bin;
+    struct key_reader r;
+    struct stat st;
+    size_t n = 0, alloc = 0, unit = KEY_BYTES;
+    bkey_t *keys = NULL, k;
+    int e;
+
+    if (!strncmp(spec, "hex:", 4)) {
+        next = read_hex;
+        unit = KEY_DIGITS + 1;
+        spec += 4;
+    } else if (!strncmp(spec, "bin:", 4)) {
+        spec += 4;
+    }
+    *count = 0;
+    if (!strcmp(spec, "-")) {
+        r.fd = 0;
+    } else {
+        r.fd = open(spec, O_RDONLY);
+        if (r.fd < 0)
+            return NULL;
+    }
+    /* For hex files this assumes full-width keys, one per line */
+    if (!fstat(r.fd, &st) && S_ISREG(st.st_mode))
+        alloc = st.st_size / unit;
+    if (max && (!alloc || alloc > max))
+        alloc = max;
+    if (alloc)
+        keys = xmalloc(sizeof(*keys) * alloc);
+    r.eof = r.error = 0;
+    r.buf = xmalloc(READ_CHUNK);
+    r.pos = r.len = 0;
+
+    while ((!max || n < max) && next(&r, &k) > 0) {
+        if (n == alloc) {
+            alloc = alloc ? alloc + alloc / 2 : READ_CHUNK / sizeof(k);
+            if (max && alloc > max)
+                alloc = max;
+            keys = realloc(keys, sizeof(*keys) * alloc);
+            if (!keys)
+                err(1, "realloc");
+        }
+        keys[n++] = k;
+    }
+    e = r.error;
+    free(r.buf);
+    if (r.fd)
+        close(r.fd);
+    if (e) {
+        free(keys);
+        errno = e;
+        return NULL;
+    }
+    /* Even no keys is an array, so NULL is only an error */
+    if (!keys)
+        keys = xmalloc(sizeof(*keys));
+    if (n && n < alloc) {
+        keys = realloc(keys, sizeof(*keys) * n);
+        if (!keys)
+            err(1, "realloc");
+    }
+    *count = n;
+    return keys;
+}
+
+/* Batch queries ====================
+
+   Queries don't change the trees, so a batch of queries can be run
+   on any number of threads at once.  Each worker has its
+   own result buffer and a range of the query array.  A worker takes
+   small chunks from the front of its own range, and when that runs
+   out it steals the back half of another worker's range, so a few
+   expensive queries don't leave the other threads idle.  A worker can
+   also take its queries in blocks and push each block down the tree
+   together.  */
+
+/* Build an index from an array of keys, which is allocated with
+   malloc().  The index takes ownership of the array.  */
+typedef void *(*mktree_t)(bkey_t *, size_t, size_t);
+typedef size_t (*query_t)(struct buf *, void *, bkey_t, unsigned);
+typedef void (*qblock_t)(struct buf *, void *, struct mtree_query *, size_t);
+typedef size_t (*knn_t)(struct knn *, void *, bkey_t);
+typedef size_t (*approx_t)(struct buf *, void *, bkey_t, unsigned, size_t,
+                           int *);
+typedef int (*insert_t)(void *, bkey_t, size_t);
+typedef int (*remove_t)(void *, bkey_t);
+typedef void (*free_t)(void *);
+typedef void (*measure_t)(void *, struct mtree_stats *);
+
+struct tree_type {
+    const char *name;
+    const char *desc;
+    mktree_t mktree;
+    query_t query;
+    /* These are NULL if the type doesn't support them */
+    qblock_t qblock;
+    knn_t knn;
+    approx_t approx;
+    /* Count the hits, or stop at the first, see SUBTREE_MANY */
+    query_t count;
+    query_t exists;
+    image_t image;
+    /* Format of loaded index files, or 0 */
+    uint32_t format;
+    /* Changing the keys, see "Dynamic indexes" */
+    insert_t insert;
+    remove_t remove;
+    /* Free an index, but not the key array it was built from */
+    free_t free;
+    /* Add up the shape and memory of an index, see struct mtree_stats */
+    measure_t measure;
+};
+
+static struct auto_index *
+mktree_auto(bkey_t *restrict keys, size_t n, size_t max_linear);
+static size_t
+query_auto(struct buf *restrict b, struct auto_index *restrict root,
+           bkey_t ref, unsigned maxd);
+static void
+qblock_auto(struct buf *restrict b, struct auto_index *restrict root,
+            struct mtree_query *restrict q, size_t nq);
+static void
+measure_auto(struct auto_index *root, struct mtree_stats *st);
+static void
+free_auto(struct auto_index *root);
+
+static const struct tree_type tree_types[] = {
+    { "bk", "BK-tree",
+      (mktree_t) mktree_bk, (query_t) query_bk, (qblock_t) qblock_bk,
+      (knn_t) knn_bk, (approx_t) approx_bk, (query_t) count_bk,
+      (query_t) exists_bk, (image_t) image_bk, 0,
+      (insert_t) insert_bk, (remove_t) remove_bk, (free_t) free_bk,
+      (measure_t) measure_bk },
+    { "bkflat", "BK-tree (flat)",
+      (mktree_t) mktree_bkflat, (query_t) query_bkflat, NULL,
+      NULL, NULL, NULL, NULL, (image_t) image_bkflat, INDEX_BKFLAT,
+      NULL, NULL, (free_t) free_flat, (measure_t) measure_bkflat },
+    { "vp", "VP-tree",
+      (mktree_t) mktree_vp, (query_t) query_vp, (qblock_t) qblock_vp,
+      (knn_t) knn_vp, (approx_t) approx_vp, (query_t) count_vp,
+      (query_t) exists_vp, (image_t) image_vp, 0,
+      (insert_t) insert_vp, (remove_t) remove_vp, (free_t) free_vp,
+      (measure_t) measure_vp },
+    { "vpflat", "VP-tree (flat)",
+      (mktree_t) mktree_vpflat, (query_t) query_vpflat,
+      (qblock_t) qblock_vpflat, NULL, NULL, NULL, NULL,
+      (image_t) image_vpflat, INDEX_VPFLAT, NULL, NULL, (free_t) free_flat,
+      (measure_t) measure_vpflat },
+    { "mih", "Multi-index hashing",
+      (mktree_t) mktree_mih, (query_t) query_mih, NULL, NULL, NULL, NULL,
+      NULL, NULL, 0, NULL, NULL, (free_t) free_mih,
+      (measure_t) measure_mih },
+    { "linear", "Linear search",
+      (mktree_t) mktree_linear, (query_t) query_linear,
+      (qblock_t) qblock_linear, (knn_t) knn_linear, NULL,
+      (query_t) query_linear, (query_t) exists_linear,
+      (image_t) image_linear, INDEX_LINEAR, NULL, NULL,
+      (free_t) free_linear, (measure_t) measure_linear },
+    { "auto", "Automatic",
+      (mktree_t) mktree_auto, (query_t) query_auto,
+      (qblock_t) qblock_auto, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL,
+      (free_t) free_auto, (measure_t) measure_auto },
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL,
+      NULL, NULL, NULL }
+};
+
+enum {
+    QUERY_RADIUS = MTREE_RADIUS,
+    QUERY_COUNT = MTREE_COUNT,
+    QUERY_EXISTS = MTREE_EXISTS
+};
+
+static const char *const query_names[] = { "radius", "count", "exists" };
+
+/* The function for a kind of query, or NULL if the type doesn't
+   support it */
+static query_t
+query_kind(const struct tree_type *type, unsigned kind)
+{
+    return kind == QUERY_COUNT ? type->count
+        : kind == QUERY_EXISTS ? type->exists : type->query;
+}
+
+/* A batch is run as a struct mtree_batch says, and each worker
+   calls its emit function with the results of each query.  */
+
+enum { WS_CHUNK = 4 };
+
+struct batch;
+
+struct worker {
+    pthread_mutex_t lock;
+    size_t lo, hi;
+    struct batch *batch;
+    unsigned id;
+    pthread_t thread;
+    /* One buffer per query in a block */
+    struct buf *buf;
+    struct knn heap;
+} __attribute__((aligned(64)));
+
+struct batch {
+    const struct tree_type *type;
+    void *root;
+    unsigned block;
+    struct mtree_query *q;
+    const struct mtree_batch *opts;
+    unsigned nworkers;
+    struct worker *workers;
+};
+
+static int
+ws_pop(struct worker *restrict w, size_t *lo, size_t *hi)
+{
+    size_t n, chunk = w->batch->block && !w->batch->opts->knn
+        ? w->batch->block : WS_CHUNK;
+    pthread_mutex_lock(&w->lock);
+    n = w->hi - w->lo;
+    if (n > chunk)
+        n = chunk;
+    *lo = w->lo;
+    *hi = w->lo += n;
+    pthread_mutex_unlock(&w->lock);
+    return n != 0;
+}
+
+static int
+ws_steal(struct worker *restrict w)
+{
+    struct batch *b = w->batch;
+    struct worker *v;
+    size_t lo, hi, mid;
+    unsigned i;
+    for (i = 1; i < b->nworkers; ++i) {
+        v = &b->workers[(w->id + i) % b->nworkers];
+        pthread_mutex_lock(&v->lock);
+        lo = v->lo;
+        hi = v->hi;
+        mid = hi - (hi - lo + 1) / 2;
+        v->hi = mid;
+        pthread_mutex_unlock(&v->lock);
+        if (mid != hi) {
+            pthread_mutex_lock(&w->lock);
+            w->lo = mid;
+            w->hi = hi;
+            pthread_mutex_unlock(&w->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* A result buffer of the kind the batch asks for.  */
+static void
+batch_buf_init(struct buf *restrict buf, const struct mtree_batch *opts)
+{
+    if (opts->sink == BUF_FIXED) {
+        buf_fixed(buf, xmalloc(sizeof(bkey_t) * opts->reserve),
+                  opts->reserve);
+    } else if (opts->sink == BUF_VISIT) {
+        buf_visit(buf, opts->visit, opts->visit_arg);
+    } else {
+        buf_init(buf, opts->sink);
+        if (opts->sink == BUF_GROW && opts->reserve)
+            bufreserve(buf, opts->reserve);
+    }
+}
+
+static void
+batch_buf_free(struct buf *restrict buf)
+{
+    if (buf->mode == BUF_FIXED)
+        free(buf->keys);
+    buf_free(buf);
+}
+
+/* Record a query's hits and pass them on.  */
+static void
+batch_done(const struct mtree_batch *opts, struct mtree_query *q,
+           struct buf *buf)
+{
+    size_t n = buf->n < buf->a ? buf->n : buf->a;
+    q->hits = buf->n;
+    q->overflow = buf->overflow;
+    q->error = query_errno;
+    query_errno = 0;
+    if (opts->emit)
+        opts->emit(opts->arg, q,
+                   buf->mode == BUF_COUNT || buf->mode == BUF_VISIT
+                   ? NULL : buf->keys, n);
+}
+
+static inline uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void
+ws_knn(struct worker *restrict w, struct mtree_query *restrict q)
+{
+    struct batch *b = w->batch;
+    struct buf *buf = w->buf;
+    size_t i;
+    if (w->heap.k != q->maxd) {
+        knn_free(&w->heap);
+        knn_init(&w->heap, q->maxd);
+    }
+    w->heap.n = 0;
+    q->cmp = b->type->knn(&w->heap, b->root, q->key);
+    q->kdist = knn_sort(&w->heap);
+    buf_reset(buf);
+    for (i = 0; i < w->heap.n; ++i)
+        addkey(buf, w->heap.heap[i].key);
+    batch_done(b->opts, q, buf);
+}
+
+static void *
+ws_run(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *b = w->batch;
+    struct mtree_query *q;
+    size_t lo, hi, i;
+    int latency = b->opts->latency;
+    uint64_t t0 = 0;
+    query_t query = query_kind(b->type, b->opts->kind);
+    for (;;) {
+        if (!ws_pop(w, &lo, &hi)) {
+            if (!ws_steal(w))
+                break;
+            continue;
+        }
+        if (b->opts->knn) {
+            for (; lo < hi; ++lo) {
+                if (latency)
+                    t0 = nsec_now();
+                ws_knn(w, &b->q[lo]);
+                if (latency)
+                    b->q[lo].nsec = nsec_now() - t0;
+            }
+            continue;
+        }
+        if (b->block) {
+            /* Every query in a block finishes at the same time */
+            if (latency)
+                t0 = nsec_now();
+            q = &b->q[lo];
+            for (i = 0; i < hi - lo; ++i) {
+                buf_reset(&w->buf[i]);
+                q[i].cmp = 0;
+            }
+            b->type->qblock(w->buf, b->root, q, hi - lo);
+            for (i = 0; i < hi - lo; ++i)
+                batch_done(b->opts, &q[i], &w->buf[i]);
+            if (latency) {
+                t0 = nsec_now() - t0;
+                for (i = 0; i < hi - lo; ++i)
+                    q[i].nsec = t0;
+            }
+            continue;
+        }
+        for (; lo < hi; ++lo) {
+            q = &b->q[lo];
+            if (latency)
+                t0 = nsec_now();
+            STAT_BEGIN(q);
+            buf_reset(w->buf);
+            if (b->opts->budget)
+                q->cmp = b->type->approx(w->buf, b->root, q->key, q->maxd,
+                                         b->opts->budget, &q->partial);
+            else
+                q->cmp = query(w->buf, b->root, q->key, q->maxd);
+            STAT_END(q);
+            batch_done(b->opts, q, w->buf);
+            if (latency)
+                q->nsec = nsec_now() - t0;
+        }
+    }
+    STAT_MERGE();
+    return NULL;
+}
+
+/* Threads kept to run batch after batch, as a server does, so that a
+   small batch doesn't pay for starting and joining threads of its own.
+   Every batch wakes every thread, which runs the worker with its id if
+   the batch has that many, while the caller is worker 0.  A batch
+   starts once the threads are all done with the one before, so each
+   of them sees each batch.  */
+struct bpool_thread {
+    struct batch_pool *pool;
+    unsigned id;
+    pthread_t thread;
+};
+
+struct batch_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    struct batch *batch;
+    /* Batches started, and threads still on the last one */
+    unsigned long gen;
+    unsigned busy;
+    /* Threads, not counting the caller */
+    unsigned nthreads;
+    struct bpool_thread *threads;
+};
+
+static void *
+bpool_run(void *arg)
+{
+    struct bpool_thread *t = arg;
+    struct batch_pool *p = t->pool;
+    unsigned long gen = 0;
+    struct batch *b;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->gen == gen)
+            pthread_cond_wait(&p->start, &p->lock);
+        gen = p->gen;
+        b = p->batch;
+        pthread_mutex_unlock(&p->lock);
+        if (t->id < b->nworkers)
+            ws_run(&b->workers[t->id]);
+        pthread_mutex_lock(&p->lock);
+        if (!--p->busy)
+            pthread_cond_signal(&p->done);
+    }
+    return NULL;
+}
+
+/* A pool for batches of up to 'nthreads' threads, counting the
+   caller's.  The threads run until the process exits.  */
+static struct batch_pool *
+bpool_create(unsigned nthreads)
+{
+    struct batch_pool *p = xmalloc(sizeof(*p));
+    unsigned i;
+    int r;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->batch = NULL;
+    p->gen = 0;
+    p->busy = 0;
+    p->nthreads = nthreads > 1 ? nthreads - 1 : 0;
+    p->threads = xmalloc(sizeof(*p->threads) * (p->nthreads + 1));
+    for (i = 0; i < p->nthreads; ++i) {
+        p->threads[i].pool = p;
+        p->threads[i].id = i + 1;
+        r = pthread_create(&p->threads[i].thread, NULL, bpool_run,
+                           &p->threads[i]);
+        if (r) {
+            errno = r;
+            err(1, "pthread_create");
+        }
+    }
+    return p;
+}
+
+/* Run an array of queries against an index, on the threads of 'pool',
+   or on threads of its own if it is NULL.  */
+static void
+run_batch(struct batch_pool *pool, const struct tree_type *type,
+          void *root, struct mtree_query *q, size_t nq,
+          const struct mtree_batch *opts)
+{
+    struct batch b;
+    struct worker *w;
+    unsigned i, j, nbuf, nthreads = opts->nthreads;
+    int r;
+    assert(opts->block <= QBLOCK_MAX);
+    assert(!opts->knn || type->knn);
+    assert(!opts->budget || (type->approx && !opts->block && !opts->knn));
+    assert(opts->kind == QUERY_RADIUS ||
+           (query_kind(type, opts->kind) && opts->sink == BUF_COUNT &&
+            !opts->block && !opts->knn && !opts->budget));
+    nbuf = opts->block && !opts->knn ? opts->block : 1;
+    if (pool && nthreads > pool->nthreads + 1)
+        nthreads = pool->nthreads + 1;
+    if (nthreads > nq)
+        nthreads = nq;
+    if (!nthreads)
+        nthreads = 1;
+    b.type = type;
+    b.root = root;
+    b.block = opts->block;
+    b.q = q;
+    b.opts = opts;
+    b.nworkers = nthreads;
+    b.workers = xmalloc(sizeof(*b.workers) * nthreads);
+    for (i = 0; i < nthreads; ++i) {
+        w = &b.workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->lo = nq * i / nthreads;
+        w->hi = nq * (i + 1) / nthreads;
+        w->batch = &b;
+        w->id = i;
+        knn_init(&w->heap, 0);
+        w->buf = xmalloc(sizeof(*w->buf) * nbuf);
+        for (j = 0; j < nbuf; ++j)
+            batch_buf_init(&w->buf[j], opts);
+    }
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->batch = &b;
+        pool->gen++;
+        pool->busy = pool->nthreads;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for (i = 1; !pool && i < nthreads; ++i) {
+        r = pthread_create(&b.workers[i].thread, NULL, ws_run,
+                           &b.workers[i]);
+        if (r) {
+            errno = r;
+            err(1, "pthread_create");
+        }
+    }
+    ws_run(&b.workers[0]);
+    /* Until the last worker is done, any of them can still be stealing
+       from the others */
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for (i = 1; !pool && i < nthreads; ++i)
+        pthread_join(b.workers[i].thread, NULL);
+    for (i = 0; i < nthreads; ++i) {
+        w = &b.workers[i];
+        pthread_mutex_destroy(&w->lock);
+        for (j = 0; j < nbuf; ++j)
+            batch_buf_free(&w->buf[j]);
+        free(w->buf);
+        knn_free(&w->heap);
+    }
+    free(b.workers);
+}
+
+/* Dynamic indexes ====================
+
+   A dynamic index wraps a BK-tree or VP-tree so keys can be added and
+   removed after it is built.  A new key goes into the leaf it would
+   have been sorted into, and a leaf which grows past the leaf size is
+   rebuilt as a subtree.  Keys are removed from leaves directly, but
+   the keys at internal nodes are still needed to route queries, so
+   they are marked as dead instead.
+
+   Over time the tree drifts from the tree which would be built from
+   the current keys, so once the changes since the last build reach
+   1/DYN_REBUILD of the keys, the tree is rebuilt on a background
+   thread.  Changes keep going to the old tree while that happens, and
+   from when the rebuild starts they are logged and replayed on the new
+   tree before it replaces the old one.  Some of them may already be
+   in the keys the new tree is built from, but each key ends up the way
+   its last change left it, so replaying them does no harm.
+
+   Queries hold a read lock and changes hold the write lock, so they
+   can run on different threads.  Changes and rebuilds use the options
+   the tree was built with.  */
+
+enum { DYN_REBUILD = 4 };
+
+struct dyn_change {
+    bkey_t key;
+    int insert;
+};
+
+struct dynamic {
+    const struct tree_type *type;
+    pthread_rwlock_t lock;
+    void *root;
+    /* Key array the tree was built from */
+    bkey_t *base;
+    size_t max_linear;
+    size_t live;
+    /* Changes since the tree was built */
+    size_t changes;
+    unsigned rebuilds;
+    int rebuilding, joinable;
+    pthread_t thread;
+    /* Changes made during a rebuild */
+    struct dyn_change *log;
+    size_t nlog, alog;
+    struct build build;
+};
+
+/* Wrap a tree, which was built from 'n' keys in 'base' with the
+   options in 'opts'.  */
+static void
+dyn_init(struct dynamic *d, const struct tree_type *type, void *root,
+         bkey_t *base, size_t n, size_t max_linear,
+         const struct mtree_opts *opts)
+{
+    assert(type->insert && type->remove && type->free);
+    d->type = type;
+    memset(&d->build, 0, sizeof(d->build));
+    d->build.opts = *opts;
+    d->build.tokens = opts->threads > 1 ? opts->threads - 1 : 0;
+    pthread_rwlock_init(&d->lock, NULL);
+    d->root = root;
+    d->base = base;
+    d->max_linear = max_linear;
+    d->live = n;
+    d->changes = 0;
+    d->rebuilds = 0;
+    d->rebuilding = 0;
+    d->joinable = 0;
+    d->log = NULL;
+    d->nlog = d->alog = 0;
+}
+
+/* Apply a change to the tree.  The write lock must be held.  */
+static int
+dyn_update(struct dynamic *d, bkey_t key, int insert)
+{
+    struct build *old = build_cur;
+    int r;
+    build_cur = &d->build;
+    if (insert)
+        r = d->type->insert(d->root, key, d->max_linear);
+    else
+        r = d->type->remove(d->root, key);
+    build_cur = old;
+    if (r) {
+        d->live += insert ? 1 : -1;
+        d->changes++;
+    }
+    return r;
+}
+
+static void *
+dyn_rebuild(void *arg)
+{
+    struct dynamic *d = arg;
+    void *root, *old;
+    bkey_t *oldbase, any;
+    struct buf b;
+    size_t i;
+
+    /* Copy the keys, which blocks changes but not queries */
+    build_cur = &d->build;
+    memset(&any, 0, sizeof(any));
+    buf_init(&b, BUF_GROW);
+    pthread_rwlock_rdlock(&d->lock);
+    bufreserve(&b, d->live);
+    d->type->query(&b, d->root, any, MAX_DISTANCE);
+    pthread_rwlock_unlock(&d->lock);
+
+    root = b.n ? d->type->mktree(b.keys, b.n, d->max_linear) : NULL;
+
+    pthread_rwlock_wrlock(&d->lock);
+    old = d->root;
+    oldbase = d->base;
+    if (root) {
+        d->root = root;
+        d->base = b.keys;
+        d->live = b.n;
+        d->rebuilds++;
+    } else {
+        /* There is nothing to build a tree from, keep the old one */
+        old = NULL;
+        oldbase = NULL;
+        buf_free(&b);
+    }
+    d->changes = 0;
+    if (root)
+        for (i = 0; i < d->nlog; ++i)
+            dyn_update(d, d->log[i].key, d->log[i].insert);
+    d->nlog = 0;
+    d->rebuilding = 0;
+    pthread_rwlock_unlock(&d->lock);
+
+    if (old)
+        d->type->free(old);
+    free(oldbase);
+    return NULL;
+}
+
+/* Wait for a rebuild to finish.  This and the functions which change
+   keys must be called from one thread at a time.  */
+static void
+dyn_wait(struct dynamic *d)
+{
+    if (d->joinable) {
+        pthread_join(d->thread, NULL);
+        d->joinable = 0;
+    }
+}
+
+static int
+dyn_change(struct dynamic *d, bkey_t key, int insert)
+{
+    struct dyn_change *np;
+    size_t na;
+    int r;
+    pthread_rwlock_wrlock(&d->lock);
+    r = dyn_update(d, key, insert);
+    if (r && d->rebuilding) {
+        if (d->nlog == d->alog) {
+            na = d->alog ? 2 * d->alog : 1024;
+            np = realloc(d->log, sizeof(*np) * na);
+            if (!np)
+                err(1, "realloc");
+            d->log = np;
+            d->alog = na;
+        }
+        d->log[d->nlog].key = key;
+        d->log[d->nlog].insert = insert;
+        d->nlog++;
+    } else if (r && d->changes * DYN_REBUILD > d->live) {
+        /* The last rebuild thread has released the lock for good */
+        dyn_wait(d);
+        d->rebuilding = 1;
+        if (pthread_create(&d->thread, NULL, dyn_rebuild, d))
+            d->rebuilding = 0;
+        else
+            d->joinable = 1;
+    }
+    pthread_rwlock_unlock(&d->lock);
+    return r;
+}
+
+/* Add a key.  Returns 0 if it is already there.  */
+static int
+dyn_insert(struct dynamic *d, bkey_t key)
+{
+    return dyn_change(d, key, 1);
+}
+
+/* Remove a key.  Returns 0 if it isn't there.  */
+static int
+dyn_remove(struct dynamic *d, bkey_t key)
+{
+    return dyn_change(d, key, 0);
+}
+
+/* Free the tree, once any rebuild is done, and its key array.  */
+static void
+dyn_free(struct dynamic *d)
+{
+    dyn_wait(d);
+    d->type->free(d->root);
+    free(d->base);
+    free(d->log);
+    pthread_rwlock_destroy(&d->lock);
+}
+
+static size_t
+query_dyn(struct buf *restrict b, struct dynamic *restrict d,
+          bkey_t ref, unsigned maxd)
+{
+    size_t nc;
+    pthread_rwlock_rdlock(&d->lock);
+    nc = d->type->query(b, d->root, ref, maxd);
+    pthread_rwlock_unlock(&d->lock);
+    return nc;
+}
+
+static void
+qblock_dyn(struct buf *restrict b, struct dynamic *restrict d,
+           struct mtree_query *restrict q, size_t nq)
+{
+    pthread_rwlock_rdlock(&d->lock);
+    d->type->qblock(b, d->root, q, nq);
+    pthread_rwlock_unlock(&d->lock);
+}
+
+static size_t
+knn_dyn(struct knn *restrict h, struct dynamic *restrict d, bkey_t ref)
+{
+    size_t nc;
+    pthread_rwlock_rdlock(&d->lock);
+    nc = d->type->knn(h, d->root, ref);
+    pthread_rwlock_unlock(&d->lock);
+    return nc;
+}
+
+static size_t
+count_dyn(struct buf *restrict b, struct dynamic *restrict d,
+          bkey_t ref, unsigned maxd)
+{
+    size_t nc;
+    pthread_rwlock_rdlock(&d->lock);
+    nc = d->type->count(b, d->root, ref, maxd);
+    pthread_rwlock_unlock(&d->lock);
+    return nc;
+}
+
+static size_t
+exists_dyn(struct buf *restrict b, struct dynamic *restrict d,
+           bkey_t ref, unsigned maxd)
+{
+    size_t nc;
+    pthread_rwlock_rdlock(&d->lock);
+    nc = d->type->exists(b, d->root, ref, maxd);
+    pthread_rwlock_unlock(&d->lock);
+    return nc;
+}
+
+static size_t
+approx_dyn(struct buf *restrict b, struct dynamic *restrict d,
+           bkey_t ref, unsigned maxd, size_t budget, int *partial)
+{
+    size_t nc;
+    pthread_rwlock_rdlock(&d->lock);
+    nc = d->type->approx(b, d->root, ref, maxd, budget, partial);
+    pthread_rwlock_unlock(&d->lock);
+    return nc;
+}
+
+/* The log of changes made during a rebuild counts as nodes */
+static void
+measure_dyn(struct dynamic *d, struct mtree_stats *st)
+{
+    pthread_rwlock_rdlock(&d->lock);
+    d->type->measure(d->root, st);
+    st->node_bytes += sizeof(*d->log) * d->nlog;
+    st->slack += sizeof(*d->log) * (d->alog - d->nlog);
+    pthread_rwlock_unlock(&d->lock);
+}
+
+/* Queries on a struct dynamic */
+static const struct tree_type dyn_type = {
+    "dynamic", "Dynamic index",
+    NULL, (query_t) query_dyn, (qblock_t) qblock_dyn, (knn_t) knn_dyn,
+    (approx_t) approx_dyn, (query_t) count_dyn, (query_t) exists_dyn, NULL,
+    0, NULL, NULL, NULL, (measure_t) measure_dyn
+};
+
+/* Result cache ====================
+
+   A cache in front of an index answers repeated queries without
+   searching it.  An entry keeps every hit of a query key within the
+   largest radius the key has been queried at.  A query with the same
+   key and the same radius is answered straight from the entry, and
+   one with a smaller radius by comparing the key to each cached hit.
+   Count and exists queries are answered from the entries too.  A
+   count which misses runs a radius query to fill the entry, since
+   counting in the index saves little, but an exists query which
+   misses runs the index's own, much cheaper, query and adds nothing.
+   kNN queries go to the index.
+
+   The entries are split between CACHE_STRIPES stripes by a hash of
+   the key, each with a read-write lock, a hash table, its share of
+   the memory budget and a CLOCK hand.  A hit sets the entry's
+   reference bit, and when the stripe is full the hand clears the
+   bits it passes and evicts the first entry whose bit is clear.
+   Results bigger than an eighth of a stripe aren't kept.  The index
+   must not change while it is cached.  */
+
+enum { CACHE_STRIPES = 64 };
+
+#define CACHE_NONE ((unsigned) -1)
+
+struct cache_entry {
+    bkey_t key;
+    unsigned maxd;
+    /* Next entry in the hash chain, or CACHE_NONE */
+    unsigned next;
+    /* Set by hits, cleared by the CLOCK hand */
+    unsigned char used;
+    size_t n;
+    bkey_t *keys;
+};
+
+struct cache_stripe {
+    pthread_rwlock_t lock;
+    struct cache_entry *entry;
+    unsigned *chain;
+    unsigned nentry, aentry, nchain, hand;
+    size_t bytes;
+    /* Queries answered directly, by filtering, and not at all */
+    unsigned long long hits, filtered, misses;
+} __attribute__((aligned(64)));
+
+struct cache {
+    /* The cached type, with the queries 'sub' has */
+    struct tree_type type;
+    const struct tree_type *sub;
+    void *root;
+    /* Bytes per stripe */
+    size_t budget;
+    /* Each thread's buffer for the hits of a query which missed, reused
+       from query to query and freed as the thread exits */
+    pthread_key_t scratch;
+    struct cache_stripe stripe[CACHE_STRIPES];
+};
+
+static void
+cache_scratch_free(void *arg)
+{
+    struct buf *r = arg;
+    buf_free(r);
+    free(r);
+}
+
+/* The calling thread's buffer for the hits of a miss */
+static struct buf *
+cache_scratch(struct cache *c)
+{
+    struct buf *r = pthread_getspecific(c->scratch);
+    if (!r) {
+        r = xmalloc(sizeof(*r));
+        buf_init(r, BUF_GROW);
+        pthread_setspecific(c->scratch, r);
+    }
+    return r;
+}
+
+static inline uint32_t
+cache_hash(bkey_t k)
+{
+    return key_fold(k) * 0x9e3779b1u;
+}
+
+static struct cache_entry *
+cache_find(struct cache_stripe *s, uint32_t h, bkey_t key)
+{
+    unsigned i;
+    for (i = s->chain[h & (s->nchain - 1)]; i != CACHE_NONE;
+         i = s->entry[i].next)
+        if (!distance(s->entry[i].key, key))
+            return &s->entry[i];
+    return NULL;
+}
+
+/* The link to entry i in its hash chain */
+static unsigned *
+cache_link(struct cache_stripe *s, unsigned i)
+{
+    unsigned *p = &s->chain[cache_hash(s->entry[i].key) & (s->nchain - 1)];
+    while (*p != i)
+        p = &s->entry[*p].next;
+    return p;
+}
+
+/* Remove entry i, moving the last entry into its place.  */
+static void
+cache_drop(struct cache_stripe *s, unsigned i)
+{
+    struct cache_entry *e = &s->entry[i];
+    unsigned last = s->nentry - 1;
+    *cache_link(s, i) = e->next;
+    s->bytes -= sizeof(*e) + sizeof(*e->keys) * e->n;
+    free(e->keys);
+    if (i != last) {
+        *cache_link(s, last) = i;
+        *e = s->entry[last];
+    }
+    s->nentry = last;
+}
+
+/* Evict entries until 'size' more bytes fit in the stripe.  */
+static void
+cache_evict(struct cache *c, struct cache_stripe *s, size_t size)
+{
+    struct cache_entry *e;
+    while (s->nentry && s->bytes + size > c->budget) {
+        if (s->hand >= s->nentry)
+            s->hand = 0;
+        e = &s->entry[s->hand];
+        if (e->used) {
+            e->used = 0;
+            s->hand++;
+        } else {
+            cache_drop(s, s->hand);
+        }
+    }
+}
+
+/* Keep the n hits of a query at radius maxd, unless the cache has the
+   key at that radius or more already.  */
+static void
+cache_add(struct cache *c, struct cache_stripe *s, uint32_t h, bkey_t ref,
+          unsigned maxd, const bkey_t *keys, size_t n)
+{
+    struct cache_entry *e;
+    size_t size = sizeof(*e) + sizeof(*keys) * n;
+    bkey_t *copy;
+    unsigned i;
+    if (size > c->budget / 8)
+        return;
+    copy = xmalloc(sizeof(*keys) * n);
+    if (n)
+        memcpy(copy, keys, sizeof(*keys) * n);
+    pthread_rwlock_wrlock(&s->lock);
+    e = cache_find(s, h, ref);
+    if (e && e->maxd >= maxd) {
+        pthread_rwlock_unlock(&s->lock);
+        free(copy);
+        return;
+    }
+    if (e)
+        cache_drop(s, e - s->entry);
+    cache_evict(c, s, size);
+    if (s->nentry == s->aentry) {
+        s->aentry = s->aentry ? 2 * s->aentry : 64;
+        e = realloc(s->entry, sizeof(*e) * s->aentry);
+        if (!e)
+            err(1, "realloc");
+        s->entry = e;
+    }
+    i = s->nentry++;
+    e = &s->entry[i];
+    e->key = ref;
+    e->maxd = maxd;
+    e->used = 0;
+    e->n = n;
+    e->keys = copy;
+    e->next = s->chain[h & (s->nchain - 1)];
+    s->chain[h & (s->nchain - 1)] = i;
+    s->bytes += size;
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/* Answer a query from the cache if it can, setting *nc to the keys
+   compared.  Returns 0 on a miss.  */
+static int
+cache_lookup(struct cache_stripe *s, uint32_t h, struct buf *restrict b,
+             bkey_t ref, unsigned maxd, unsigned kind, size_t *nc)
+{
+    struct cache_entry *e;
+    size_t i, n;
+    pthread_rwlock_rdlock(&s->lock);
+    e = cache_find(s, h, ref);
+    if (!e || e->maxd < maxd) {
+        pthread_rwlock_unlock(&s->lock);
+        __atomic_add_fetch(&s->misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_store_n(&e->used, 1, __ATOMIC_RELAXED);
+    if (e->maxd == maxd) {
+        n = kind == QUERY_EXISTS && e->n ? 1 : e->n;
+        if (b->mode == BUF_COUNT) {
+            b->n += n;
+        } else if (bufroom(b, n)) {
+            memcpy(b->keys + b->n, e->keys, sizeof(*e->keys) * n);
+            b->n += n;
+        } else {
+            for (i = 0; i < n; ++i)
+                addkey(b, e->keys[i]);
+        }
+        *nc = 0;
+        __atomic_add_fetch(&s->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        for (i = 0; i < e->n; ++i)
+            if (distance(e->keys[i], ref) <= maxd) {
+                addkey(b, e->keys[i]);
+                if (kind == QUERY_EXISTS) {
+                    ++i;
+                    break;
+                }
+            }
+        *nc = i;
+        __atomic_add_fetch(&s->filtered, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return 1;
+}
+
+static size_t
+cache_query(struct buf *restrict b, struct cache *restrict c,
+            bkey_t ref, unsigned maxd, unsigned kind)
+{
+    uint32_t h = cache_hash(ref);
+    struct cache_stripe *s = &c->stripe[(h >> 16) % CACHE_STRIPES];
+    struct buf *r;
+    size_t nc, n0 = b->n, i;
+    if (cache_lookup(s, h, b, ref, maxd, kind, &nc))
+        return nc;
+    if (kind == QUERY_EXISTS)
+        return c->sub->exists(b, c->root, ref, maxd);
+    if (b->mode == BUF_GROW) {
+        nc = c->sub->query(b, c->root, ref, maxd);
+        if (!query_errno)
+            cache_add(c, s, h, ref, maxd, b->keys + n0, b->n - n0);
+        return nc;
+    }
+    /* Collect the hits to keep them, then pass them on */
+    r = cache_scratch(c);
+    buf_reset(r);
+    nc = c->sub->query(r, c->root, ref, maxd);
+    if (!query_errno)
+        cache_add(c, s, h, ref, maxd, r->keys, r->n);
+    if (b->mode == BUF_COUNT)
+        b->n += r->n;
+    else
+        for (i = 0; i < r->n; ++i)
+            addkey(b, r->keys[i]);
+    return nc;
+}
+
+static size_t
+query_cache(struct buf *restrict b, struct cache *restrict c,
+            bkey_t ref, unsigned maxd)
+{
+    return cache_query(b, c, ref, maxd, QUERY_RADIUS);
+}
+
+static size_t
+count_cache(struct buf *restrict b, struct cache *restrict c,
+            bkey_t ref, unsigned maxd)
+{
+    return cache_query(b, c, ref, maxd, QUERY_COUNT);
+}
+
+static size_t
+exists_cache(struct buf *restrict b, struct cache *restrict c,
+             bkey_t ref, unsigned maxd)
+{
+    return cache_query(b, c, ref, maxd, QUERY_EXISTS);
+}
+
+static size_t
+knn_cache(struct knn *restrict h, struct cache *restrict c, bkey_t ref)
+{
+    return c->sub->knn(h, c->root, ref);
+}
+
+/* Queries on a struct cache */
+static const struct tree_type cache_type = {
+    "cache", "Cached index",
+    NULL, (query_t) query_cache, NULL, (knn_t) knn_cache,
+    NULL, (query_t) count_cache, (query_t) exists_cache, NULL,
+    0, NULL, NULL, NULL, NULL
+};
+
+/* Cache queries on an index in 'budget' bytes.  */
+static void
+cache_init(struct cache *c, const struct tree_type *type, void *root,
+           size_t budget)
+{
+    struct cache_stripe *s;
+    unsigned i, nchain = 16;
+    int e;
+    e = pthread_key_create(&c->scratch, cache_scratch_free);
+    if (e) {
+        errno = e;
+        err(1, "pthread_key_create");
+    }
+    c->type = cache_type;
+    if (!type->knn)
+        c->type.knn = NULL;
+    if (!type->exists)
+        c->type.exists = NULL;
+    c->sub = type;
+    c->root = root;
+    c->budget = budget / CACHE_STRIPES;
+    /* About four entries of no hits per chain when full */
+    while (nchain < c->budget / (4 * sizeof(struct cache_entry)) &&
+           nchain < 1u << 20)
+        nchain *= 2;
+    for (s = c->stripe; s < c->stripe + CACHE_STRIPES; ++s) {
+        pthread_rwlock_init(&s->lock, NULL);
+        s->entry = NULL;
+        s->nentry = s->aentry = s->hand = 0;
+        s->nchain = nchain;
+        s->chain = xmalloc(sizeof(*s->chain) * nchain);
+        for (i = 0; i < nchain; ++i)
+            s->chain[i] = CACHE_NONE;
+        s->bytes = 0;
+        s->hits = s->filtered = s->misses = 0;
+    }
+}
+
+/* Add up the counters of the stripes.  */
+static void
+cache_stats(struct cache *c, struct mtree_cache_stats *st)
+{
+    struct cache_stripe *s;
+    memset(st, 0, sizeof(*st));
+    for (s = c->stripe; s < c->stripe + CACHE_STRIPES; ++s) {
+        pthread_rwlock_rdlock(&s->lock);
+        st->hits += __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+        st->filtered += __atomic_load_n(&s->filtered, __ATOMIC_RELAXED);
+        st->misses += __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+        st->bytes += s->bytes;
+        st->entries += s->nentry;
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+/* Free the entries, but not the cached index.  */
+static void
+cache_free(struct cache *c)
+{
+    struct cache_stripe *s;
+    struct buf *r;
+    unsigned i;
+    for (s = c->stripe; s < c->stripe + CACHE_STRIPES; ++s) {
+        for (i = 0; i < s->nentry; ++i)
+            free(s->entry[i].keys);
+        free(s->entry);
+        free(s->chain);
+        pthread_rwlock_destroy(&s->lock);
+    }
+    /* Only the calling thread's buffer, the others go as their threads
+       exit */
+    r = pthread_getspecific(c->scratch);
+    if (r)
+        cache_scratch_free(r);
+    pthread_key_delete(c->scratch);
+}
+
+/* Automatic tuning ====================
+
+   The "auto" type picks the index for each query radius by trying
+   them.  It builds each candidate on a sample of the keys, times
+   queries at each radius which will be asked for (see auto_radii),
+   and builds the fastest candidate for each radius on all the keys.
+   When one of the indexes it has already chosen is nearly as fast at
+   a radius, it uses that one instead of building another.  The
+   radii, the queries to time, and where to print the choices are
+   build options.  Queries are routed to the index chosen for the
+   nearest radius.  */
+
+enum {
+    AUTO_SAMPLE = 1 << 20,
+    AUTO_MAX = 4,
+    /* Stop timing a candidate after this many queries or seconds */
+    AUTO_QUERIES = 1000,
+    /* Use an index already chosen if it is within this factor */
+    AUTO_SLACK_PERCENT = 10
+};
+
+#define AUTO_TIME 0.02
+
+struct auto_sub {
+    const struct tree_type *type;
+    size_t max_linear;
+    void *root;
+    /* Its copy of the keys, or NULL if it has the key array */
+    bkey_t *keys;
+};
+
+struct auto_index {
+    unsigned n;
+    struct auto_sub sub[AUTO_MAX];
+    unsigned char route[MAX_DISTANCE + 1];
+};
+
+static const struct {
+    const char *type;
+    size_t max_linear;
+} auto_candidates[] = {
+    { "vp", 16 }, { "vp", 64 }, { "vp", 256 }, { "vp", 1024 },
+    { "bk", 16 }, { "bk", 64 }, { "bk", 256 }, { "bk", 1024 },
+    { "mih", 0 }, { "linear", 0 }
+};
+
+enum { AUTO_NCAND = sizeof(auto_candidates) / sizeof(*auto_candidates) };
+
+static const struct tree_type *
+find_type(const char *name)
+{
+    const struct tree_type *type;
+    for (type = tree_types; type->name; ++type)
+        if (!strcasecmp(name, type->name))
+            return type;
+    return NULL;
+}
+
+/* Time per query at radius r, for the build's queries or random
+   ones.  */
+static double
+auto_time(const struct tree_type *type, void *root, unsigned r)
+{
+    const struct mtree_opts *opts = &build_cur->opts;
+    uint64_t t0 = nsec_now(), limit = AUTO_TIME * 1e9;
+    struct mtree_rng rng;
+    struct buf b;
+    size_t i;
+    mtree_rng_seed(&rng, r);
+    buf_init(&b, BUF_COUNT);
+    for (i = 0; i < AUTO_QUERIES && nsec_now() - t0 < limit; ++i) {
+        buf_reset(&b);
+        type->query(&b, root, opts->queries
+                    ? opts->queries[i % opts->nqueries] : key_rand(&rng), r);
+    }
+    return (nsec_now() - t0) * 1e-9 / i;
+}
+
+static struct auto_index *
+mktree_auto(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    double tm[AUTO_NCAND][MAX_DISTANCE + 1];
+    unsigned char chosen[AUTO_MAX];
+    const unsigned char *radii = build_cur->opts.radii;
+    FILE *log = build_cur->opts.log;
+    const struct tree_type *type;
+    struct auto_index *root;
+    size_t i, j, ns;
+    unsigned c, r, best;
+    bkey_t *sample;
+    void *t;
+    (void) max_linear;
+
+    /* mtree_build() checks there are radii */
+    assert(radii);
+    ns = n < AUTO_SAMPLE ? n : AUTO_SAMPLE;
+    if (log)
+        fprintf(log, "Tuning on %zu keys...\n", ns);
+    for (c = 0; c < AUTO_NCAND; ++c) {
+        type = find_type(auto_candidates[c].type);
+        sample = xmalloc(sizeof(*sample) * ns);
+        for (i = 0; i < ns; ++i)
+            sample[i] = keys[i * n / ns];
+        t = type->mktree(sample, ns, auto_candidates[c].max_linear);
+        for (r = 0; r <= MAX_DISTANCE; ++r)
+            if (radii[r])
+                tm[c][r] = auto_time(type, t, r);
+        type->free(t);
+        free(sample);
+    }
+
+    root = xmalloc(sizeof(*root));
+    root->n = 0;
+    for (r = 0; r <= MAX_DISTANCE; ++r) {
+        if (!radii[r])
+            continue;
+        for (c = 1, best = 0; c < AUTO_NCAND; ++c)
+            if (tm[c][r] < tm[best][r])
+                best = c;
+        for (j = 0; j < root->n; ++j)
+            if (tm[chosen[j]][r] * 100 <=
+                tm[best][r] * (100 + AUTO_SLACK_PERCENT))
+                break;
+        if (j == root->n) {
+            if (root->n == AUTO_MAX) {
+                /* Use the best of the ones already chosen */
+                for (j = 1, i = 0; j < root->n; ++j)
+                    if (tm[chosen[j]][r] < tm[chosen[i]][r])
+                        i = j;
+                j = i;
+            } else {
+                chosen[root->n++] = best;
+            }
+        }
+        root->route[r] = j;
+        if (log)
+            fprintf(log, "Auto: r=%u %s/%zu (%.3f usec/query)\n", r,
+                    auto_candidates[chosen[j]].type,
+                    auto_candidates[chosen[j]].max_linear,
+                    1e6 * tm[chosen[j]][r]);
+    }
+    /* Other radii use the index for the nearest radius */
+    for (r = 0; r <= MAX_DISTANCE; ++r) {
+        if (radii[r])
+            continue;
+        for (i = 1; i <= MAX_DISTANCE; ++i) {
+            if (r >= i && radii[r - i]) {
+                root->route[r] = root->route[r - i];
+                break;
+            }
+            if (r + i <= MAX_DISTANCE && radii[r + i]) {
+                root->route[r] = root->route[r + i];
+                break;
+            }
+        }
+    }
+
+    for (j = 0; j < root->n; ++j) {
+        c = chosen[j];
+        root->sub[j].type = find_type(auto_candidates[c].type);
+        root->sub[j].max_linear = auto_candidates[c].max_linear;
+        if (j + 1 < root->n) {
+            sample = xmalloc(sizeof(*sample) * n);
+            memcpy(sample, keys, sizeof(*sample) * n);
+            root->sub[j].keys = sample;
+        } else {
+            sample = keys;
+            root->sub[j].keys = NULL;
+        }
+        root->sub[j].root = root->sub[j].type->mktree(
+            sample, n, root->sub[j].max_linear);
+    }
+    return root;
+}
+
+static void
+free_auto(struct auto_index *root)
+{
+    unsigned i;
+    for (i = 0; i < root->n; ++i) {
+        root->sub[i].type->free(root->sub[i].root);
+        free(root->sub[i].keys);
+    }
+    free(root);
+}
+
+static size_t
+query_auto(struct buf *restrict b, struct auto_index *restrict root,
+           bkey_t ref, unsigned maxd)
+{
+    struct auto_sub *s = &root->sub[root->route[maxd]];
+    return s->type->query(b, s->root, ref, maxd);
+}
+
+/* Blocks go to one index when all their queries are routed there.  */
+static void
+qblock_auto(struct buf *restrict b, struct auto_index *restrict root,
+            struct mtree_query *restrict q, size_t nq)
+{
+    struct auto_sub *s = &root->sub[root->route[q[0].maxd]];
+    size_t i;
+    for (i = 1; i < nq; ++i)
+        if (root->route[q[i].maxd] != root->route[q[0].maxd])
+            break;
+    if (i == nq && s->type->qblock) {
+        s->type->qblock(b, s->root, q, nq);
+        return;
+    }
+    for (i = 0; i < nq; ++i)
+        q[i].cmp += query_auto(&b[i], root, q[i].key, q[i].maxd);
+}
+
+/* Each index with the MAXLIN it was built with */
+static void
+measure_auto(struct auto_index *root, struct mtree_stats *st)
+{
+    size_t max_linear = st->max_linear;
+    unsigned i;
+    st->node_bytes += sizeof(*root);
+    for (i = 0; i < root->n; ++i) {
+        st->max_linear = root->sub[i].max_linear;
+        root->sub[i].type->measure(root->sub[i].root, st);
+    }
+    st->max_linear = max_linear;
+}
+
+/* Sharded indexes ====================
+
+   A sharded index splits the keys into shards, each an index of its
+   own, and a query goes to every shard which could hold a hit and
+   gathers the hits from them.  The keys are split by the top levels
+   of a VP-tree, where each split gives each side its share of the keys
+   by the number of shards on that side.  Each shard keeps the range of
+   distances of its keys from every vantage point above it, so by the
+   triangle inequality a query skips a shard when its distance from
+   one of them is further than maxd outside that range.
+
+   The shards are shared out between the NUMA nodes.  With more than
+   one node, each shard's keys are copied and its index is built by a
+   thread pinned to its node, so its memory is allocated there, and
+   each node has threads pinned to it which run the queries for its
+   shards, so the leaves are scanned from local memory.  The hits come
+   back in a buffer for each shard and are merged into the query's.
+   A shard is only given a key and a radius and only returns hits, so
+   it could as well be on another machine.  */
+
+enum {
+    SHARD_MAX = MTREE_SHARD_MAX,
+    /* Splits above a shard, log2(SHARD_MAX) */
+    SHARD_LEVELS = 8,
+    SHARD_MAX_NODES = 64
+};
+
+struct shard_bound {
+    bkey_t vantage;
+    dist_t lo, hi;
+};
+
+struct shard {
+    const struct tree_type *type;
+    void *root;
+    /* The shard's keys, copied if 'copied' is set */
+    bkey_t *keys;
+    size_t n;
+    int copied;
+    unsigned node;
+    unsigned nbound;
+    struct shard_bound bound[SHARD_LEVELS];
+};
+
+struct shard_req;
+
+/* Threads pinned to a NUMA node, which run queries on its shards */
+struct shard_node {
+    cpu_set_t cpus;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct shard_req *head, **tail;
+    int stop;
+    unsigned nthreads;
+    pthread_t *threads;
+};
+
+struct sharded {
+    unsigned n;
+    struct shard shard[SHARD_MAX];
+    /* Nodes, if there is more than one */
+    unsigned nnodes;
+    struct shard_node *nodes;
+};
+
+/* Read a list like "0-3,8-11" from a sysfs file into a set.  */
+static int
+read_cpulist(const char *path, cpu_set_t *set)
+{
+    unsigned a, b;
+    FILE *f;
+    int c;
+    CPU_ZERO(set);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fscanf(f, "%u", &a) == 1) {
+        b = a;
+        c = getc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &b) != 1)
+                break;
+            c = getc(f);
+        }
+        for (; a <= b && a < CPU_SETSIZE; ++a)
+            CPU_SET(a, set);
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Find the CPUs this process can use on each NUMA node, leaving out
+   nodes without any.  Returns the number of nodes, or 0 if there is
+   no NUMA information.  */
+static unsigned
+numa_nodes(cpu_set_t *nodes, unsigned max)
+{
+    cpu_set_t mine, online;
+    char path[64];
+    unsigned i, n = 0;
+    if (sched_getaffinity(0, sizeof(mine), &mine) ||
+        read_cpulist("/sys/devices/system/node/online", &online))
+        return 0;
+    for (i = 0; i < CPU_SETSIZE && n < max; ++i) {
+        if (!CPU_ISSET(i, &online))
+            continue;
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%u/cpulist", i);
+        if (read_cpulist(path, &nodes[n]))
+            continue;
+        CPU_AND(&nodes[n], &nodes[n], &mine);
+        if (CPU_COUNT(&nodes[n]))
+            n++;
+    }
+    return n;
+}
+
+/* Split the keys between 'count' shards starting at 'first', which
+   are under the 'nb' splits in 'up'.  */
+static void
+shard_split(struct sharded *sh, bkey_t *keys, size_t n, unsigned first,
+            unsigned count, const struct shard_bound *up, unsigned nb)
+{
+    struct shard_bound bound[SHARD_LEVELS];
+    class_t cls[MAX_DISTANCE + 1];
+    struct partition pt;
+    struct shard *s;
+    size_t a, want;
+    unsigned d, t, half;
+    bkey_t v;
+
+    if (nb)
+        memcpy(bound, up, sizeof(*bound) * nb);
+    if (count == 1 || !n) {
+        for (; count; --count, ++first) {
+            s = &sh->shard[first];
+            s->keys = keys;
+            s->n = count == 1 ? n : 0;
+            s->nbound = nb;
+            memcpy(s->bound, bound, sizeof(*bound) * nb);
+        }
+        return;
+    }
+
+    /* The near side gets the keys up to distance t, about its share */
+    v = choose_vantage(keys, n);
+    partition_hist(&pt, v, keys, n);
+    half = count / 2;
+    want = n * half / count;
+    for (t = 0, a = pt.dcnt[0];
+         t < MAX_DISTANCE && a + pt.dcnt[t + 1] <= want; )
+        a += pt.dcnt[++t];
+    if (t < MAX_DISTANCE && a < want && a + pt.dcnt[t + 1] - want < want - a)
+        a += pt.dcnt[++t];
+    for (d = 0; d <= MAX_DISTANCE; ++d)
+        cls[d] = d > t;
+    partition_permute(&pt, cls, keys);
+
+    assert(nb < SHARD_LEVELS);
+    bound[nb].vantage = v;
+    for (d = 0; d < t && !pt.dcnt[d]; ++d);
+    bound[nb].lo = d;
+    for (d = t; d > 0 && !pt.dcnt[d]; --d);
+    bound[nb].hi = d;
+    shard_split(sh, keys, a, first, half, bound, nb + 1);
+    for (d = t + 1; d < MAX_DISTANCE && !pt.dcnt[d]; ++d);
+    bound[nb].lo = d;
+    for (d = MAX_DISTANCE; d > t + 1 && !pt.dcnt[d]; --d);
+    bound[nb].hi = d;
+    shard_split(sh, keys + a, n - a, first + half, count - half,
+                bound, nb + 1);
+}
+
+/* The flat trees copy the keys into their arena and free the array
+   they were built from, the others keep it.  */
+static int
+type_frees_keys(const struct tree_type *type)
+{
+    return type->format == INDEX_VPFLAT || type->format == INDEX_BKFLAT;
+}
+
+struct shard_job {
+    struct shard *shard;
+    /* CPUs to build on, or NULL */
+    const cpu_set_t *cpus;
+    int copy;
+    size_t max_linear;
+};
+
+static void *
+shard_job_run(void *arg)
+{
+    struct shard_job *job = arg;
+    struct shard *s = job->shard;
+    bkey_t *keys;
+    cpu_set_t old;
+    int pinned = 0;
+    if (job->cpus)
+        /* The job may be running on the thread which forked it */
+        pinned = !pthread_getaffinity_np(pthread_self(), sizeof(old), &old)
+            && !pthread_setaffinity_np(pthread_self(), sizeof(*job->cpus),
+                                       job->cpus);
+    if (job->copy) {
+        /* Touching the copy first puts it on this node */
+        keys = xmalloc(sizeof(*keys) * s->n);
+        memcpy(keys, s->keys, sizeof(*keys) * s->n);
+        s->keys = keys;
+        s->copied = !type_frees_keys(s->type);
+    }
+    s->root = s->type->mktree(s->keys, s->n, job->max_linear);
+    if (pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(old), &old);
+    return NULL;
+}
+
+static void *shard_node_run(void *arg);
+
+/* Build 'count' shards of the given type from the keys, sharing them
+   out between the given NUMA nodes.  On one node the shards are built
+   in place, unless their type frees its keys, and otherwise each
+   shard has a copy of its keys and the key array is freed.  */
+static void
+shard_build(struct sharded *sh, const struct tree_type *type,
+            bkey_t *keys, size_t n, size_t max_linear, unsigned count,
+            const cpu_set_t *cpus, unsigned nnodes)
+{
+    struct shard_job job[SHARD_MAX];
+    struct task task[SHARD_MAX];
+    struct shard_node *nd;
+    struct shard *s;
+    pthread_attr_t attr;
+    unsigned i, j;
+    int r;
+
+    assert(count >= 1 && count <= SHARD_MAX);
+    sh->n = count;
+    shard_split(sh, keys, n, 0, count, NULL, 0);
+    for (i = 0; i < count; ++i) {
+        s = &sh->shard[i];
+        s->type = type;
+        s->root = NULL;
+        s->copied = 0;
+        s->node = nnodes > 1 ? i * nnodes / count : 0;
+        job[i].shard = s;
+        job[i].cpus = nnodes > 1 ? &cpus[s->node] : NULL;
+        job[i].copy = nnodes > 1 || type_frees_keys(type);
+        job[i].max_linear = max_linear;
+        if (s->n)
+            task_fork(&task[i], shard_job_run, &job[i], s->n);
+    }
+    for (i = 0; i < count; ++i)
+        if (sh->shard[i].n)
+            task_join(&task[i]);
+
+    if (job[0].copy)
+        free(keys);
+    sh->nnodes = nnodes > 1 ? nnodes : 1;
+    sh->nodes = NULL;
+    if (nnodes <= 1)
+        return;
+    sh->nodes = xmalloc(sizeof(*sh->nodes) * nnodes);
+    for (i = 0; i < nnodes; ++i) {
+        nd = &sh->nodes[i];
+        nd->cpus = cpus[i];
+        pthread_mutex_init(&nd->lock, NULL);
+        pthread_cond_init(&nd->wake, NULL);
+        nd->head = NULL;
+        nd->tail = &nd->head;
+        nd->stop = 0;
+        nd->nthreads = CPU_COUNT(&nd->cpus);
+        nd->threads = xmalloc(sizeof(*nd->threads) * nd->nthreads);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(nd->cpus), &nd->cpus);
+        for (j = 0; j < nd->nthreads; ++j) {
+            r = pthread_create(&nd->threads[j], &attr, shard_node_run, nd);
+            if (r) {
+                errno = r;
+                err(1, "pthread_create");
+            }
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/* The number of shards and their type are build options */
+static struct sharded *
+mktree_sharded(bkey_t *restrict keys, size_t n, size_t max_linear)
+{
+    cpu_set_t cpus[SHARD_MAX_NODES];
+    struct sharded *sh = xmalloc(sizeof(*sh));
+    shard_build(sh, build_cur->shard_sub, keys, n, max_linear,
+                build_cur->opts.shards, cpus,
+                numa_nodes(cpus, SHARD_MAX_NODES));
+    return sh;
+}
+
+static void
+free_sharded(struct sharded *sh)
+{
+    struct shard_node *nd;
+    unsigned i, j;
+    for (i = 0; sh->nodes && i < sh->nnodes; ++i) {
+        nd = &sh->nodes[i];
+        pthread_mutex_lock(&nd->lock);
+        nd->stop = 1;
+        pthread_cond_broadcast(&nd->wake);
+        pthread_mutex_unlock(&nd->lock);
+        for (j = 0; j < nd->nthreads; ++j)
+            pthread_join(nd->threads[j], NULL);
+        free(nd->threads);
+        pthread_mutex_destroy(&nd->lock);
+        pthread_cond_destroy(&nd->wake);
+    }
+    free(sh->nodes);
+    for (i = 0; i < sh->n; ++i) {
+        if (sh->shard[i].root)
+            sh->shard[i].type->free(sh->shard[i].root);
+        if (sh->shard[i].copied)
+            free(sh->shard[i].keys);
+    }
+    free(sh);
+}
+
+static void
+measure_sharded(struct sharded *sh, struct mtree_stats *st)
+{
+    unsigned i;
+    st->node_bytes += sizeof(*sh);
+    for (i = 0; i < sh->n; ++i)
+        if (sh->shard[i].root)
+            sh->shard[i].type->measure(sh->shard[i].root, st);
+}
+
+/* The least distance from ref that a key in the shard could have.  */
+static unsigned
+shard_lower(const struct shard *s, bkey_t ref)
+{
+    unsigned i, d, lb = 0;
+    for (i = 0; i < s->nbound; ++i) {
+        d = distance(ref, s->bound[i].vantage);
+        if (d < s->bound[i].lo && s->bound[i].lo - d > lb)
+            lb = s->bound[i].lo - d;
+        else if (d > s->bound[i].hi && d - s->bound[i].hi > lb)
+            lb = d - s->bound[i].hi;
+    }
+    return lb;
+}
+
+/* Run a query on one shard, which is all a shard has to do.  */
+static size_t
+shard_query(struct shard *s, unsigned kind, struct buf *b, bkey_t ref,
+            unsigned maxd)
+{
+    return query_kind(s->type, kind)(b, s->root, ref, maxd);
+}
+
+/* Waits for the shards of a query */
+struct shard_fan {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    unsigned left;
+};
+
+struct shard_req {
+    struct shard *shard;
+    unsigned kind;
+    bkey_t ref;
+    unsigned maxd;
+    struct buf buf;
+    size_t cmp;
+    struct shard_fan *fan;
+    struct shard_req *next;
+};
+
+static void *
+shard_node_run(void *arg)
+{
+    struct shard_node *nd = arg;
+    struct shard_req *r;
+    struct shard_fan *f;
+    for (;;) {
+        pthread_mutex_lock(&nd->lock);
+        while (!nd->head && !nd->stop)
+            pthread_cond_wait(&nd->wake, &nd->lock);
+        r = nd->head;
+        if (r && !(nd->head = r->next))
+            nd->tail = &nd->head;
+        pthread_mutex_unlock(&nd->lock);
+        if (!r)
+            return NULL;
+        r->cmp = shard_query(r->shard, r->kind, &r->buf, r->ref, r->maxd);
+        f = r->fan;
+        pthread_mutex_lock(&f->lock);
+        if (!--f->left)
+            pthread_cond_signal(&f->done);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+/* Merge the hits from a shard into the query's buffer.  */
+static void
+shard_merge(struct buf *restrict b, struct buf *restrict part)
+{
+    size_t i;
+    if (part->mode == BUF_COUNT)
+        b->n += part->n;
+    else
+        for (i = 0; i < part->n; ++i)
+            addkey(b, part->keys[i]);
+    buf_free(part);
+}
+
+/* An existence query stops at the first shard with a hit when the
+   shards run in turn, but asks all of them at once when they run on
+   their nodes.  */
+static size_t
+sharded_run(struct buf *restrict b, struct sharded *restrict sh,
+            bkey_t ref, unsigned maxd, unsigned kind)
+{
+    struct shard_req req[SHARD_MAX], *r;
+    struct shard_node *nd;
+    struct shard_fan fan;
+    struct shard *s;
+    unsigned i, nreq = 0;
+    size_t nc = 0;
+    for (i = 0; i < sh->n; ++i) {
+        s = &sh->shard[i];
+        if (!s->n || shard_lower(s, ref) > maxd)
+            continue;
+        if (!sh->nodes) {
+            nc += shard_query(s, kind, b, ref, maxd);
+            if (kind == QUERY_EXISTS && b->n)
+                break;
+            continue;
+        }
+        r = &req[nreq++];
+        r->shard = s;
+        r->kind = kind;
+        r->ref = ref;
+        r->maxd = maxd;
+        buf_init(&r->buf, b->mode == BUF_COUNT ? BUF_COUNT : BUF_GROW);
+        r->fan = &fan;
+        r->next = NULL;
+    }
+    if (!nreq)
+        return nc;
+
+    pthread_mutex_init(&fan.lock, NULL);
+    pthread_cond_init(&fan.done, NULL);
+    fan.left = nreq;
+    for (i = 0; i < nreq; ++i) {
+        nd = &sh->nodes[req[i].shard->node];
+        pthread_mutex_lock(&nd->lock);
+        *nd->tail = &req[i];
+        nd->tail = &req[i].next;
+        pthread_cond_signal(&nd->wake);
+        pthread_mutex_unlock(&nd->lock);
+    }
+    pthread_mutex_lock(&fan.lock);
+    while (fan.left)
+        pthread_cond_wait(&fan.done, &fan.lock);
+    pthread_mutex_unlock(&fan.lock);
+    pthread_mutex_destroy(&fan.lock);
+    pthread_cond_destroy(&fan.done);
+    for (i = 0; i < nreq; ++i) {
+        nc += req[i].cmp;
+        shard_merge(b, &req[i].buf);
+    }
+    if (kind == QUERY_EXISTS && b->n > 1)
+        b->n = 1;
+    return nc;
+}
+
+static size_t
+query_sharded(struct buf *restrict b, struct sharded *restrict sh,
+              bkey_t ref, unsigned maxd)
+{
+    return sharded_run(b, sh, ref, maxd, QUERY_RADIUS);
+}
+
+static size_t
+count_sharded(struct buf *restrict b, struct sharded *restrict sh,
+              bkey_t ref, unsigned maxd)
+{
+    return sharded_run(b, sh, ref, maxd, QUERY_COUNT);
+}
+
+static size_t
+exists_sharded(struct buf *restrict b, struct sharded *restrict sh,
+               bkey_t ref, unsigned maxd)
+{
+    return sharded_run(b, sh, ref, maxd, QUERY_EXISTS);
+}
+
+/* kNN queries run the shards in turn on the calling thread, nearest
+   first, so the later ones can be skipped once the heap is good
+   enough.  */
+static size_t
+knn_sharded(struct knn *restrict h, struct sharded *restrict sh, bkey_t ref)
+{
+    unsigned lb[SHARD_MAX], order[SHARD_MAX], i, j, n = 0;
+    struct shard *s;
+    size_t nc = 0;
+    for (i = 0; i < sh->n; ++i) {
+        if (!sh->shard[i].n)
+            continue;
+        lb[i] = shard_lower(&sh->shard[i], ref);
+        for (j = n++; j > 0 && lb[order[j - 1]] > lb[i]; --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    for (i = 0; i < n; ++i) {
+        s = &sh->shard[order[i]];
+        if ((int) lb[order[i]] > knn_radius(h))
+            break;
+        nc += s->type->knn(h, s->root, ref);
+    }
+    return nc;
+}
+
+/* Queries on a struct sharded */
+static const struct tree_type shard_type = {
+    "sharded", "Sharded index",
+    (mktree_t) mktree_sharded, (query_t) query_sharded, NULL,
+    (knn_t) knn_sharded, NULL, (query_t) count_sharded,
+    (query_t) exists_sharded, NULL, 0, NULL, NULL, (free_t) free_sharded,
+    (measure_t) measure_sharded
+};
+
+/* Query server ====================
+
+   A server answers queries on an index on a Unix socket, for an ADDR
+   of unix:PATH, or on a TCP port, for [HOST:]PORT.  Each request is 8 bytes followed by a key:
+
+       uint32  id, which is sent back with the response
+       uint8   kind: QUERY_RADIUS, QUERY_COUNT, QUERY_EXISTS, SRV_KNN
+               or SRV_INFO
+       uint8   0
+       uint16  the radius, or k
+       key     KEY_BYTES, as in a binary key file
+
+   Each response is 24 bytes, and the keys of a radius or kNN query
+   follow it:
+
+       uint32  id
+       uint16  0, or SRV_EINVAL if the index can't run the query
+       uint16  distance of the farthest kNN result
+       uint64  hits, or the number of keys for SRV_INFO
+       uint64  keys compared, or KEY_BITS for SRV_INFO
+
+   All of it is little-endian.  A client can send any number of
+   requests without waiting for the responses, which come back as the
+   queries finish, so not always in order.
+
+   Each connection has a thread which reads its requests into one
+   queue.  The thread in mtree_serve() takes up to 'batch' requests at
+   a time, waiting at most 'deadline' usec after the oldest one for the
+   rest, and runs them with run_batch() on a pool of threads started
+   once.  So a larger batch or a later deadline trades latency for
+   throughput.  Requests go on queueing while a batch runs.
+
+   A response is queued as soon as its query finishes, and written by
+   a second thread of the connection, so a client which doesn't read
+   its responses holds up nobody else.  Each connection has at most
+   'inflight' requests which have been read but whose responses
+   haven't been written, and its reader waits for them before reading
+   more, so neither can grow without bound.
+
+   mtree_connect() gives an index which runs its queries on a server
+   instead, through the "remote" type, with a connection for each
+   query thread.  */
+
+enum {
+    SRV_KNN = QUERY_EXISTS + 1,
+    SRV_INFO,
+    SRV_REQUEST = 8 + KEY_BYTES,
+    SRV_RESPONSE = 24,
+    SRV_EINVAL = 1,
+    /* The least requests in flight on a connection, see srv_listen() */
+    SRV_INFLIGHT = 64,
+    /* Keys of a response built on the stack */
+    SRV_CHUNK = 256
+};
+
+/* The rest of a response, waiting to be written */
+struct srv_out {
+    struct srv_out *next;
+    size_t len;
+    unsigned char data[];
+};
+
+struct srv_conn {
+    int fd;
+    /* Held for the fields below */
+    pthread_mutex_t lock;
+    /* Signalled for a response to write, and when the reader ends */
+    pthread_cond_t more;
+    /* Signalled when a response is written */
+    pthread_cond_t room;
+    struct srv_out *out, **out_tail;
+    /* The writer is sending what it took from 'out' */
+    int writing;
+    /* Requests read and not yet answered */
+    unsigned inflight;
+    /* The reader hasn't reached the end */
+    int reading;
+    /* A write failed, so the rest are dropped */
+    int broken;
+    /* The reader, the writer and each request in a batch, under the
+       server's lock */
+    unsigned refs;
+    struct mtree_server *server;
+};
+
+struct srv_req {
+    struct srv_conn *conn;
+    uint32_t id;
+    unsigned kind, arg;
+    bkey_t key;
+    uint64_t arrived;
+    struct srv_req *next;
+};
+
+struct mtree_server {
+    const struct tree_type *type;
+    void *root;
+    size_t nkeys;
+    struct mtree_batch bo;
+    /* Requests per batch, and how long to wait for them in usec */
+    unsigned batch;
+    unsigned long deadline;
+    /* Requests in flight on each connection */
+    unsigned inflight;
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct srv_req *head, **tail;
+    size_t nqueued;
+};
+
+static void
+put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+    unsigned i;
+    for (i = 0; i < n; ++i)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t
+get_le(const unsigned char *p, unsigned n)
+{
+    uint64_t v = 0;
+    unsigned i;
+    for (i = 0; i < n; ++i)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+/* An errno for a getaddrinfo() error */
+static int
+gai_errno(int r)
+{
+    switch (r) {
+    case EAI_SYSTEM:
+        return errno;
+    case EAI_MEMORY:
+        return ENOMEM;
+    case EAI_AGAIN:
+        return EAGAIN;
+    default:
+        return EADDRNOTAVAIL;
+    }
+}
+
+/* Open a socket for an ADDR, listening on it or connected to it.
+   Returns -1 if it can't.  */
+static int
+srv_socket(const char *addr, int listening)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un un;
+    struct stat st;
+    char host[256];
+    const char *port;
+    int fd = -1, one = 1, r;
+
+    if (!strncmp(addr, "unix:", 5)) {
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof(un.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(un.sun_path, addr + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (listening) {
+            /* Replace the socket of an earlier server */
+            if (!lstat(un.sun_path, &st) && S_ISSOCK(st.st_mode))
+                unlink(un.sun_path);
+            r = bind(fd, (struct sockaddr *) &un, sizeof(un));
+        } else {
+            r = connect(fd, (struct sockaddr *) &un, sizeof(un));
+        }
+        if (r)
+            goto fail;
+    } else {
+        port = strrchr(addr, ':');
+        if (port) {
+            if ((size_t) (port - addr) >= sizeof(host)) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            memcpy(host, addr, port - addr);
+            host[port - addr] = 0;
+            port++;
+        } else {
+            host[0] = 0;
+            port = addr;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        r = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+        if (r) {
+            errno = gai_errno(r);
+            return -1;
+        }
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (listening) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                r = bind(fd, ai->ai_addr, ai->ai_addrlen);
+            } else {
+                r = connect(fd, ai->ai_addr, ai->ai_addrlen);
+            }
+            if (!r)
+                break;
+            r = errno;
+            close(fd);
+            errno = r;
+            fd = -1;
+        }
+        r = errno;
+        freeaddrinfo(res);
+        errno = r;
+        if (fd < 0)
+            return -1;
+    }
+    if (!listening || !listen(fd, SOMAXCONN))
+        return fd;
+fail:
+    r = errno;
+    close(fd);
+    errno = r;
+    return -1;
+}
+
+/* Write all of a buffer, or return -1.  */
+static int
+srv_send(int fd, const unsigned char *p, size_t n)
+{
+    ssize_t r;
+    while (n) {
+        r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* Read all of a buffer, or return -1 at the end or on an error.  */
+static int
+srv_recv(int fd, unsigned char *p, size_t n)
+{
+    ssize_t r;
+    while (n) {
+        r = recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* Count a request as answered, with the connection's lock held.  */
+static void
+srv_answered(struct srv_conn *c, unsigned n)
+{
+    c->inflight -= n;
+    pthread_cond_signal(&c->room);
+    /* The writer waits for this once the reader has ended */
+    if (!c->inflight && !c->reading)
+        pthread_cond_signal(&c->more);
+}
+
+/* Send the response to a request if the socket has room for it, and
+   queue what it hasn't for srv_writer().  This never waits for the
+   client, so a batch worker can call it.  */
+static void
+srv_respond(struct srv_conn *c, uint32_t id, unsigned status,
+            unsigned kdist, uint64_t hits, uint64_t cmp,
+            const bkey_t *keys, size_t n)
+{
+    unsigned char small[SRV_RESPONSE + SRV_CHUNK * KEY_BYTES], *p = small;
+    size_t i, len = SRV_RESPONSE + KEY_BYTES * n;
+    struct srv_out *o;
+    ssize_t r = 0;
+    if (n > SRV_CHUNK)
+        p = xmalloc(len);
+    put_le(p, id, 4);
+    put_le(p + 4, status, 2);
+    put_le(p + 6, kdist, 2);
+    put_le(p + 8, hits, 8);
+    put_le(p + 16, cmp, 8);
+    for (i = 0; i < n; ++i)
+        key_store_le(p + SRV_RESPONSE + KEY_BYTES * i, keys[i]);
+    pthread_mutex_lock(&c->lock);
+    /* Behind queued responses, it has to wait its turn */
+    if (!c->broken && !c->out && !c->writing) {
+        do
+            r = send(c->fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        while (r < 0 && errno == EINTR);
+        if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            c->broken = 1;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        if (r < 0)
+            r = 0;
+    }
+    if (c->broken || (size_t) r == len) {
+        srv_answered(c, 1);
+    } else {
+        o = xmalloc(sizeof(*o) + len - r);
+        o->next = NULL;
+        o->len = len - r;
+        memcpy(o->data, p + r, len - r);
+        *c->out_tail = o;
+        c->out_tail = &o->next;
+        pthread_cond_signal(&c->more);
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (p != small)
+        free(p);
+}
+
+/* Drop a reference to a connection, with the server's lock held.  */
+static void
+srv_release(struct srv_conn *c)
+{
+    if (--c->refs)
+        return;
+    close(c->fd);
+    pthread_cond_destroy(&c->more);
+    pthread_cond_destroy(&c->room);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+/* Write a connection's responses, until the reader has ended and
+   every request it read is answered.  */
+static void *
+srv_writer(void *arg)
+{
+    struct srv_conn *c = arg;
+    struct mtree_server *s = c->server;
+    struct srv_out *o, *next;
+    unsigned n;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (!c->out && (c->reading || c->inflight))
+            pthread_cond_wait(&c->more, &c->lock);
+        if (!c->out)
+            break;
+        o = c->out;
+        c->out = NULL;
+        c->out_tail = &c->out;
+        c->writing = 1;
+        pthread_mutex_unlock(&c->lock);
+        for (n = 0; o; o = next, ++n) {
+            next = o->next;
+            if (!c->broken && srv_send(c->fd, o->data, o->len)) {
+                pthread_mutex_lock(&c->lock);
+                c->broken = 1;
+                pthread_mutex_unlock(&c->lock);
+                shutdown(c->fd, SHUT_RDWR);
+            }
+            free(o);
+        }
+        pthread_mutex_lock(&c->lock);
+        c->writing = 0;
+        srv_answered(c, n);
+    }
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_lock(&s->lock);
+    srv_release(c);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void *
+srv_reader(void *arg)
+{
+    struct srv_conn *c = arg;
+    struct mtree_server *s = c->server;
+    unsigned char in[SRV_REQUEST * 64];
+    struct srv_req *head, **tail, *req;
+    size_t len = 0, pos, n, room;
+    ssize_t r;
+    for (;;) {
+        /* Read no more than the requests which can be in flight */
+        pthread_mutex_lock(&c->lock);
+        while (c->inflight >= s->inflight)
+            pthread_cond_wait(&c->room, &c->lock);
+        room = s->inflight - c->inflight;
+        pthread_mutex_unlock(&c->lock);
+        if (room > sizeof(in) / SRV_REQUEST)
+            room = sizeof(in) / SRV_REQUEST;
+        r = recv(c->fd, in + len, SRV_REQUEST * room - len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += r;
+        head = NULL;
+        tail = &head;
+        for (pos = 0, n = 0; len - pos >= SRV_REQUEST;
+             pos += SRV_REQUEST, ++n) {
+            req = xmalloc(sizeof(*req));
+            req->conn = c;
+            req->id = get_le(in + pos, 4);
+            req->kind = in[pos + 4];
+            req->arg = get_le(in + pos + 6, 2);
+            req->key = key_load_le(in + pos + 8);
+            req->arrived = nsec_now();
+            req->next = NULL;
+            *tail = req;
+            tail = &req->next;
+        }
+        memmove(in, in + pos, len - pos);
+        len -= pos;
+        if (!n)
+            continue;
+        pthread_mutex_lock(&c->lock);
+        c->inflight += n;
+        pthread_mutex_unlock(&c->lock);
+        pthread_mutex_lock(&s->lock);
+        c->refs += n;
+        *s->tail = head;
+        s->tail = tail;
+        s->nqueued += n;
+        /* The dispatcher only waits for a batch to start or to fill */
+        if (s->nqueued == n || s->nqueued >= s->batch)
+            pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_lock(&c->lock);
+    c->reading = 0;
+    pthread_cond_signal(&c->more);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_lock(&s->lock);
+    srv_release(c);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void *
+srv_accept(void *arg)
+{
+    struct mtree_server *s = arg;
+    struct srv_conn *c;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fd, r;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        fd = accept(s->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            err(1, "accept");
+        }
+        c = xmalloc(sizeof(*c));
+        c->fd = fd;
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->more, NULL);
+        pthread_cond_init(&c->room, NULL);
+        c->out = NULL;
+        c->out_tail = &c->out;
+        c->writing = 0;
+        c->inflight = 0;
+        c->reading = 1;
+        c->broken = 0;
+        c->refs = 2;
+        c->server = s;
+        r = pthread_create(&thread, &attr, srv_reader, c);
+        if (!r)
+            r = pthread_create(&thread, &attr, srv_writer, c);
+        if (r) {
+            errno = r;
+            err(1, "pthread_create");
+        }
+    }
+    return NULL;
+}
+
+/* The requests of one kind in a batch */
+struct srv_run {
+    struct srv_req **req;
+    struct mtree_query *q;
+};
+
+static void
+srv_emit(void *arg, const struct mtree_query *q, const bkey_t *keys, size_t n)
+{
+    struct srv_run *run = arg;
+    struct srv_req *req = run->req[q - run->q];
+    if (q->error)
+        srv_respond(req->conn, req->id, SRV_EINVAL, 0, 0, 0, NULL, 0);
+    else
+        srv_respond(req->conn, req->id, 0,
+                    req->kind == SRV_KNN ? q->kdist : 0,
+                    q->hits, q->cmp, keys, keys ? n : 0);
+}
+
+/* Say whether the index can run a request.  */
+static int
+srv_valid(const struct mtree_server *s, const struct srv_req *req)
+{
+    if (req->kind == SRV_KNN)
+        return s->type->knn && req->arg;
+    return req->kind <= QUERY_EXISTS && query_kind(s->type, req->kind);
+}
+
+/* Run a batch of requests, a kind at a time, on the server's pool.  */
+static void
+srv_run(struct mtree_server *s, struct batch_pool *pool,
+        struct srv_req **req, size_t n, struct srv_req **sub,
+        struct mtree_query *q)
+{
+    struct mtree_batch bo;
+    struct srv_run run;
+    size_t i, m;
+    unsigned kind;
+    for (kind = QUERY_RADIUS; kind <= SRV_KNN; ++kind) {
+        for (i = 0, m = 0; i < n; ++i) {
+            if (req[i]->kind != kind)
+                continue;
+            sub[m] = req[i];
+            q[m].key = req[i]->key;
+            q[m].maxd = req[i]->arg;
+            m++;
+        }
+        if (!m)
+            continue;
+        bo = s->bo;
+        bo.knn = kind == SRV_KNN;
+        bo.kind = kind == SRV_KNN ? QUERY_RADIUS : kind;
+        bo.sink = kind == QUERY_RADIUS || kind == SRV_KNN
+            ? BUF_GROW : BUF_COUNT;
+        bo.reserve = 0;
+        bo.block = kind == QUERY_RADIUS && !bo.budget ? bo.block : 0;
+        bo.budget = kind == QUERY_RADIUS ? bo.budget : 0;
+        bo.latency = 0;
+        bo.emit = srv_emit;
+        bo.arg = &run;
+        run.req = sub;
+        run.q = q;
+        run_batch(pool, s->type, s->root, q, m, &bo);
+    }
+}
+
+/* Start listening, and accepting connections, for an index.  Returns
+   NULL if it can't listen on ADDR.  */
+static struct mtree_server *
+srv_listen(const struct tree_type *type, void *root, size_t nkeys,
+           const struct mtree_batch *bo, const char *addr, unsigned batch,
+           unsigned long deadline)
+{
+    struct mtree_server *s;
+    pthread_condattr_t attr;
+    pthread_t thread;
+    int fd, e;
+
+    assert(batch > 0);
+    fd = srv_socket(addr, 1);
+    if (fd < 0)
+        return NULL;
+    s = xmalloc(sizeof(*s));
+    s->fd = fd;
+    s->type = type;
+    s->root = root;
+    s->nkeys = nkeys;
+    s->bo = *bo;
+    s->batch = batch;
+    s->deadline = deadline;
+    /* Enough for a client to fill batches on its own */
+    s->inflight = batch > SRV_INFLIGHT / 2 ? 2 * batch : SRV_INFLIGHT;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    s->head = NULL;
+    s->tail = &s->head;
+    s->nqueued = 0;
+    e = pthread_create(&thread, NULL, srv_accept, s);
+    if (e) {
+        errno = e;
+        err(1, "pthread_create");
+    }
+    pthread_detach(thread);
+    return s;
+}
+
+/* Serve queries until the process is killed.  */
+void
+mtree_serve(struct mtree_server *s)
+{
+    struct srv_req **req, **sub, *r;
+    struct batch_pool *pool;
+    struct mtree_query *q;
+    struct timespec ts;
+    uint64_t deadline;
+    size_t i, n;
+
+    /* Started once, rather than for each batch */
+    pool = bpool_create(s->bo.nthreads);
+    req = xmalloc(sizeof(*req) * s->batch);
+    sub = xmalloc(sizeof(*sub) * s->batch);
+    q = xmalloc(sizeof(*q) * s->batch);
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->head)
+            pthread_cond_wait(&s->wake, &s->lock);
+        deadline = s->head->arrived + s->deadline * 1000;
+        while (s->nqueued < s->batch && nsec_now() < deadline) {
+            ts.tv_sec = deadline / 1000000000;
+            ts.tv_nsec = deadline % 1000000000;
+            pthread_cond_timedwait(&s->wake, &s->lock, &ts);
+        }
+        for (n = 0; n < s->batch && s->head; ++n) {
+            req[n] = s->head;
+            s->head = s->head->next;
+        }
+        if (!s->head)
+            s->tail = &s->head;
+        s->nqueued -= n;
+        pthread_mutex_unlock(&s->lock);
+
+        for (i = 0; i < n; ++i) {
+            r = req[i];
+            /* These are answered here, and srv_run() skips SRV_INFO */
+            if (r->kind == SRV_INFO) {
+                srv_respond(r->conn, r->id, 0, 0, s->nkeys, KEY_BITS, NULL, 0);
+            } else if (!srv_valid(s, r)) {
+                srv_respond(r->conn, r->id, SRV_EINVAL, 0, 0, 0, NULL, 0);
+                r->kind = SRV_INFO;
+            }
+        }
+        srv_run(s, pool, req, n, sub, q);
+
+        pthread_mutex_lock(&s->lock);
+        for (i = 0; i < n; ++i) {
+            srv_release(req[i]->conn);
+            free(req[i]);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* An index on a server, with each thread's connection to it */
+struct remote {
+    char *addr;
+    size_t nkeys;
+    pthread_key_t key;
+};
+
+struct remote_conn {
+    int fd;
+    uint32_t id;
+};
+
+static void
+remote_close(void *arg)
+{
+    struct remote_conn *c = arg;
+    close(c->fd);
+    free(c);
+}
+
+/* A failed call sets query_errno, and drops the connection, so the
+   next opens another rather than get the rest of a response.  */
+static size_t
+remote_fail(struct remote *rm, struct remote_conn *c, int e)
+{
+    if (c) {
+        remote_close(c);
+        pthread_setspecific(rm->key, NULL);
+    }
+    query_errno = e;
+    return 0;
+}
+
+/* Run a query on the server, over the calling thread's connection.
+   The keys it returns go into b, or h for SRV_KNN.  Returns the keys
+   the server compared, or 0 with query_errno set if it failed.  */
+static size_t
+remote_call(struct remote *rm, unsigned kind, bkey_t ref, unsigned arg,
+            struct buf *restrict b, struct knn *restrict h)
+{
+    unsigned char msg[SRV_RESPONSE > SRV_REQUEST
+                      ? SRV_RESPONSE : SRV_REQUEST];
+    struct remote_conn *c;
+    uint64_t i, n, cmp;
+    bkey_t key;
+    int fd;
+
+    if (arg > UINT16_MAX)
+        return remote_fail(rm, NULL, EINVAL);
+    c = pthread_getspecific(rm->key);
+    if (!c) {
+        fd = srv_socket(rm->addr, 0);
+        if (fd < 0)
+            return remote_fail(rm, NULL, errno);
+        c = xmalloc(sizeof(*c));
+        c->fd = fd;
+        c->id = 0;
+        pthread_setspecific(rm->key, c);
+    }
+    put_le(msg, ++c->id, 4);
+    msg[4] = kind;
+    msg[5] = 0;
+    put_le(msg + 6, arg, 2);
+    key_store_le(msg + 8, ref);
+    if (srv_send(c->fd, msg, SRV_REQUEST) ||
+        srv_recv(c->fd, msg, SRV_RESPONSE))
+        return remote_fail(rm, c, ECONNRESET);
+    if (get_le(msg, 4) != c->id)
+        return remote_fail(rm, c, EPROTO);
+    /* The server can't run this kind of query, or this one failed */
+    if (get_le(msg + 4, 2)) {
+        query_errno = EINVAL;
+        return 0;
+    }
+    n = get_le(msg + 8, 8);
+    cmp = get_le(msg + 16, 8);
+    if (kind != QUERY_RADIUS && kind != SRV_KNN) {
+        b->n += n;
+        return cmp;
+    }
+    for (i = 0; i < n; ++i) {
+        if (srv_recv(c->fd, msg, KEY_BYTES))
+            return remote_fail(rm, c, ECONNRESET);
+        key = key_load_le(msg);
+        if (h)
+            knn_add(h, key, distance(key, ref));
+        else
+            addkey(b, key);
+    }
+    return cmp;
+}
+
+/* Only the calling thread's connection is closed here, the others
+   close as their threads exit.  */
+static void
+free_remote(struct remote *rm)
+{
+    struct remote_conn *c = pthread_getspecific(rm->key);
+    if (c)
+        remote_close(c);
+    pthread_key_delete(rm->key);
+    free(rm->addr);
+    free(rm);
+}
+
+/* Connect to a server, and check it has the same key width.  Returns
+   NULL if it can't connect, or EINVAL if the keys differ.  */
+static struct remote *
+remote_open(const char *addr)
+{
+    struct remote *rm = xmalloc(sizeof(*rm));
+    struct buf b;
+    bkey_t zero;
+    size_t bits;
+    int r;
+    memset(&zero, 0, sizeof(zero));
+    rm->addr = strdup(addr);
+    if (!rm->addr)
+        err(1, "strdup");
+    r = pthread_key_create(&rm->key, remote_close);
+    if (r) {
+        errno = r;
+        err(1, "pthread_key_create");
+    }
+    buf_init(&b, BUF_COUNT);
+    bits = remote_call(rm, SRV_INFO, zero, 0, &b, NULL);
+    rm->nkeys = b.n;
+    buf_free(&b);
+    if (query_errno || bits != KEY_BITS) {
+        r = query_errno ? query_errno : EINVAL;
+        query_errno = 0;
+        free_remote(rm);
+        errno = r;
+        return NULL;
+    }
+    return rm;
+}
+
+static size_t
+query_remote(struct buf *restrict b, struct remote *restrict rm,
+             bkey_t ref, unsigned maxd)
+{
+    return remote_call(rm, QUERY_RADIUS, ref, maxd, b, NULL);
+}
+
+static size_t
+count_remote(struct buf *restrict b, struct remote *restrict rm,
+             bkey_t ref, unsigned maxd)
+{
+    return remote_call(rm, QUERY_COUNT, ref, maxd, b, NULL);
+}
+
+static size_t
+exists_remote(struct buf *restrict b, struct remote *restrict rm,
+              bkey_t ref, unsigned maxd)
+{
+    return remote_call(rm, QUERY_EXISTS, ref, maxd, b, NULL);
+}
+
+static size_t
+knn_remote(struct knn *restrict h, struct remote *restrict rm, bkey_t ref)
+{
+    return remote_call(rm, SRV_KNN, ref, h->k, NULL, h);
+}
+
+/* Queries on a struct remote.  The server says which it supports. */
+static const struct tree_type remote_type = {
+    "remote", "Remote index",
+    NULL, (query_t) query_remote, NULL, (knn_t) knn_remote, NULL,
+    (query_t) count_remote, (query_t) exists_remote, NULL, 0, NULL, NULL,
+    (free_t) free_remote, NULL
+};
+
+/* Library interface ====================
+
+   The functions in mtree.h.  A struct mtree is an index of one of the
+   types above, where 'base_type' and 'base_root' are the index as it
+   was built, loaded or connected to, and 'type' and 'root' are what
+   queries go to: the index, or the dynamic index or cache wrapped
+   around it.  The handle owns the key array the index was built from,
+   unless the index frees it or the dynamic index has taken it, and
+   the mapping of a loaded index.  The options it was built with stay
+   in 'build', for a dynamic index to rebuild with.  */
+
+struct mtree {
+    const struct tree_type *type, *base_type;
+    void *root, *base_root;
+    /* MTREE_CAN_* for 'type' */
+    int caps;
+    size_t nkeys, max_linear;
+    struct build build;
+    bkey_t *keys;
+    struct dynamic *dyn;
+    struct cache *cache;
+    void *map;
+    size_t mapsize;
+};
+
+static pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+
+static void
+lib_init_once(void)
+{
+    scan_init();
+    slice_init();
+    pack_init();
+}
+
+/* Pick the kernels for this CPU, once.  */
+static void
+lib_init(void)
+{
+    pthread_once(&lib_once, lib_init_once);
+}
+
+static int
+type_caps(const struct tree_type *type)
+{
+    return (type->qblock ? MTREE_CAN_BLOCK : 0) |
+        (type->knn ? MTREE_CAN_KNN : 0) |
+        (type->approx ? MTREE_CAN_APPROX : 0) |
+        (type->count ? MTREE_CAN_COUNT : 0) |
+        (type->exists ? MTREE_CAN_EXISTS : 0) |
+        (type->insert && type->remove ? MTREE_CAN_CHANGE : 0) |
+        (type->image ? MTREE_CAN_SAVE : 0);
+}
+
+/* The type of an index built with the options, and of its shards if
+   it is sharded, and what it supports.  A sharded index can only run
+   the queries which its shards can.  Returns -1 if it can't be
+   built.  */
+static int
+build_caps(const char *name, const struct mtree_opts *opts,
+           const struct tree_type **type, const struct tree_type **sub)
+{
+    const int shard = MTREE_CAN_KNN | MTREE_CAN_COUNT | MTREE_CAN_EXISTS;
+    const struct tree_type *t = find_type(name);
+    int caps;
+    if (!t || opts->shards > SHARD_MAX ||
+        (t->mktree == (mktree_t) mktree_auto && !opts->radii))
+        return -1;
+    caps = type_caps(t);
+    *sub = NULL;
+    *type = t;
+    if (opts->shards) {
+        if (!t->free)
+            return -1;
+        *sub = t;
+        *type = &shard_type;
+        caps = (caps & type_caps(&shard_type) & shard) |
+            (type_caps(&shard_type) & ~shard);
+    }
+    return caps;
+}
+
+int
+mtree_type_caps(const char *type, const struct mtree_opts *opts)
+{
+    static const struct mtree_opts none;
+    const struct tree_type *t, *sub;
+    return build_caps(type, opts ? opts : &none, &t, &sub);
+}
+
+const char *
+mtree_type_desc(const char *type)
+{
+    const struct tree_type *t = find_type(type);
+    return t ? t->desc : NULL;
+}
+
+const char *
+mtree_scan_name(void)
+{
+    lib_init();
+    return scan_name;
+}
+
+const char *
+mtree_kind_name(unsigned kind)
+{
+    return kind <= MTREE_EXISTS ? query_names[kind] : NULL;
+}
+
+size_t
+mtree_estimate(size_t nkeys, unsigned maxd)
+{
+    return buf_estimate(nkeys, maxd);
+}
+
+static struct mtree *
+mtree_new(const struct tree_type *type, void *root, int caps, size_t nkeys)
+{
+    struct mtree *t = xmalloc(sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    t->type = t->base_type = type;
+    t->root = t->base_root = root;
+    t->caps = caps;
+    t->nkeys = nkeys;
+    return t;
+}
+
+struct mtree *
+mtree_build(const char *type, mtree_key_t *keys, size_t n,
+            size_t max_linear, const struct mtree_opts *opts)
+{
+    static const struct mtree_opts none;
+    const struct tree_type *tt, *sub;
+    struct build *old = build_cur;
+    struct mtree *t;
+    int caps;
+
+    if (!opts)
+        opts = &none;
+    caps = build_caps(type, opts, &tt, &sub);
+    if (caps < 0 || !n) {
+        errno = EINVAL;
+        return NULL;
+    }
+    lib_init();
+    t = mtree_new(tt, NULL, caps, n);
+    t->max_linear = max_linear;
+    t->build.opts = *opts;
+    t->build.tokens = opts->threads > 1 ? opts->threads - 1 : 0;
+    t->build.shard_sub = sub;
+    build_cur = &t->build;
+    t->root = t->base_root = tt->mktree(keys, n, max_linear);
+    build_cur = old;
+    /* Only the build uses what these point to */
+    t->build.opts.radii = NULL;
+    t->build.opts.queries = NULL;
+    t->build.opts.nqueries = 0;
+    t->build.opts.log = NULL;
+    if (sub)
+        t->keys = ((struct sharded *) t->root)->nnodes > 1 ||
+            type_frees_keys(sub) ? NULL : keys;
+    else
+        t->keys = type_frees_keys(tt) ? NULL : keys;
+    return t;
+}
+
+struct mtree *
+mtree_load(const char *path, const struct mtree_opts *opts)
+{
+    static const struct mtree_opts none;
+    const struct tree_type *type;
+    struct build *old = build_cur;
+    struct mtree *t;
+    uint32_t format;
+    size_t nkeys;
+    void *map, *root;
+
+    lib_init();
+    t = mtree_new(NULL, NULL, 0, 0);
+    t->build.opts = opts ? *opts : none;
+    build_cur = &t->build;
+    root = index_load(path, &format, &nkeys, &map, &t->mapsize);
+    build_cur = old;
+    if (!root) {
+        free(t);
+        return NULL;
+    }
+    for (type = tree_types; type->name; ++type)
+        if (type->format == format)
+            break;
+    t->type = t->base_type = type;
+    t->root = t->base_root = root;
+    t->caps = type_caps(type);
+    t->nkeys = nkeys;
+    t->map = map;
+    return t;
+}
+
+int
+mtree_save(const struct mtree *t, const char *path)
+{
+    if (!(t->caps & MTREE_CAN_SAVE)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return index_save(path, t->base_type->image, t->base_root, t->nkeys);
+}
+
+struct mtree *
+mtree_connect(const char *addr)
+{
+    struct remote *rm;
+    lib_init();
+    rm = remote_open(addr);
+    if (!rm)
+        return NULL;
+    return mtree_new(&remote_type, rm, type_caps(&remote_type), rm->nkeys);
+}
+
+void
+mtree_free(struct mtree *t)
+{
+    if (!t)
+        return;
+    if (t->cache) {
+        cache_free(t->cache);
+        free(t->cache);
+    }
+    if (t->dyn) {
+        dyn_free(t->dyn);
+        free(t->dyn);
+    } else if (t->base_type->free) {
+        t->base_type->free(t->base_root);
+    }
+    free(t->keys);
+    if (t->map)
+        munmap(t->map, t->mapsize);
+    free(t);
+}
+
+const char *
+mtree_name(const struct mtree *t)
+{
+    return t->base_type->name;
+}
+
+const char *
+mtree_desc(const struct mtree *t)
+{
+    return t->base_type->desc;
+}
+
+int
+mtree_caps(const struct mtree *t)
+{
+    return t->caps;
+}
+
+size_t
+mtree_nkeys(const struct mtree *t)
+{
+    size_t n;
+    if (!t->dyn)
+        return t->nkeys;
+    pthread_rwlock_rdlock(&t->dyn->lock);
+    n = t->dyn->live;
+    pthread_rwlock_unlock(&t->dyn->lock);
+    return n;
+}
+
+unsigned
+mtree_numa_nodes(const struct mtree *t)
+{
+    if (t->base_type != &shard_type)
+        return 1;
+    return ((struct sharded *) t->base_root)->nnodes;
+}
+
+int
+mtree_measure(const struct mtree *t, struct mtree_stats *st)
+{
+    stats_init(st, t->max_linear);
+    if (t->dyn) {
+        measure_dyn(t->dyn, st);
+        return 0;
+    }
+    if (!t->base_type->measure) {
+        errno = EINVAL;
+        return -1;
+    }
+    t->base_type->measure(t->base_root, st);
+    return 0;
+}
+
+/* A growable buffer in the caller's array */
+static void
+buf_caller(struct buf *restrict b, bkey_t *keys, size_t alloc)
+{
+    buf_init(b, BUF_GROW);
+    b->keys = keys;
+    b->a = alloc;
+}
+
+/* Pass on the errno of a query which failed, and say whether it did */
+static int
+query_failed(void)
+{
+    if (!query_errno)
+        return 0;
+    errno = query_errno;
+    query_errno = 0;
+    return 1;
+}
+
+size_t
+mtree_query(const struct mtree *t, mtree_key_t key, unsigned maxd,
+            mtree_key_t **hits, size_t *alloc)
+{
+    struct buf b;
+    buf_caller(&b, *hits, *alloc);
+    t->type->query(&b, t->root, key, maxd);
+    *hits = b.keys;
+    *alloc = b.a;
+    return query_failed() ? (size_t) -1 : b.n;
+}
+
+/* Count the hits of a kind of query, or return -1 if the index
+   doesn't support it.  */
+static size_t
+query_counted(const struct mtree *t, unsigned kind, bkey_t key,
+              unsigned maxd)
+{
+    query_t query = query_kind(t->type, kind);
+    struct buf b;
+    if (!query) {
+        errno = EINVAL;
+        return -1;
+    }
+    buf_init(&b, BUF_COUNT);
+    query(&b, t->root, key, maxd);
+    return query_failed() ? (size_t) -1 : b.n;
+}
+
+size_t
+mtree_count(const struct mtree *t, mtree_key_t key, unsigned maxd)
+{
+    return query_counted(t, QUERY_COUNT, key, maxd);
+}
+
+int
+mtree_exists(const struct mtree *t, mtree_key_t key, unsigned maxd)
+{
+    size_t n = query_counted(t, QUERY_EXISTS, key, maxd);
+    return n == (size_t) -1 ? -1 : n != 0;
+}
+
+size_t
+mtree_knn(const struct mtree *t, mtree_key_t key, unsigned k,
+          mtree_key_t *keys, unsigned *kdist)
+{
+    struct knn h;
+    size_t i;
+    if (!t->type->knn) {
+        errno = EINVAL;
+        return -1;
+    }
+    knn_init(&h, k);
+    t->type->knn(&h, t->root, key);
+    if (query_failed()) {
+        knn_free(&h);
+        return -1;
+    }
+    *kdist = knn_sort(&h);
+    for (i = 0; i < h.n; ++i)
+        keys[i] = h.heap[i].key;
+    knn_free(&h);
+    return i;
+}
+
+/* Check a batch against what the index supports, as run_batch()
+   asserts.  */
+static int
+batch_valid(int caps, const struct mtree_batch *bo)
+{
+    int kind = bo->kind == MTREE_COUNT ? MTREE_CAN_COUNT
+        : bo->kind == MTREE_EXISTS ? MTREE_CAN_EXISTS : 0;
+    if (bo->kind > MTREE_EXISTS || bo->sink > MTREE_SINK_VISIT ||
+        (bo->sink == MTREE_SINK_VISIT && !bo->visit))
+        return 0;
+    if (bo->block > QBLOCK_MAX || (bo->block && !(caps & MTREE_CAN_BLOCK)))
+        return 0;
+    if (bo->knn && !(caps & MTREE_CAN_KNN))
+        return 0;
+    if (bo->budget &&
+        (!(caps & MTREE_CAN_APPROX) || bo->block || bo->knn))
+        return 0;
+    if (kind && (!(caps & kind) || bo->sink != MTREE_SINK_COUNT ||
+                 bo->block || bo->knn || bo->budget))
+        return 0;
+    return 1;
+}
+
+int
+mtree_batch(const struct mtree *t, struct mtree_query *q, size_t n,
+            const struct mtree_batch *bo)
+{
+    size_t i;
+    if (!batch_valid(t->caps, bo)) {
+        errno = EINVAL;
+        return -1;
+    }
+    run_batch(NULL, t->type, t->root, q, n, bo);
+    for (i = 0; i < n; ++i)
+        if (q[i].error) {
+            errno = q[i].error;
+            return -1;
+        }
+    return 0;
+}
+
+/* A radius query which calls the type's search directly, so it can be
+   inlined into the caller's loop instead of going through 'query'.
+   Any other index, including one wrapped in a dynamic index or a
+   cache, goes to mtree_query().  */
+#define DEFINE_QUERY(name, fn, root_t)                                  \
+size_t                                                                  \
+mtree_query_##name(const struct mtree *t, mtree_key_t key,              \
+                   unsigned maxd, mtree_key_t **hits, size_t *alloc)    \
+{                                                                       \
+    struct buf b;                                                       \
+    if (t->type->query != (query_t) fn)                                 \
+        return mtree_query(t, key, maxd, hits, alloc);                  \
+    buf_caller(&b, *hits, *alloc);                                      \
+    fn(&b, (root_t *) t->root, key, maxd);                              \
+    *hits = b.keys;                                                     \
+    *alloc = b.a;                                                       \
+    return b.n;                                                         \
+}
+
+DEFINE_QUERY(bk, query_bk, struct bktree)
+DEFINE_QUERY(bkflat, query_bkflat, struct flat)
+DEFINE_QUERY(vp, query_vp, struct vptree)
+DEFINE_QUERY(vpflat, query_vpflat, struct flat)
+DEFINE_QUERY(mih, query_mih, struct mih)
+DEFINE_QUERY(linear, query_linear, struct linear)
+
+int
+mtree_dynamic(struct mtree *t)
+{
+    struct dynamic *d;
+    if (t->dyn)
+        return 0;
+    if (!(t->caps & MTREE_CAN_CHANGE) || t->cache) {
+        errno = EINVAL;
+        return -1;
+    }
+    d = xmalloc(sizeof(*d));
+    dyn_init(d, t->type, t->root, t->keys, t->nkeys, t->max_linear,
+             &t->build.opts);
+    t->keys = NULL;
+    t->dyn = d;
+    t->type = &dyn_type;
+    t->root = d;
+    /* The tree changes under a save */
+    t->caps &= ~MTREE_CAN_SAVE;
+    return 0;
+}
+
+int
+mtree_insert(struct mtree *t, mtree_key_t key)
+{
+    if (!t->dyn || t->cache) {
+        errno = EINVAL;
+        return -1;
+    }
+    return dyn_insert(t->dyn, key);
+}
+
+int
+mtree_remove(struct mtree *t, mtree_key_t key)
+{
+    if (!t->dyn || t->cache) {
+        errno = EINVAL;
+        return -1;
+    }
+    return dyn_remove(t->dyn, key);
+}
+
+unsigned
+mtree_rebuilds(struct mtree *t)
+{
+    unsigned n;
+    if (!t->dyn)
+        return 0;
+    dyn_wait(t->dyn);
+    pthread_rwlock_rdlock(&t->dyn->lock);
+    n = t->dyn->rebuilds;
+    pthread_rwlock_unlock(&t->dyn->lock);
+    return n;
+}
+
+int
+mtree_cache(struct mtree *t, size_t bytes)
+{
+    struct cache *c;
+    if (t->cache || !bytes) {
+        errno = EINVAL;
+        return -1;
+    }
+    c = xmalloc(sizeof(*c));
+    cache_init(c, t->type, t->root, bytes);
+    t->cache = c;
+    t->type = &c->type;
+    t->root = c;
+    /* Queries only, and the index is saved from underneath */
+    t->caps = type_caps(&c->type) | (t->caps & MTREE_CAN_SAVE);
+    return 0;
+}
+
+int
+mtree_cache_stats(const struct mtree *t, struct mtree_cache_stats *st)
+{
+    if (!t->cache) {
+        errno = EINVAL;
+        return -1;
+    }
+    cache_stats(t->cache, st);
+    return 0;
+}
+
+struct mtree_server *
+mtree_listen(const struct mtree *t, const char *addr,
+             const struct mtree_batch *bo, unsigned batch,
+             unsigned long deadline)
+{
+    if (!batch || !batch_valid(t->caps, bo)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return srv_listen(t->type, t->root, mtree_nkeys(t), bo, addr, batch,
+                      deadline);
+}
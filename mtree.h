@@ -0,0 +1,316 @@
+/* Metric tree library.
+
+   An index over a set of keys, which finds the keys within a Hamming
+   distance of a query key, or the k nearest ones.  The types of index
+   are described in mtree.c, and "tree" is a benchmark built on this
+   interface.
+
+   Keys are KEY_BITS wide, which is chosen at compile time, and the
+   library and its callers must be built with the same KEY_BITS (and
+   INSTRUMENT, which adds counters to struct mtree_query).
+
+   An index is built once, by one thread, and then any number of
+   threads can query it at once.  Changes to a dynamic index need one
+   thread at a time, but can run alongside queries.  Indexes share
+   nothing, so any number of them can be used at once.  Functions
+   which can't do what is asked, such as a query the type of index
+   doesn't support, a file which can't be read or written, or a
+   server which can't be reached, return NULL or -1 and set errno.
+   Only running out of memory, or threads, is fatal, and exits with a
+   message, as in the benchmark.  */
+
+#ifndef MTREE_H
+#define MTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef KEY_BITS
+#define KEY_BITS 32
+#endif
+
+#if KEY_BITS == 32
+typedef uint32_t mtree_key_t;
+#elif KEY_BITS == 64
+typedef uint64_t mtree_key_t;
+#elif KEY_BITS == 128 || KEY_BITS == 256 || KEY_BITS == 512
+#define MTREE_KEY_WORDS (KEY_BITS / 64)
+typedef struct {
+    uint64_t w[MTREE_KEY_WORDS];
+} mtree_key_t;
+#else
+#error "KEY_BITS must be 32, 64, 128, 256, or 512"
+#endif
+
+enum {
+    MTREE_MAX_DISTANCE = KEY_BITS,
+    /* Most queries in a block, see struct mtree_batch */
+    MTREE_BLOCK_MAX = 256,
+    MTREE_SHARD_MAX = 256,
+    /* Size of a buffer for mtree_keystr() */
+    MTREE_KEYSTR = KEY_BITS + 1,
+    /* Leaf fill buckets, in tenths of MAXLIN, and one for leaves over */
+    MTREE_STATS_FILL = 11,
+    /* Leaf depths counted, the last taking any deeper */
+    MTREE_STATS_DEPTH = 64,
+    /* Depths of the visits counted with INSTRUMENT */
+    MTREE_STAT_DEPTH = 64
+};
+
+/* Kinds of query */
+enum {
+    MTREE_RADIUS,
+    MTREE_COUNT,
+    MTREE_EXISTS
+};
+
+/* What happens to the hits of the queries in a batch.  GROW stores
+   them in a growable array, COUNT only counts them, FIXED stores up
+   to 'reserve' of them and sets 'overflow' for the rest, and VISIT
+   passes each one to a callback.  */
+enum {
+    MTREE_SINK_GROW,
+    MTREE_SINK_COUNT,
+    MTREE_SINK_FIXED,
+    MTREE_SINK_VISIT
+};
+
+/* What an index, or a type of index, supports */
+enum {
+    MTREE_CAN_BLOCK = 1 << 0,
+    MTREE_CAN_KNN = 1 << 1,
+    MTREE_CAN_APPROX = 1 << 2,
+    MTREE_CAN_COUNT = 1 << 3,
+    MTREE_CAN_EXISTS = 1 << 4,
+    MTREE_CAN_CHANGE = 1 << 5,
+    MTREE_CAN_SAVE = 1 << 6
+};
+
+struct mtree;
+
+/* Options for building an index.  Zero is the default for each.  */
+struct mtree_opts {
+    /* Threads to build on, counting the caller's */
+    unsigned threads;
+    /* Choose each vantage point from this many samples */
+    unsigned vantage_samples;
+    /* Sort VP-tree leaves, bit-slice leaves, and pack VP-tree leaves.
+       Only keys of at most 64 bits are packed: with wider keys
+       pack_leaves builds the leaves unpacked.  */
+    int sort_leaves, slice_leaves, pack_leaves;
+    /* Split the keys between this many indexes of the type */
+    unsigned shards;
+    /* For "auto", which needs the radii: nonzero for each radius to
+       tune for, with MTREE_MAX_DISTANCE + 1 entries, the keys to time
+       queries with, or NULL for random ones, and where to print its
+       choices, or NULL.  These are only used during the build.  */
+    const unsigned char *radii;
+    const mtree_key_t *queries;
+    size_t nqueries;
+    FILE *log;
+};
+
+/* A query in a batch */
+struct mtree_query {
+    mtree_key_t key;
+    /* The radius, or k for kNN queries */
+    unsigned maxd;
+    /* Results */
+    size_t hits;
+    size_t cmp;
+    int overflow;
+    /* An approximate query ran out of budget */
+    int partial;
+    /* The errno of a query which failed, as one on a server can, or 0 */
+    int error;
+    /* Distance of the farthest result, for kNN queries */
+    unsigned kdist;
+    /* Time taken, if the batch records latency */
+    uint64_t nsec;
+#if defined(INSTRUMENT) && INSTRUMENT
+    size_t nodes, leaves, scanned;
+#endif
+};
+
+/* Called by a worker thread with the results of each query.  The
+   keys are NULL if the batch only counts hits.  */
+typedef void (*mtree_emit_t)(void *, const struct mtree_query *,
+                             const mtree_key_t *, size_t);
+
+/* How to run a batch of queries */
+struct mtree_batch {
+    unsigned nthreads;
+    /* Run kNN queries, with k in the 'maxd' field of each query */
+    int knn;
+    /* Queries per block, or 0 to run queries one at a time */
+    unsigned block;
+    /* Type of result buffer, MTREE_SINK_* */
+    unsigned sink;
+    /* Initial size of a growable buffer, or size of a fixed one */
+    size_t reserve;
+    /* Callback for MTREE_SINK_VISIT, called from every worker thread */
+    void (*visit)(void *, mtree_key_t);
+    void *visit_arg;
+    mtree_emit_t emit;
+    void *arg;
+    /* Record the time each query takes in its 'nsec' field */
+    int latency;
+    /* Run approximate queries, giving up after this many key
+       comparisons, or 0 for exact queries */
+    size_t budget;
+    /* MTREE_COUNT and MTREE_EXISTS need a sink of MTREE_SINK_COUNT */
+    unsigned kind;
+};
+
+/* The shape and memory of an index, from mtree_measure().  Slack is
+   memory allocated but not in use.  */
+struct mtree_stats {
+    /* The MAXLIN of the index, for the leaf fill */
+    size_t max_linear;
+    /* Internal nodes, leaves, and the keys in either */
+    size_t nodes, leaves, keys;
+    size_t node_bytes, key_bytes, slack;
+    /* Keys in packed leaves, and the bytes of their packing */
+    size_t packed_keys, packed_bytes;
+    size_t fill[MTREE_STATS_FILL];
+    size_t depth[MTREE_STATS_DEPTH];
+};
+
+struct mtree_cache_stats {
+    unsigned long long hits, filtered, misses;
+    size_t bytes, entries;
+};
+
+struct mtree_server;
+
+/* Random keys, from a generator which the caller keeps */
+struct mtree_rng {
+    uint32_t x0, x1, c;
+};
+
+void mtree_rng_seed(struct mtree_rng *r, uint32_t seed);
+uint32_t mtree_rng_next(struct mtree_rng *r);
+mtree_key_t mtree_rng_key(struct mtree_rng *r);
+
+/* The key as KEY_BITS binary digits in 'buf', which has room for
+   MTREE_KEYSTR.  With 'ref' the digits which are the same are dots.  */
+char *mtree_keystr(mtree_key_t k, const mtree_key_t *ref, char *buf);
+/* The key folded to 32 bits, for checksums */
+uint32_t mtree_key_fold(mtree_key_t k);
+
+/* Read keys from a file, given as [bin:|hex:]PATH, where the PATH "-"
+   is standard input.  Reads at most 'max' keys, or all of them if
+   'max' is 0.  The array is allocated with malloc().  A file which
+   isn't valid, such as one ending with a partial key, is EINVAL.  */
+mtree_key_t *mtree_keys_read(const char *spec, size_t max, size_t *count);
+
+/* The kernel chosen for scanning leaves on this CPU */
+const char *mtree_scan_name(void);
+const char *mtree_kind_name(unsigned kind);
+/* Expected number of hits of a radius query on random keys, for
+   sizing a growable buffer */
+size_t mtree_estimate(size_t nkeys, unsigned maxd);
+
+/* What an index of a type, built with the options, would support, or
+   -1 if there is no such type or it can't take the options.  */
+int mtree_type_caps(const char *type, const struct mtree_opts *opts);
+const char *mtree_type_desc(const char *type);
+
+/* Build an index of a type: "bk", "vp", "vpflat", "bkflat", "mih",
+   "linear" or "auto".  The index takes the key array, which must be
+   allocated with malloc(), and may reorder it.  'max_linear' is the
+   leaf size, or for "mih" the number of substrings.  'opts' can be
+   NULL.  */
+struct mtree *mtree_build(const char *type, mtree_key_t *keys, size_t n,
+                          size_t max_linear, const struct mtree_opts *opts);
+/* Map a file saved by mtree_save(), and query it in place.  Only the
+   slice_leaves option applies, and 'opts' can be NULL.  A file which
+   isn't a valid index is EINVAL, and one from another build, such as
+   with other KEY_BITS, is ENOTSUP.  */
+struct mtree *mtree_load(const char *path, const struct mtree_opts *opts);
+int mtree_save(const struct mtree *t, const char *path);
+/* An index served by mtree_serve().  A server with other KEY_BITS is
+   EINVAL.  Queries on the index which lose the connection fail with
+   ECONNRESET, and the next one connects again.  */
+struct mtree *mtree_connect(const char *addr);
+void mtree_free(struct mtree *t);
+
+const char *mtree_name(const struct mtree *t);
+const char *mtree_desc(const struct mtree *t);
+int mtree_caps(const struct mtree *t);
+size_t mtree_nkeys(const struct mtree *t);
+/* NUMA nodes a sharded index is spread over */
+unsigned mtree_numa_nodes(const struct mtree *t);
+/* Returns -1 for an index which can't be measured, on a server */
+int mtree_measure(const struct mtree *t, struct mtree_stats *st);
+
+/* Find the keys within 'maxd' of 'key', into '*hits', which holds
+   '*alloc' keys and is grown with realloc().  Returns the hits.  The
+   count, exists and kNN queries return -1 if the index doesn't
+   support them, and any of them does if it fails on a server.  */
+size_t mtree_query(const struct mtree *t, mtree_key_t key, unsigned maxd,
+                   mtree_key_t **hits, size_t *alloc);
+size_t mtree_count(const struct mtree *t, mtree_key_t key, unsigned maxd);
+int mtree_exists(const struct mtree *t, mtree_key_t key, unsigned maxd);
+/* The k nearest keys, nearest first, into 'keys', which has room for
+   k, with the distance of the farthest in '*kdist'.  Returns how many
+   there are.  */
+size_t mtree_knn(const struct mtree *t, mtree_key_t key, unsigned k,
+                 mtree_key_t *keys, unsigned *kdist);
+/* Run a batch of queries on bo->nthreads threads.  Returns -1 with
+   the first error if any of them failed, and the others are still
+   run.  */
+int mtree_batch(const struct mtree *t, struct mtree_query *q, size_t n,
+                const struct mtree_batch *bo);
+
+/* mtree_query() for an index of one type, which runs the type's
+   search directly instead of through the table of types.  Other
+   indexes go to mtree_query().  */
+size_t mtree_query_bk(const struct mtree *t, mtree_key_t key, unsigned maxd,
+                      mtree_key_t **hits, size_t *alloc);
+size_t mtree_query_bkflat(const struct mtree *t, mtree_key_t key,
+                          unsigned maxd, mtree_key_t **hits, size_t *alloc);
+size_t mtree_query_vp(const struct mtree *t, mtree_key_t key, unsigned maxd,
+                      mtree_key_t **hits, size_t *alloc);
+size_t mtree_query_vpflat(const struct mtree *t, mtree_key_t key,
+                          unsigned maxd, mtree_key_t **hits, size_t *alloc);
+size_t mtree_query_mih(const struct mtree *t, mtree_key_t key, unsigned maxd,
+                       mtree_key_t **hits, size_t *alloc);
+size_t mtree_query_linear(const struct mtree *t, mtree_key_t key,
+                          unsigned maxd, mtree_key_t **hits, size_t *alloc);
+
+/* Allow changes to the keys of a BK-tree or VP-tree, which can then
+   no longer be saved.  Once the changes add up to a quarter of the
+   keys, it is rebuilt on another thread with the options it was built
+   with.  */
+int mtree_dynamic(struct mtree *t);
+/* Add or remove a key of a dynamic index.  Returns 0 if it was
+   already there, or wasn't.  */
+int mtree_insert(struct mtree *t, mtree_key_t key);
+int mtree_remove(struct mtree *t, mtree_key_t key);
+/* Wait for a rebuild to finish, and return the number so far */
+unsigned mtree_rebuilds(struct mtree *t);
+
+/* Cache query results in 'bytes'.  The cache can't see changes, so
+   the index can't be changed after this.  Blocked and approximate
+   queries aren't cached, so the index no longer runs them.  */
+int mtree_cache(struct mtree *t, size_t bytes);
+int mtree_cache_stats(const struct mtree *t, struct mtree_cache_stats *st);
+
+/* Listen on unix:PATH or [HOST:]PORT, and serve queries, running them
+   in batches of up to 'batch' which wait up to 'deadline' usec to
+   fill.  mtree_serve() doesn't return.  */
+struct mtree_server *mtree_listen(const struct mtree *t, const char *addr,
+                                  const struct mtree_batch *bo,
+                                  unsigned batch, unsigned long deadline);
+void mtree_serve(struct mtree_server *s);
+
+#if defined(INSTRUMENT) && INSTRUMENT
+/* Visits by depth of the radius queries run one at a time, summed
+   over every batch since the last reset */
+void mtree_visits(size_t visits[MTREE_STAT_DEPTH]);
+void mtree_visits_reset(void);
+#endif
+
+#endif
@@ -1,76 +1,51 @@
-/* Metric tree sample implementation.
+/* Metric tree benchmark.
 
-   This generates a bunch of pseudorandom 32-bit integers, inserts
-   them into an index, and queries the index for points within a
-   certain distance of the given point.
-
-   That is,
-
-   Let S = { N pseudorandom 32-bit integers }
-   Let d(x,y) be the (base-2) Hamming distance between x and y
-   Let q(x,r) = { y in S : d(x,y) <= r }
-
-   There are three implementations in here which can be selected at runtime.
-
-   "bk" is a BK-Tree.  Each internal node has a center point, and each
-   child node contains a set of all points a certain distance away
-   from the center.
-
-   "vp" is a VP-Tree.  Each internal node has a center point and two
-   children.  The "near" child contains all points contained in a
-   closed ball of a certain radius around the center, and the "far"
-   node contains all other points.
-
-   "linear" is a linear search.
-
-   The tree implementations use a linear search for leaf nodes.  The
-   maximum number of points in a leaf node is configurable at runtime,
-   but 1000 is a good number.  If the number is low, say 1, then the
-   memory usage of the tree implementations will skyrocket to
-   unreasonable levels: more than 24 bytes per element.
-
-   Note that VP trees are slightly faster than BK trees for this
-   problem, and neither tree implementation significantly outperforms
-   linear search (that is, by a factor of two or more) for r > 6.  */
+   This generates a bunch of pseudorandom keys, or reads them from a
+   file, builds an index of them with the library in mtree.c, and
+   times queries for the keys within a certain distance of a query
+   key.  The index can also be saved and loaded, changed, cached,
+   served to other processes, or queried on a server.  It only uses
+   the interface in mtree.h.  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
 #include <err.h>
+#include <errno.h>
 #include <time.h>
 #include <stdio.h>
-#include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #ifndef DO_PRINT
 #define DO_PRINT 0
 #endif
 
-#ifndef HAVE_POPCNT
-#define HAVE_POPCNT 0
+#ifndef INSTRUMENT
+#define INSTRUMENT 0
+#endif
+
+#if INSTRUMENT
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #endif
 
-static uint32_t rand_x0, rand_x1, rand_c;
-#define RAND_A 4284966893U
+#include "mtree.h"
+
+/* Random keys and queries, and the queries read from a file */
+static struct mtree_rng rng;
+static mtree_key_t *queries;
+static size_t nqueries;
 
-void
+static void
 seedrand(void)
 {
     time_t t;
     time(&t);
-    rand_x0 = t;
-    fprintf(stderr, "seed: %u\n", rand_x0);
-    rand_x1 = 0x038acaf3U;
-    rand_c = 0xa2cc5886U;
-}
-
-uint32_t
-irand(void)
-{
-    uint64_t y = (uint64_t)rand_x0 * RAND_A + rand_c;
-    rand_x0 = rand_x1;
-    rand_x1 = y;
-    rand_c = y >> 32;
-    return y;
+    fprintf(stderr, "seed: %u\n", (uint32_t) t);
+    mtree_rng_seed(&rng, t);
 }
 
 __attribute__((malloc))
@@ -86,7 +61,7 @@ xmalloc(size_t sz)
     return p;
 }
 
-unsigned long
+static unsigned long
 xatoul(const char *p)
 {
     char *e;
@@ -97,460 +72,1049 @@ xatoul(const char *p)
     return x;
 }
 
-typedef uint32_t bkey_t;
-enum { MAX_DISTANCE = 32 };
+/* The i'th query key, from the query file or random.  */
+static mtree_key_t
+query_key(size_t i)
+{
+    return queries ? queries[i % nqueries] : mtree_rng_key(&rng);
+}
 
-#if HAVE_POPCNT
+static double
+wallclock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
 
-static inline unsigned
-distance(bkey_t x, bkey_t y)
+static void
+print_query(void *arg, const struct mtree_query *q, const mtree_key_t *keys,
+            size_t n)
 {
-    return __builtin_popcount(x^y);
+    char buf[MTREE_KEYSTR];
+    size_t i;
+    (void)arg;
+    if (!keys)
+        return;
+    flockfile(stdout);
+    printf("Query: %s\n", mtree_keystr(q->key, NULL, buf));
+    for (i = 0; i < n; ++i)
+        printf("       %s\n", mtree_keystr(keys[i], &q->key, buf));
+    funlockfile(stdout);
 }
 
-#else
+/* Fold the hits into a checksum, which doesn't depend on the order
+   the hits arrive in.  */
+static void
+visit_xor(void *arg, mtree_key_t k)
+{
+    __atomic_fetch_xor((uint32_t *) arg, mtree_key_fold(k), __ATOMIC_RELAXED);
+}
+
+/* Latency histogram, with LAT_SUB buckets for each power of two of
+   nanoseconds, so a bucket is within about 6% of any value in it.  */
+enum { LAT_SUB = 16, LAT_BUCKETS = 61 * LAT_SUB };
 
-static inline unsigned
-distance(bkey_t x, bkey_t y)
+struct latency {
+    uint64_t count[LAT_BUCKETS];
+    uint64_t n;
+};
+
+static unsigned
+lat_bucket(uint64_t nsec)
 {
-    uint32_t d = x^y;
-    d = (d & 0x55555555U) + ((d >> 1) & 0x55555555U);
-    d = (d & 0x33333333U) + ((d >> 2) & 0x33333333U);
-    d = (d + (d >> 4)) & 0x0f0f0f0fU;
-    d = d + (d >> 8);
-    d = d + (d >> 16);
-    return d & 63;
+    unsigned e;
+    if (nsec < LAT_SUB)
+        return nsec;
+    e = 63 - __builtin_clzll(nsec);
+    return (e - 3) * LAT_SUB + ((nsec >> (e - 4)) & (LAT_SUB - 1));
 }
 
-#endif
+/* The middle of the range of values in bucket 'i'.  */
+static double
+lat_value(unsigned i)
+{
+    unsigned e = i / LAT_SUB + 3;
+    if (i < LAT_SUB)
+        return i;
+    return ((double)(LAT_SUB + i % LAT_SUB) + 0.5) * (1ULL << (e - 4));
+}
 
-static char keybuf[33];
+static void
+lat_add(struct latency *h, const struct mtree_query *qs, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        h->count[lat_bucket(qs[i].nsec)]++;
+    h->n += n;
+}
 
-static const char *
-keystr(bkey_t k)
+/* Latency at or below which a fraction 'p' of the queries finished,
+   in microseconds.  */
+static double
+lat_percentile(const struct latency *h, double p)
 {
+    uint64_t rank = (uint64_t)(p * h->n + 0.999999), seen = 0;
     unsigned i;
-    for (i = 0; i < 32; ++i) {
-        keybuf[31 - i] = '0' + (k & 1);
-        k >>= 1;
+    if (!rank)
+        rank = 1;
+    for (i = 0; i < LAT_BUCKETS; ++i) {
+        seen += h->count[i];
+        if (seen >= rank)
+            return lat_value(i) * 1e-3;
     }
-    keybuf[32] = '\0';
-    return keybuf;
+    return 0;
 }
 
-static const char *
-keystr2(bkey_t k, bkey_t ref)
+/* Peak resident set size in kB.  */
+static long
+peak_rss(void)
 {
-    unsigned i;
-    bkey_t d = ref ^ k;
-    for (i = 0; i < 32; ++i) {
-        keybuf[31 - i] = (d & 1) ? ('0' + (k & 1)) : '.';
-        d >>= 1;
-        k >>= 1;
-    }
-    keybuf[32] = '\0';
-    return keybuf;
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+    return ru.ru_maxrss;
 }
 
-static unsigned num_nodes = 0;
-static size_t tree_size = 0;
-
-struct buf {
-    bkey_t *keys;
-    size_t n, a;
+struct bench {
+    const char *name;
+    const struct mtree *t;
+    struct mtree_query *qs;
+    size_t nquery, nkeys;
+    unsigned long long maxlin;
+    double build;
+    /* The index's measured size, and the peak RSS once it was built */
+    size_t tree_size;
+    long build_rss;
+    struct mtree_batch *bo;
+    /* Queries to run untimed before each timed batch */
+    size_t warmup;
+    /* Machine readable results, one record per DIST argument */
+    FILE *out;
+    int csv;
+    /* Exact index for the recall of approximate queries */
+    const struct mtree *exact;
+    /* The index is cached */
+    int cache;
 };
 
+/* Run a batch which the checks in main() have allowed.  */
 static void
-addkey(struct buf *restrict b, bkey_t k)
+run_batch(const struct mtree *t, struct mtree_query *q, size_t n,
+          const struct mtree_batch *bo)
 {
-    size_t na;
-    bkey_t *np;
-    if (b->n >= b->a) {
-        na = b->a ? 2*b->a : 16;
-        np = xmalloc(sizeof(*np) * na);
-        memcpy(np, b->keys, sizeof(*np) * b->n);
-        free(b->keys);
-        b->keys = np;
-        b->a = na;
-    }
-    b->keys[b->n++] = k;
+    if (mtree_batch(t, q, n, bo))
+        err(1, "mtree_batch");
 }
 
-/* Linear search ==================== */
+/* One timed batch, for the report.  */
+struct run {
+    const char *query;
+    unsigned long arg;
+    double sec;
+    double hits;
+    double radius;
+    double coverage;
+    /* Percentage of the exact hits found, and of the queries which
+       ran out of budget */
+    double recall;
+    double partial;
+    /* Percentage of the queries answered by the cache */
+    double cached;
+};
+
+#if INSTRUMENT
 
-struct linear {
-    size_t count;
-    bkey_t *keys;
+/* Hardware counters for a batch, counted in user space for the main
+   thread and the workers it starts.  They need perf_event_paranoid
+   to allow it, and are reported as unavailable otherwise.  */
+static const struct {
+    const char *name;
+    uint64_t config;
+} perf_events[] = {
+    { "Cycles", PERF_COUNT_HW_CPU_CYCLES },
+    { "LLC misses", PERF_COUNT_HW_CACHE_MISSES },
+    { "Branch misses", PERF_COUNT_HW_BRANCH_MISSES },
 };
 
-static struct linear *
-mktree_linear(const bkey_t *restrict keys, size_t n, size_t max_linear)
+enum { PERF_EVENTS = sizeof(perf_events) / sizeof(perf_events[0]) };
+
+struct perf {
+    int fd[PERF_EVENTS];
+    uint64_t count[PERF_EVENTS];
+};
+
+static void
+perf_start(struct perf *p)
 {
-    struct linear* node;
-    (void)max_linear;
-    node = xmalloc(sizeof(*node));
-    node->count = n;
-    node->keys = xmalloc(sizeof(bkey_t) * n);
-    num_nodes += 1;
-    tree_size += sizeof(bkey_t) * n + sizeof(*node);
-    memcpy(node->keys, keys, sizeof(bkey_t) * n);
-    return node;
+    struct perf_event_attr attr;
+    unsigned i;
+    mtree_visits_reset();
+    for (i = 0; i < PERF_EVENTS; ++i) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    for (i = 0; i < PERF_EVENTS; ++i)
+        if (p->fd[i] >= 0)
+            ioctl(p->fd[i], PERF_EVENT_IOC_ENABLE, 0);
 }
 
-static size_t
-query_linear(struct buf *restrict b, struct linear *restrict root,
-             bkey_t ref, unsigned maxd)
+static void
+perf_stop(struct perf *p)
 {
-    size_t i;
-    const bkey_t *restrict p = root->keys;
-    for (i = 0; i < root->count; ++i)
-        if (distance(ref, p[i]) <= maxd)
-            addkey(b, p[i]);
-    return root->count;
+    unsigned i;
+    for (i = 0; i < PERF_EVENTS; ++i)
+        if (p->fd[i] >= 0)
+            ioctl(p->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERF_EVENTS; ++i) {
+        if (p->fd[i] < 0)
+            continue;
+        if (read(p->fd[i], &p->count[i], sizeof(p->count[i])) !=
+            sizeof(p->count[i])) {
+            close(p->fd[i]);
+            p->fd[i] = -1;
+        }
+    }
 }
 
-/* BK-tree ==================== */
-
-struct bktree {
-    unsigned short distance;
-    unsigned short linear;
-    union {
-        struct {
-            bkey_t key;
-            struct bktree *child;
-        } tree;
-        struct {
-            unsigned count;
-            bkey_t *keys;
-        } linear;
-    } data;
-    struct bktree *sibling;
-};
-
-static struct bktree *
-mktree_bk(const bkey_t *restrict keys, size_t n, size_t max_linear)
+/* Print the counters, and the node visits for radius queries run one
+   at a time.  */
+static void
+perf_report(struct perf *p, const struct bench *bn)
 {
-    size_t dcnt[MAX_DISTANCE + 1], i, a, pos[MAX_DISTANCE + 1], off, len;
-    bkey_t rootkey = keys[0], *tmp;
-    struct bktree *root, *child, *prev;
-    assert(n > 0);
-
-    num_nodes += 1;
-
-    /* Build root */
-    root = xmalloc(sizeof(*root));
-    tree_size += sizeof(*root);
-    root->distance = 0;
-    root->sibling = NULL;
-    if (n <= max_linear || n <= 1) {
-        root->linear = 1;
-        tmp = xmalloc(sizeof(*tmp) * n);
-        tree_size += sizeof(*tmp) * n;
-        memcpy(tmp, keys, sizeof(*tmp) * n);
-        root->data.linear.count = n;
-        root->data.linear.keys = tmp;
-        return root;
-    }
-    root->linear = 0;
-    root->data.tree.key = rootkey;
-    root->data.tree.child = NULL;
-
-    n -= 1;
-    keys += 1;
-    if (!n)
-        return root;
-
-    /* Sort keys by distance to root */
-    tmp = xmalloc(sizeof(*tmp) * n);
-    for (i = 0; i <= MAX_DISTANCE; ++i)
-        dcnt[i] = 0;
-    for (i = 0; i < n; ++i)
-        dcnt[distance(rootkey, keys[i])]++;
-    for (i = 0, a = 0; i <= MAX_DISTANCE; ++i)
-        dcnt[i] = (a += dcnt[i]);
-    assert(a == n);
-    memcpy(pos, dcnt, sizeof(pos));
-    for (i = 0; i < n; ++i)
-        tmp[--pos[distance(rootkey, keys[i])]] = keys[i];
-
-    /* Add child nodes */
-    for (i = 1, prev = NULL; i <= MAX_DISTANCE; ++i) {
-        off = dcnt[i-1];
-        len = dcnt[i] - off;
-        if (!len)
+    const struct mtree_query *qs = bn->qs;
+    size_t n = bn->nquery, i, nodes = 0, leaves = 0, scanned = 0;
+    size_t visits[MTREE_STAT_DEPTH];
+    for (i = 0; i < PERF_EVENTS; ++i) {
+        if (p->fd[i] < 0) {
+            printf("%s: unavailable\n", perf_events[i].name);
             continue;
-        child = mktree_bk(tmp + off, len, max_linear);
-        child->distance = i;
-        if (prev)
-            prev->sibling = child;
-        else
-            root->data.tree.child = child;
-        prev = child;
+        }
+        printf("%s/query: %f\n", perf_events[i].name,
+               p->count[i] / (double)n);
+        close(p->fd[i]);
+    }
+    if (bn->bo->knn || bn->bo->block)
+        return;
+    for (i = 0; i < n; ++i) {
+        nodes += qs[i].nodes;
+        leaves += qs[i].leaves;
+        scanned += qs[i].scanned;
     }
+    printf("Nodes/query: %f\n", nodes / (double)n);
+    printf("Leaves/query: %f\n", leaves / (double)n);
+    printf("Leaf keys/query: %f\n", scanned / (double)n);
+    mtree_visits(visits);
+    puts("Visits by depth:");
+    for (i = 0; i < MTREE_STAT_DEPTH; ++i)
+        if (visits[i])
+            printf("  %3zu%s %f\n", i, i == MTREE_STAT_DEPTH - 1 ? "+" : ":",
+                   visits[i] / (double)n);
+}
+
+#else
+
+struct perf {
+    char unused;
+};
 
-    free(tmp);
-    return root;
+static inline void
+perf_start(struct perf *p)
+{
+    (void)p;
 }
 
+static inline void
+perf_stop(struct perf *p)
+{
+    (void)p;
+}
 
-static size_t
-query_bk(struct buf *restrict b, struct bktree *restrict root,
-         bkey_t ref, unsigned maxd)
+static inline void
+perf_report(struct perf *p, const struct bench *bn)
 {
-    /* We are trying to find x that satisfy d(ref,x) <= maxd
-       By triangle inequality, we know: d(root,x) <= d(root,ref) + d(ref,x)
-       By algebra: d(root,x) - d(root,ref) <= d(ref,x)
-       By transitivity: d(root,x) - d(root,ref) <= maxd
-       By algebra: d(root,x) <= maxd + d(root,ref) */
-    if (root->linear) {
-        const bkey_t *restrict keys = root->data.linear.keys;
-        unsigned i, n = root->data.linear.count;
-        for (i = 0; i < n; ++i)
-            if (distance(ref, keys[i]) <= maxd)
-                addkey(b, keys[i]);
-        return n;
-    } else {
-        unsigned d = distance(root->data.tree.key, ref);
-        struct bktree *p = root->data.tree.child;
-        size_t nc = 1;
-        if (d <= maxd)
-            addkey(b, root->data.tree.key);
-        for (; p && p->distance + maxd < d; p = p->sibling);
-        for (; p && p->distance <= maxd + d; p = p->sibling)
-            nc += query_bk(b, p, ref, maxd);
-        return nc;
-    }
+    (void)p;
+    (void)bn;
 }
 
-/* VP-tree ==================== */
-
-struct vptree {
-    unsigned short linear;
-    union {
-        struct {
-            /* Closed ball (d = threshold is included) */
-            unsigned short threshold;
-            bkey_t vantage;
-            struct vptree *near;
-            struct vptree *far;
-        } tree;
-        struct {
-            unsigned count;
-            bkey_t *keys;
-        } linear;
-    } data;
-};
+#endif
 
-static struct vptree *
-mktree_vp(const bkey_t *restrict keys, size_t n, size_t max_linear)
+static void
+warmup(struct bench *bn)
 {
-    size_t dcnt[MAX_DISTANCE + 1], i, a;
-    bkey_t rootkey = keys[0], *tmp;
-    struct vptree *root;
-    unsigned k;
-    size_t median, nnear, nfar, inear, ifar;
-    assert(n > 0);
-
-    num_nodes += 1;
-
-    /* Build root */
-    root = xmalloc(sizeof(*root));
-    tree_size += sizeof(root);
-    if (n <= max_linear || n <= 1) {
-        root->linear = 1;
-        tmp = xmalloc(sizeof(*tmp) * n);
-        tree_size += sizeof(*tmp) * n;
-        memcpy(tmp, keys, sizeof(*tmp) * n);
-        root->data.linear.count = n;
-        root->data.linear.keys = tmp;
-        return root;
-    }
-    root->linear = 0;
-    root->data.tree.threshold = 0;
-    root->data.tree.vantage = rootkey;
-    root->data.tree.near = NULL;
-    root->data.tree.far = NULL;
-
-    n -= 1;
-    keys += 1;
+    struct mtree_batch wbo = *bn->bo;
+    uint32_t checksum = 0;
+    size_t n = bn->warmup < bn->nquery ? bn->warmup : bn->nquery;
     if (!n)
-        return root;
+        return;
+    wbo.emit = NULL;
+    wbo.latency = 0;
+    wbo.visit_arg = &checksum;
+    run_batch(bn->t, bn->qs, n, &wbo);
+}
 
-    /* Count keys inside the given ball */
-    for (i = 0; i <= MAX_DISTANCE; ++i)
-        dcnt[i] = 0;
-    for (i = 0; i < n; ++i)
-        dcnt[distance(rootkey, keys[i])]++;
-    for (i = 0, a = 0; i <= MAX_DISTANCE; ++i)
-        dcnt[i] = (a += dcnt[i]);
-    assert(a == n);
-    median = dcnt[0] + (n - dcnt[0]) / 2;
-    for (k = 1; k <= MAX_DISTANCE; ++k)
-        if (dcnt[k] > median)
-            break;
-    if (k != 1 && median - dcnt[k-1] <= dcnt[k] - median)
-        k--;
-    nnear = dcnt[k] - dcnt[0];
-    nfar = n - dcnt[k];
-    // printf("keys: %zu; near: %zu; far: %zu; k=%u\n", n, nnear, nfar, k);
-
-    /* Sort keys into near and far sets */
-    tmp = xmalloc(sizeof(*tmp) * (nnear + nfar));
-    inear = 0;
-    ifar = nnear;
-    for (i = 0; i < n; ++i) {
-        if (keys[i] == rootkey)
-            continue;
-        if (distance(rootkey, keys[i]) <= k)
-            tmp[inear++] = keys[i];
-        else
-            tmp[ifar++] = keys[i];
+static void
+report(struct bench *bn, const struct run *r)
+{
+    static const double pct[] = { 0.5, 0.9, 0.99, 0.999 };
+    struct latency *h = NULL;
+    double p[4] = { 0 };
+    unsigned i;
+    if (bn->bo->latency) {
+        h = xmalloc(sizeof(*h));
+        memset(h, 0, sizeof(*h));
+        lat_add(h, bn->qs, bn->nquery);
+        for (i = 0; i < 4; ++i)
+            p[i] = lat_percentile(h, pct[i]);
+        free(h);
+        printf("Latency: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f usec\n",
+               p[0], p[1], p[2], p[3]);
+    }
+    if (!bn->out)
+        return;
+    if (bn->csv) {
+        if (!ftell(bn->out))
+            fputs("type,key_bits,scan,keys,queries,threads,block,maxlin,"
+                  "query,arg,build_sec,tree_size,rss_kb,build_rss_kb,"
+                  "rate,mean_usec,p50_usec,p90_usec,p99_usec,p999_usec,"
+                  "hits,radius,coverage_pct,budget,recall_pct,partial_pct\n",
+                  bn->out);
+        fprintf(bn->out,
+                "%s,%d,%s,%zu,%zu,%u,%u,%llu,%s,%lu,%.6f,%zu,%ld,%ld,%.3f,"
+                "%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.6f,%zu,%.3f,%.3f\n",
+                bn->name, KEY_BITS, mtree_scan_name(), bn->nkeys, bn->nquery,
+                bn->bo->nthreads, bn->bo->block, bn->maxlin, r->query,
+                r->arg, bn->build, bn->tree_size, peak_rss(), bn->build_rss,
+                bn->nquery / r->sec, 1e6 * r->sec / bn->nquery,
+                p[0], p[1], p[2], p[3], r->hits, r->radius, r->coverage,
+                bn->bo->budget, r->recall, r->partial);
+    } else {
+        fprintf(bn->out,
+                "{\"type\": \"%s\", \"key_bits\": %d, \"scan\": \"%s\", "
+                "\"keys\": %zu, \"queries\": %zu, \"threads\": %u, "
+                "\"block\": %u, \"maxlin\": %llu, \"query\": \"%s\", "
+                "\"arg\": %lu, \"build_sec\": %.6f, \"tree_size\": %zu, "
+                "\"rss_kb\": %ld, \"build_rss_kb\": %ld, \"rate\": %.3f, "
+                "\"mean_usec\": %.3f",
+                bn->name, KEY_BITS, mtree_scan_name(), bn->nkeys, bn->nquery,
+                bn->bo->nthreads, bn->bo->block, bn->maxlin, r->query,
+                r->arg, bn->build, bn->tree_size, peak_rss(), bn->build_rss,
+                bn->nquery / r->sec, 1e6 * r->sec / bn->nquery);
+        if (h)
+            fprintf(bn->out,
+                    ", \"p50_usec\": %.3f, \"p90_usec\": %.3f, "
+                    "\"p99_usec\": %.3f, \"p999_usec\": %.3f",
+                    p[0], p[1], p[2], p[3]);
+        if (bn->bo->budget)
+            fprintf(bn->out,
+                    ", \"budget\": %zu, \"recall_pct\": %.3f, "
+                    "\"partial_pct\": %.3f",
+                    bn->bo->budget, r->recall, r->partial);
+        if (bn->cache)
+            fprintf(bn->out, ", \"cached_pct\": %.3f", r->cached);
+        fprintf(bn->out,
+                ", \"hits\": %.3f, \"radius\": %.3f, "
+                "\"coverage_pct\": %.6f}\n",
+                r->hits, r->radius, r->coverage);
     }
-    assert(inear == nnear);
-    assert(ifar == nnear + nfar);
+    fflush(bn->out);
+}
 
-    root->data.tree.threshold = k;
-    if (nnear)
-        root->data.tree.near = mktree_vp(tmp, nnear, max_linear);
-    if (nfar)
-        root->data.tree.far = mktree_vp(tmp + nnear, nfar, max_linear);
+/* Percentage of the hits of the approximate queries in bn->qs that
+   the exact index finds, which are all it can have found.  Also sets
+   the percentage of queries which ran out of budget.  */
+static double
+recall(struct bench *bn, double *partial)
+{
+    unsigned long long total = 0, exact = 0, npartial = 0;
+    struct mtree_batch ebo = *bn->bo;
+    struct mtree_query *eq;
+    size_t i, nquery = bn->nquery;
+    ebo.budget = 0;
+    ebo.sink = MTREE_SINK_COUNT;
+    ebo.emit = NULL;
+    ebo.latency = 0;
+    eq = xmalloc(sizeof(*eq) * nquery);
+    for (i = 0; i < nquery; ++i) {
+        eq[i].key = bn->qs[i].key;
+        eq[i].maxd = bn->qs[i].maxd;
+    }
+    run_batch(bn->exact, eq, nquery, &ebo);
+    for (i = 0; i < nquery; ++i) {
+        total += bn->qs[i].hits;
+        exact += eq[i].hits;
+        npartial += bn->qs[i].partial;
+    }
+    free(eq);
+    *partial = 100.0 * npartial / nquery;
+    return exact ? 100.0 * total / exact : 100.0;
+}
 
-    free(tmp);
-    return root;
+static void
+bench_radius(struct bench *bn, unsigned long dist)
+{
+    unsigned long long total = 0, totalcmp = 0, noverflow = 0;
+    struct mtree_batch *bo = bn->bo;
+    struct mtree_query *qs = bn->qs;
+    size_t i, nquery = bn->nquery;
+    uint32_t checksum = 0;
+    struct mtree_cache_stats cs0, cs;
+    struct perf perf;
+    struct run r;
+    double t0;
+    if (dist >= MTREE_MAX_DISTANCE || dist <= 0) {
+        fprintf(stderr, "Distance should be in the range 1..%d\n",
+                MTREE_MAX_DISTANCE);
+        exit(1);
+    }
+    printf("Distance: %lu\n", dist);
+    for (i = 0; i < nquery; ++i) {
+        qs[i].key = query_key(i);
+        qs[i].maxd = dist;
+    }
+    if (bo->sink == MTREE_SINK_GROW)
+        bo->reserve = mtree_estimate(bn->nkeys, dist);
+    bo->knn = 0;
+    bo->emit = DO_PRINT ? print_query : NULL;
+    bo->visit = visit_xor;
+    bo->visit_arg = &checksum;
+    warmup(bn);
+    if (bn->cache)
+        mtree_cache_stats(bn->t, &cs0);
+    perf_start(&perf);
+    t0 = wallclock();
+    run_batch(bn->t, qs, nquery, bo);
+    r.sec = wallclock() - t0;
+    perf_stop(&perf);
+    for (i = 0; i < nquery; ++i) {
+        total += qs[i].hits;
+        totalcmp += qs[i].cmp;
+        noverflow += qs[i].overflow;
+    }
+    r.query = mtree_kind_name(bo->kind);
+    r.arg = dist;
+    r.hits = total / (double)nquery;
+    r.radius = dist;
+    r.coverage = 100.0 * (double)totalcmp / ((double)bn->nkeys * nquery);
+    printf("Rate: %f query/sec\n", nquery / r.sec);
+    printf("Time: %f msec/query\n", 1000.0 * r.sec / nquery);
+    printf("Hits: %f\n", r.hits);
+    printf("Coverage: %f%%\n", r.coverage);
+    printf("Cmp/result: %f\n", (double)totalcmp / (double)total);
+    if (bo->sink == MTREE_SINK_FIXED)
+        printf("Overflow: %llu queries\n", noverflow);
+    if (bo->sink == MTREE_SINK_VISIT)
+        printf("Checksum: %08x\n", (unsigned) checksum);
+    r.recall = 100.0;
+    r.partial = 0;
+    if (bo->budget) {
+        r.recall = recall(bn, &r.partial);
+        printf("Recall: %f%%\n", r.recall);
+        printf("Partial: %f%% of queries\n", r.partial);
+    }
+    r.cached = 0;
+    if (bn->cache) {
+        mtree_cache_stats(bn->t, &cs);
+        cs.hits -= cs0.hits;
+        cs.filtered -= cs0.filtered;
+        cs.misses -= cs0.misses;
+        r.cached = 100.0 * (cs.hits + cs.filtered) / nquery;
+        printf("Cache: %llu hits, %llu filtered, %llu misses\n",
+               cs.hits, cs.filtered, cs.misses);
+        printf("Cache size: %zu bytes in %zu entries\n",
+               cs.bytes, cs.entries);
+    }
+    perf_report(&perf, bn);
+    report(bn, &r);
 }
 
-static size_t
-query_vp(struct buf *restrict b, struct vptree *restrict root,
-         bkey_t ref, unsigned maxd)
+/* Run kNN queries, and compare against finding the k nearest keys by
+   repeating the radius query with a growing radius until it has at
+   least k hits.  */
+static void
+bench_knn(struct bench *bn, unsigned long k)
 {
-    /* We are trying to find x that satisfy d(ref,x) <= maxd
-       By triangle inequality, we know: d(root,x) <= d(root,ref) + d(ref,x)
-       By algebra: d(root,x) - d(root,ref) <= d(ref,x)
-       By transitivity: d(root,x) - d(root,ref) <= maxd
-       By algebra: d(root,x) <= maxd + d(root,ref) */
-    if (root->linear) {
-        const bkey_t *restrict keys = root->data.linear.keys;
-        unsigned i, n = root->data.linear.count;
+    unsigned long long totalcmp = 0, totald = 0;
+    struct mtree_batch *bo = bn->bo, rbo;
+    struct mtree_query *qs = bn->qs, *rq;
+    size_t i, n, nquery = bn->nquery, nkeys = bn->nkeys;
+    struct perf perf;
+    struct run rn;
+    double t0, tm;
+    unsigned r;
+    if (!k || k > nkeys) {
+        fprintf(stderr, "K should be in the range 1..%zu\n", nkeys);
+        exit(1);
+    }
+    printf("K: %lu\n", k);
+    for (i = 0; i < nquery; ++i) {
+        qs[i].key = query_key(i);
+        qs[i].maxd = k;
+    }
+    bo->knn = 1;
+    bo->emit = DO_PRINT ? print_query : NULL;
+    warmup(bn);
+    perf_start(&perf);
+    t0 = wallclock();
+    run_batch(bn->t, qs, nquery, bo);
+    rn.sec = wallclock() - t0;
+    perf_stop(&perf);
+    for (i = 0; i < nquery; ++i) {
+        totalcmp += qs[i].cmp;
+        totald += qs[i].kdist;
+    }
+    rn.query = "knn";
+    rn.arg = k;
+    rn.hits = k;
+    rn.radius = totald / (double)nquery;
+    rn.coverage = 100.0 * (double)totalcmp / ((double)nkeys * nquery);
+    rn.recall = 100.0;
+    rn.partial = 0;
+    printf("Rate: %f query/sec\n", nquery / rn.sec);
+    printf("Time: %f msec/query\n", 1000.0 * rn.sec / nquery);
+    printf("Radius: %f\n", rn.radius);
+    printf("Coverage: %f%%\n", rn.coverage);
+    perf_report(&perf, bn);
+    report(bn, &rn);
+
+    /* Radius loop, over the queries which don't have k hits yet */
+    rbo = *bo;
+    rbo.knn = 0;
+    rbo.sink = MTREE_SINK_COUNT;
+    rbo.emit = NULL;
+    rbo.latency = 0;
+    rq = xmalloc(sizeof(*rq) * nquery);
+    for (i = 0; i < nquery; ++i)
+        rq[i].key = qs[i].key;
+    totalcmp = 0;
+    n = nquery;
+    t0 = wallclock();
+    for (r = 0; n && r <= MTREE_MAX_DISTANCE; ++r) {
         for (i = 0; i < n; ++i)
-            if (distance(ref, keys[i]) <= maxd)
-                addkey(b, keys[i]);
-        return n;
-    } else {
-        unsigned d = distance(root->data.tree.vantage, ref);
-        unsigned thr = root->data.tree.threshold;
-        size_t nc = 1;
-        if (d <= maxd + thr) {
-            if (root->data.tree.near)
-                nc += query_vp(b, root->data.tree.near, ref, maxd);
-            if (d <= maxd)
-                addkey(b, root->data.tree.vantage);
+            rq[i].maxd = r;
+        run_batch(bn->t, rq, n, &rbo);
+        for (i = 0; i < n; ) {
+            totalcmp += rq[i].cmp;
+            if (rq[i].hits >= k)
+                rq[i] = rq[--n];
+            else
+                i++;
         }
-        if (d + maxd > thr && root->data.tree.far)
-            nc += query_vp(b, root->data.tree.far, ref, maxd);
-        return nc;
     }
+    tm = wallclock() - t0;
+    free(rq);
+    printf("Radius loop rate: %f query/sec\n", nquery / tm);
+    printf("Radius loop coverage: %f%%\n",
+           100.0 * (double)totalcmp / ((double)nkeys * nquery));
+}
+
+/* Measure an index and print what it is made of.  The tree's size
+   with packed leaves is also given without the keys they pack, and
+   without their packing, as the total counts both.  Returns the
+   total.  */
+static size_t
+report_stats(const struct mtree *t, int packed)
+{
+    struct mtree_stats st;
+    size_t size;
+    unsigned i;
+    if (mtree_measure(t, &st))
+        return 0;
+    size = st.node_bytes + st.key_bytes + st.slack;
+    printf("Nodes: %zu\n", st.nodes);
+    printf("Leaves: %zu\n", st.leaves);
+    printf("Tree size: %zu\n", size);
+    printf("Memory: %zu in nodes, %zu in keys, %zu slack\n",
+           st.node_bytes, st.key_bytes, st.slack);
+    if (st.max_linear && st.leaves) {
+        fputs("Leaf fill:", stdout);
+        for (i = 0; i < MTREE_STATS_FILL; ++i)
+            if (st.fill[i] && i == MTREE_STATS_FILL - 1)
+                printf(" over:%zu", st.fill[i]);
+            else if (st.fill[i])
+                printf(" %u-%u%%:%zu", 10 * i, 10 * i + 10, st.fill[i]);
+        putchar('\n');
+    }
+    if (st.leaves) {
+        fputs("Leaf depth:", stdout);
+        for (i = 0; i < MTREE_STATS_DEPTH; ++i)
+            if (st.depth[i])
+                printf(" %u%s:%zu", i, i == MTREE_STATS_DEPTH - 1 ? "+" : "",
+                       st.depth[i]);
+        putchar('\n');
+    }
+    if (packed) {
+        printf("Packed keys: %f%%\n",
+               st.keys ? 100.0 * st.packed_keys / st.keys : 0.0);
+        printf("Packed size: %zu\n",
+               size - sizeof(mtree_key_t) * st.packed_keys);
+        printf("Unpacked size: %zu\n", size - st.packed_bytes);
+    }
+    return size;
+}
+
+/* Whether the capabilities allow a kind of query */
+static int
+can_kind(int caps, unsigned kind)
+{
+    return kind == MTREE_COUNT ? caps & MTREE_CAN_COUNT
+        : kind == MTREE_EXISTS ? caps & MTREE_CAN_EXISTS : 1;
 }
 
-/* Main ==================== */
+static void
+usage(void)
+{
+    fputs("Usage: [OPTIONS] TYPE MAXLIN NKEYS NQUERY DIST...\n"
+          "   or: -i FILE [OPTIONS] NQUERY DIST...\n"
+          "   or: -c ADDR [OPTIONS] NQUERY DIST...\n"
+          "   or: -s ADDR [OPTIONS] TYPE MAXLIN NKEYS [DIST...]\n"
+          "   or: -s ADDR -i FILE [OPTIONS]\n"
+          "Options:\n"
+          "  -j THREADS   threads for building and queries\n"
+          "  -B BLOCK     push queries down the tree in blocks\n"
+          "  -r SINK      result buffer: count, grow, fixed:N, or visit\n"
+          "  -k           DIST arguments are k for kNN queries\n"
+          "  -o FILE      save the index to a file\n"
+          "  -i FILE      load the index from a file\n"
+          "  -f FILE      read keys from a file, NKEYS 0 reads all\n"
+          "  -q FILE      read queries from a file, NQUERY 0 runs each once\n"
+          "  -u N         make N changes to the keys before the queries\n"
+          "  -V N         choose each vantage point from N samples\n"
+          "  -S           sort VP-tree leaves to skip keys out of range\n"
+          "  -T           keep leaf keys bit-sliced as well, for large DIST\n"
+          "  -P           keep VP-tree leaf keys packed as well, if they share bits\n"
+          "               (keys of at most 64 bits, wider ones aren't packed)\n"
+          "  -w N         run N queries untimed before each benchmark\n"
+          "  -L           measure the latency of each query\n"
+          "  -O FILE      append results to [json:|csv:]FILE, implies -L\n"
+          "  -a BUDGET    approximate queries, comparing at most BUDGET keys\n"
+          "  -K SHARDS    split the keys between SHARDS indexes of TYPE\n"
+          "  -C           only count the hits of each query\n"
+          "  -E           only find whether each query has any hits\n"
+          "  -s ADDR      serve queries on unix:PATH or [HOST:]PORT\n"
+          "  -b BATCH     serve up to BATCH queries at a time\n"
+          "  -d USEC      wait up to USEC for a batch to fill\n"
+          "  -c ADDR      run the queries on a server\n"
+          "  -R MB        cache query results in MB megabytes\n"
+          "Key files are [bin:|hex:]PATH, where PATH can be - for stdin.\n",
+          stderr);
+    exit(1);
+}
 
-typedef void *(*mktree_t)(bkey_t *, size_t, size_t);
-typedef size_t (*query_t)(struct buf *, void *, bkey_t, unsigned);
 
 int main(int argc, char *argv[])
 {
-    double tm, qc;
-    clock_t ckref, t;
-    struct buf q = { 0, 0, 0 };
-    unsigned long nkeys, nquery, dist, i, j, k;
-    void *root;
-    bkey_t ref, *keys;
-    unsigned long long total, totalcmp, maxlin;
-    size_t nc;
-    char *type;
-    mktree_t mktree;
-    query_t query;
-
-    if (argc < 5) {
-        fputs("Usage: TYPE MAXLIN NKEYS NQUERY DIST...\n", stderr);
-        return 1;
-    }
-    type = argv[1];
-    if (!strcasecmp(type, "bk")) {
-        puts("Type: BK-tree");
-        mktree = (mktree_t) mktree_bk;
-        query = (query_t) query_bk;
-    } else if (!strcasecmp(type, "vp")) {
-        puts("Type: VP-tree");
-        mktree = (mktree_t) mktree_vp;
-        query = (query_t) query_vp;
-    } else if (!strcasecmp(type, "linear")) {
-        puts("Type: Linear search");
-        mktree = (mktree_t) mktree_linear;
-        query = (query_t) query_linear;
-    } else {
-        puts("Unknown type");
-        return 1;
+    static unsigned char radii[MTREE_MAX_DISTANCE + 1];
+    double t0, t1 = 0;
+    unsigned long nkeys, nquery, i, k;
+    struct mtree *t = NULL, *exact = NULL;
+    mtree_key_t *keys = NULL, *copy;
+    unsigned long long maxlin = 0;
+    struct mtree_opts opts;
+    struct mtree_batch bo;
+    struct mtree_query *qs;
+    struct mtree_server *srv;
+    const char *name, *desc;
+    const char *infile = NULL, *outfile = NULL;
+    const char *keyfile = NULL, *queryfile = NULL;
+    unsigned long nupdate = 0;
+    unsigned long cache_mb = 0;
+    unsigned batch = 64;
+    unsigned long deadline = 200;
+    mtree_key_t *del = NULL;
+    const char *resfile = NULL;
+    const char *serve_addr = NULL, *remote_addr = NULL;
+    struct bench bn;
+    size_t isize;
+    long ncpu;
+    int opt, knn = 0, caps, sub;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&bo, 0, sizeof(bo));
+    memset(&bn, 0, sizeof(bn));
+    bo.nthreads = 1;
+    bo.sink = DO_PRINT ? MTREE_SINK_GROW : MTREE_SINK_COUNT;
+    while ((opt = getopt(argc, argv, "a:b:c:d:f:i:j:ko:q:s:u:w:B:CEK:LO:PR:r:STV:")) != -1) {
+        switch (opt) {
+        case 'a':
+            bo.budget = xatoul(optarg);
+            break;
+        case 'b':
+            batch = xatoul(optarg);
+            if (!batch)
+                errx(1, "batch should be at least 1");
+            break;
+        case 'c':
+            remote_addr = optarg;
+            break;
+        case 'd':
+            deadline = xatoul(optarg);
+            break;
+        case 's':
+            serve_addr = optarg;
+            break;
+        case 'w':
+            bn.warmup = xatoul(optarg);
+            break;
+        case 'C':
+            bo.kind = MTREE_COUNT;
+            break;
+        case 'E':
+            bo.kind = MTREE_EXISTS;
+            break;
+        case 'K':
+            opts.shards = xatoul(optarg);
+            if (!opts.shards || opts.shards > MTREE_SHARD_MAX)
+                errx(1, "shards should be from 1 to %d", MTREE_SHARD_MAX);
+            break;
+        case 'L':
+            bo.latency = 1;
+            break;
+        case 'O':
+            resfile = optarg;
+            bo.latency = 1;
+            break;
+        case 'P':
+            opts.pack_leaves = 1;
+            break;
+        case 'R':
+            cache_mb = xatoul(optarg);
+            if (!cache_mb)
+                errx(1, "the cache needs at least 1 MB");
+            break;
+        case 'S':
+            opts.sort_leaves = 1;
+            break;
+        case 'T':
+            opts.slice_leaves = 1;
+            break;
+        case 'V':
+            opts.vantage_samples = xatoul(optarg);
+            break;
+        case 'u':
+            nupdate = xatoul(optarg);
+            break;
+        case 'f':
+            keyfile = optarg;
+            break;
+        case 'q':
+            queryfile = optarg;
+            break;
+        case 'i':
+            infile = optarg;
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'k':
+            knn = 1;
+            break;
+        case 'B':
+            bo.block = xatoul(optarg);
+            if (bo.block > MTREE_BLOCK_MAX)
+                errx(1, "block size should be at most %d", MTREE_BLOCK_MAX);
+            break;
+        case 'j':
+            bo.nthreads = xatoul(optarg);
+            if (!bo.nthreads) {
+                ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                bo.nthreads = ncpu > 0 ? ncpu : 1;
+            }
+            break;
+        case 'r':
+            if (!strcmp(optarg, "count")) {
+                bo.sink = MTREE_SINK_COUNT;
+            } else if (!strcmp(optarg, "grow")) {
+                bo.sink = MTREE_SINK_GROW;
+            } else if (!strcmp(optarg, "visit")) {
+                bo.sink = MTREE_SINK_VISIT;
+            } else if (!strncmp(optarg, "fixed:", 6)) {
+                bo.sink = MTREE_SINK_FIXED;
+                bo.reserve = xatoul(optarg + 6);
+            } else {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
     }
-    maxlin = xatoul(argv[2]);
-    nkeys = xatoul(argv[3]);
-    nquery = xatoul(argv[4]);
-    if (!nkeys) {
-        fputs("Need at least one key\n", stderr);
-        return 1;
+    argc -= optind;
+    argv += optind;
+    if (infile || remote_addr) {
+        /* The index file takes the place of TYPE MAXLIN NKEYS */
+        argc += 3;
+        argv -= 3;
     }
+    if (argc < (serve_addr ? 3 : 4) || (infile && keyfile) ||
+        (remote_addr && (infile || keyfile || serve_addr)))
+        usage();
     seedrand();
+    if (resfile) {
+        if (!strncmp(resfile, "csv:", 4)) {
+            bn.csv = 1;
+            resfile += 4;
+        } else if (!strncmp(resfile, "json:", 5)) {
+            resfile += 5;
+        }
+        bn.out = fopen(resfile, "a");
+        if (!bn.out)
+            err(1, "%s", resfile);
+    }
+    opts.threads = bo.nthreads;
+    opts.radii = radii;
+    opts.log = stdout;
+
+    if (remote_addr) {
+        t = mtree_connect(remote_addr);
+        if (!t)
+            err(1, "%s", remote_addr);
+        nkeys = mtree_nkeys(t);
+        printf("Type: %s\n", mtree_desc(t));
+    } else if (infile) {
+        t1 = wallclock();
+        t = mtree_load(infile, &opts);
+        if (!t)
+            err(1, "%s", infile);
+        t1 = wallclock() - t1;
+        nkeys = mtree_nkeys(t);
+        printf("Type: %s\n", mtree_desc(t));
+    } else {
+        desc = mtree_type_desc(argv[0]);
+        if (!desc) {
+            puts("Unknown type");
+            return 1;
+        }
+        printf("Type: %s\n", desc);
+        maxlin = xatoul(argv[1]);
+        nkeys = xatoul(argv[2]);
+        if (keyfile) {
+            t1 = wallclock();
+            keys = mtree_keys_read(keyfile, nkeys, &isize);
+            if (!keys)
+                err(1, "%s", keyfile);
+            t1 = wallclock() - t1;
+            nkeys = isize;
+        }
+        if (!nkeys) {
+            fputs("Need at least one key\n", stderr);
+            return 1;
+        }
+    }
+    name = t ? mtree_name(t) : argv[0];
+    if (opts.shards) {
+        /* Each shard is a TYPE, the checks below are for the whole */
+        if (t)
+            errx(1, "a loaded index can't be sharded");
+        k = opts.shards;
+        opts.shards = 0;
+        sub = mtree_type_caps(name, &opts);
+        opts.shards = k;
+        if (knn && !(sub & MTREE_CAN_KNN))
+            errx(1, "%s does not support kNN queries", name);
+        if (!can_kind(sub, bo.kind))
+            errx(1, "%s does not support %s queries", name,
+                 mtree_kind_name(bo.kind));
+    }
+    caps = t ? mtree_caps(t) : mtree_type_caps(name, &opts);
+    if (caps < 0)
+        errx(1, "%s can't be sharded", name);
+    if (opts.shards)
+        name = "sharded";
+    if (knn && !(caps & MTREE_CAN_KNN))
+        errx(1, "%s does not support kNN queries", name);
+    if (bo.block && !(caps & MTREE_CAN_BLOCK))
+        errx(1, "%s does not support blocked queries", name);
+    if (nupdate && !(caps & MTREE_CAN_CHANGE))
+        errx(1, "%s does not support changes", name);
+    if (outfile && !(caps & MTREE_CAN_SAVE))
+        errx(1, "%s can't be saved", name);
+    if (bo.budget && !(caps & MTREE_CAN_APPROX))
+        errx(1, "%s does not support approximate queries", name);
+    if (bo.budget && (knn || bo.block))
+        errx(1, "approximate queries can't be kNN or blocked");
+    if (!can_kind(caps, bo.kind))
+        errx(1, "%s does not support %s queries", name,
+             mtree_kind_name(bo.kind));
+    if (bo.kind && (knn || bo.block || bo.budget))
+        errx(1, "%s queries can't be kNN, blocked or approximate",
+             mtree_kind_name(bo.kind));
+    if (cache_mb && (bo.block || bo.budget))
+        errx(1, "cached queries can't be blocked or approximate");
+    if (bo.kind)
+        bo.sink = MTREE_SINK_COUNT;
+    nquery = serve_addr ? 1 : xatoul(argv[3]);
+    if (queryfile) {
+        queries = mtree_keys_read(queryfile, 0, &nqueries);
+        if (!queries)
+            err(1, "%s", queryfile);
+        if (!nqueries)
+            errx(1, "%s: no queries", queryfile);
+        if (!nquery)
+            nquery = nqueries;
+        opts.queries = queries;
+        opts.nqueries = nqueries;
+    }
+    /* Building an index to save, say, needs no queries */
+    if (!nquery && argc > 4)
+        usage();
+    printf("Key bits: %d\n", KEY_BITS);
+    printf("Scan: %s\n", mtree_scan_name());
     printf("Keys: %lu\n", nkeys);
-    printf("Queries: %lu\n", nquery);
+    if (!serve_addr)
+        printf("Queries: %lu\n", nquery);
+    printf("Threads: %u\n", bo.nthreads);
+    if (opts.vantage_samples)
+        printf("Vantage samples: %u\n", opts.vantage_samples);
+    if (opts.sort_leaves)
+        puts("Sorted leaves: yes");
+    if (opts.slice_leaves)
+        puts("Sliced leaves: yes");
+    if (opts.pack_leaves)
+        puts(KEY_BITS > 64 ? "Packed leaves: no, keys are over 64 bits"
+             : "Packed leaves: yes");
+    if (bo.block)
+        printf("Block: %u\n", bo.block);
+    if (bo.budget)
+        printf("Budget: %zu\n", bo.budget);
+    if (opts.shards)
+        printf("Shards: %u\n", opts.shards);
+    if (bo.kind)
+        printf("Query kind: %s\n", mtree_kind_name(bo.kind));
+    if (serve_addr)
+        printf("Batch: %u requests or %lu usec\n", batch, deadline);
+    if (cache_mb)
+        printf("Cache: %lu MB\n", cache_mb);
     putchar('\n');
 
-    puts("Generating keys...");
-    keys = malloc(sizeof(*keys) * nkeys);
-    for (i = 0; i < nkeys; ++i)
-        keys[i] = irand();
-
-    puts("Building tree...");
-    ckref = clock();
-    root = mktree(keys, nkeys, maxlin);
-    free(keys);
-    t = clock();
-    printf("Time: %.3f sec\n",
-           (double)(t - ckref) / CLOCKS_PER_SEC);
-    printf("Nodes: %u\n", num_nodes);
-    printf("Tree size: %zu\n", tree_size);
-
-    for (k = 5; k < (unsigned) argc; ++k) {
-        total = 0;
-        totalcmp = 0;
-        ckref = clock();
-        dist = xatoul(argv[k]);
-        if (dist >= MAX_DISTANCE || dist <= 0) {
-            fprintf(stderr, "Distance should be in the range 1..%d\n",
-                    MAX_DISTANCE);
-            return 1;
+    if (remote_addr) {
+        printf("Server: %s\n", remote_addr);
+    } else if (infile) {
+        printf("Loading %s...\n", infile);
+        printf("Time: %.3f sec\n", t1);
+        bn.build = t1;
+        bn.tree_size = report_stats(t, opts.pack_leaves);
+    } else {
+        if (keyfile) {
+            printf("Reading %s...\n", keyfile);
+            printf("Time: %.3f sec\n", t1);
+        } else {
+            puts("Generating keys...");
+            keys = xmalloc(sizeof(*keys) * nkeys);
+            for (i = 0; i < nkeys; ++i)
+                keys[i] = mtree_rng_key(&rng);
         }
-        putchar('\n');
-        printf("Distance: %lu\n", dist);
-        for (i = 0; i < nquery; ++i) {
-            ref = irand();
-            q.n = 0;
-            nc = query(&q, root, ref, dist);
-            totalcmp += nc;
-            total += q.n;
-            if (DO_PRINT) {
-                printf("Query: %s\n", keystr(ref));
-                for (j = 0; j < q.n; ++j)
-                    printf("       %s\n", keystr2(q.keys[j], ref));
-            }
+
+        if (nupdate) {
+            /* Keys to remove, since the tree will reorder them */
+            del = xmalloc(sizeof(*del) * ((nupdate + 1) / 2));
+            for (i = 0; i < (nupdate + 1) / 2; ++i)
+                del[i] = keys[mtree_rng_next(&rng) % nkeys];
+        }
+
+        if (bo.budget && !nupdate) {
+            /* A linear search over a copy of the keys gives the exact
+               hits, to measure recall against */
+            copy = xmalloc(sizeof(*keys) * nkeys);
+            memcpy(copy, keys, sizeof(*keys) * nkeys);
+            exact = mtree_build("linear", copy, nkeys, 0, NULL);
+            bn.exact = exact;
+        }
+
+        /* Tell "auto" which radii to tune for */
+        if (!knn)
+            for (k = serve_addr ? 3 : 4; k < (unsigned) argc; ++k)
+                if (xatoul(argv[k]) <= MTREE_MAX_DISTANCE)
+                    radii[xatoul(argv[k])] = 1;
+
+        puts("Building tree...");
+        t0 = wallclock();
+        t = mtree_build(argv[0], keys, nkeys, maxlin, &opts);
+        if (!t)
+            err(1, "%s", argv[0]);
+        bn.build = wallclock() - t0;
+        printf("Time: %.3f sec\n", bn.build);
+        bn.tree_size = report_stats(t, opts.pack_leaves);
+        if (opts.shards)
+            printf("NUMA nodes: %u\n", mtree_numa_nodes(t));
+    }
+    bn.build_rss = peak_rss();
+    printf("Peak RSS: %ld kB\n", bn.build_rss);
+
+    if (outfile) {
+        printf("Saving %s...\n", outfile);
+        t0 = wallclock();
+        if (mtree_save(t, outfile))
+            err(1, "%s", outfile);
+        printf("Time: %.3f sec\n", wallclock() - t0);
+    }
+
+    if (nupdate) {
+        /* Remove existing keys and add new ones, in turn */
+        printf("Changing %lu keys...\n", nupdate);
+        if (mtree_dynamic(t))
+            err(1, "%s", name);
+        t0 = wallclock();
+        for (i = 0; i < nupdate; ++i) {
+            if (i & 1)
+                mtree_insert(t, mtree_rng_key(&rng));
+            else
+                mtree_remove(t, del[i / 2]);
         }
-        t = clock();
-        tm = t - ckref;
-        qc = (double) CLOCKS_PER_SEC * (double) nquery;
-        printf("Rate: %f query/sec\n", qc / tm);
-        printf("Time: %f msec/query\n", 1000.0 * tm / qc);
-        printf("Hits: %f\n", total / (double)nquery);
-        printf("Coverage: %f%%\n",
-               100.0 * (double)totalcmp / ((double)nkeys * nquery));
-        printf("Cmp/result: %f\n", (double)totalcmp / (double)total);
+        t0 = wallclock() - t0;
+        k = mtree_rebuilds(t);
+        free(del);
+        printf("Rate: %f change/sec\n", nupdate / t0);
+        printf("Rebuilds: %lu\n", k);
+        printf("Keys: %zu\n", mtree_nkeys(t));
+        nkeys = mtree_nkeys(t);
+    }
+
+    if (cache_mb) {
+        /* After the changes, since the cache can't see them */
+        if (mtree_cache(t, cache_mb << 20))
+            err(1, "cache");
+        bn.cache = 1;
+    }
+
+    if (serve_addr) {
+        srv = mtree_listen(t, serve_addr, &bo, batch, deadline);
+        if (!srv)
+            err(1, "%s", serve_addr);
+        printf("Listening on %s\n", serve_addr);
+        fflush(stdout);
+        mtree_serve(srv);
+    }
+
+    qs = xmalloc(sizeof(*qs) * nquery);
+    bn.name = infile || remote_addr ? mtree_name(t) : argv[0];
+    bn.t = t;
+    bn.qs = qs;
+    bn.nquery = nquery;
+    bn.nkeys = nkeys;
+    bn.maxlin = maxlin;
+    bn.bo = &bo;
+    if (!bn.exact)
+        bn.exact = t;
+    for (k = 4; k < (unsigned) argc; ++k) {
+        putchar('\n');
+        if (knn)
+            bench_knn(&bn, xatoul(argv[k]));
+        else
+            bench_radius(&bn, xatoul(argv[k]));
     }
+    if (bn.out)
+        fclose(bn.out);
+    free(qs);
+    free(queries);
+    mtree_free(exact);
+    mtree_free(t);
     return 0;
 }